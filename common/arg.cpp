@@ -2190,6 +2190,30 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"-ctkswa", "--cache-type-k-swa"}, "TYPE",
+        string_format(
+            "KV cache data type for K of the sliding-window attention layers\n"
+            "allowed values: %s\n"
+            "(default: same as --cache-type-k)",
+            get_all_kv_cache_types().c_str()
+        ),
+        [](common_params & params, const std::string & value) {
+            params.cache_type_k_swa = kv_cache_type_from_str(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_K_SWA"));
+    add_opt(common_arg(
+        {"-ctvswa", "--cache-type-v-swa"}, "TYPE",
+        string_format(
+            "KV cache data type for V of the sliding-window attention layers\n"
+            "allowed values: %s\n"
+            "(default: same as --cache-type-v)",
+            get_all_kv_cache_types().c_str()
+        ),
+        [](common_params & params, const std::string & value) {
+            params.cache_type_v_swa = kv_cache_type_from_str(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_V_SWA"));
     add_opt(common_arg(
         {"--hellaswag"},
         "compute HellaSwag score over random tasks from datafile supplied with -f",
@@ -2262,13 +2286,18 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
     ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
     add_opt(common_arg(
         {"-dt", "--defrag-thold"}, "N",
-        string_format("KV cache defragmentation threshold (DEPRECATED)"),
+        string_format("KV cache defragmentation threshold (default: %.1f, < 0 - disabled)", (double)params.defrag_thold),
         [](common_params & params, const std::string & value) {
-            GGML_UNUSED(params);
-            GGML_UNUSED(value);
-            LOG_WRN("DEPRECATED: --defrag-thold is deprecated and no longer necessary to specify\n");
+            params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-sink"}, "N",
+        string_format("when a sequence fills its context, keep its first N tokens and evict the oldest tokens after them (default: %d, < 0 - disabled)", params.n_sink),
+        [](common_params & params, int value) {
+            params.n_sink = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN}).set_env("LLAMA_ARG_KV_SINK"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2350,6 +2379,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mlock = true;
         }
     ).set_env("LLAMA_ARG_MLOCK"));
+    add_opt(common_arg(
+        {"--hugepages"},
+        "back the model weights in RAM with transparent huge pages to reduce TLB misses (Linux only)",
+        [](common_params & params) {
+            params.use_hugepages = true;
+        }
+    ).set_env("LLAMA_ARG_HUGEPAGES"));
     add_opt(common_arg(
         {"--no-mmap"},
         "do not memory-map model (slower load but may reduce pageouts if not using mlock)",
@@ -2994,6 +3030,25 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--slot-swap-path"}, "PATH",
+        "when an idle slot is reused for an unrelated prompt, swap its kv cache out to a file in PATH and swap it\n"
+        "back in when a later prompt continues it (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.slot_swap_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.slot_swap_path.empty() && params.slot_swap_path[params.slot_swap_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.slot_swap_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SWAP_PATH"));
+    add_opt(common_arg(
+        {"--slot-swap-size"}, "N",
+        string_format("max size of the swapped out slot kv caches in MiB, the oldest ones are dropped (default: %d)", params.slot_swap_size),
+        [](common_params & params, int value) {
+            params.slot_swap_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_SWAP_SIZE"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
@@ -1115,6 +1115,7 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.use_hugepages   = params.use_hugepages;
     mparams.check_tensors   = params.check_tensors;
     mparams.use_extra_bufts = !params.no_extra_bufts;
 
@@ -1157,6 +1158,8 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.yarn_beta_fast    = params.yarn_beta_fast;
     cparams.yarn_beta_slow    = params.yarn_beta_slow;
     cparams.yarn_orig_ctx     = params.yarn_orig_ctx;
+    cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_sink            = params.n_sink;
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.flash_attn_type   = params.flash_attn_type;
@@ -1171,6 +1174,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    cparams.type_k_swa = params.cache_type_k_swa;
+    cparams.type_v_swa = params.cache_type_v_swa;
+
     return cparams;
 }
 
@@ -1285,27 +1291,29 @@ std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
-    return common_tokenize(vocab, text, add_special, parse_special);
+    return common_tokenize(vocab, text, add_special, parse_special, n_threads);
 }
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + 2 * add_special;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    n_tokens = llama_tokenize_ext(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
     if (n_tokens == std::numeric_limits<int32_t>::min()) {
         throw std::runtime_error("Tokenization failed: input text too large, tokenization result exceeds int32_t limit");
     }
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        int check = llama_tokenize_ext(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
         GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
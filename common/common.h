@@ -291,6 +291,8 @@ struct common_params {
     float   yarn_beta_fast        = 32.0f; // YaRN low correction dim
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
+    float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t n_sink                =    -1; // number of sink tokens kept when evicting old tokens from a full sequence
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -384,6 +386,7 @@ struct common_params {
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool use_hugepages     = false; // back model weights with transparent huge pages
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool display_prompt    = true;  // print prompt before generation
     bool no_kv_offload     = false; // disable KV offloading
@@ -394,8 +397,10 @@ struct common_params {
 
     bool single_turn       = false; // single turn chat conversation
 
-    ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
-    ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
+    ggml_type cache_type_k     = GGML_TYPE_F16;   // KV cache data type for the K
+    ggml_type cache_type_v     = GGML_TYPE_F16;   // KV cache data type for the V
+    ggml_type cache_type_k_swa = GGML_TYPE_COUNT; // KV cache data type for the K of the SWA layers (COUNT = same as K)
+    ggml_type cache_type_v_swa = GGML_TYPE_COUNT; // KV cache data type for the V of the SWA layers (COUNT = same as V)
 
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
@@ -451,6 +456,8 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string slot_swap_path;        // swap the KV cache of idle slots to files in this directory
+    int32_t     slot_swap_size = 4096; // max size of the swapped out KV caches (MiB)
 
     float slot_prompt_similarity = 0.5f;
 
@@ -654,17 +661,20 @@ size_t common_lcs(const llama_tokens & a, const llama_tokens & b);
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// long texts are tokenized on up to n_threads threads (see llama_tokenize_ext)
 std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
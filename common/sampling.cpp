@@ -3,7 +3,15 @@
 #include "common.h"
 #include "log.h"
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <algorithm>
 
@@ -100,9 +108,167 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+// the first filter of the sampling chain, when nothing before it needs to see the whole vocab
+// it is applied directly to the raw logits, so that only the candidates that can survive it are materialized. the
+// selection is a superset of what the filter keeps - the chain still applies the filter itself
+struct common_sampler_prefilter {
+    int32_t top_k    = 0;    // keep (at least) the top_k largest logits
+    float   min_p    = 0.0f; // keep the logits with p_i >= min_p * p_max
+    float   temp     = 1.0f; // temperature applied before the min-p filter
+    size_t  min_keep = 0;
+
+    static common_sampler_prefilter from_params(const common_params_sampling & params) {
+        common_sampler_prefilter res;
+
+        if (!params.logit_bias.empty() || params.mirostat != 0) {
+            return res;
+        }
+
+        for (const auto & cnstr : params.samplers) {
+            switch (cnstr) {
+                case COMMON_SAMPLER_TYPE_PENALTIES:
+                    if (params.penalty_last_n != 0 && (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f)) {
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_DRY:
+                    if (params.dry_multiplier != 0.0f && params.dry_base >= 1.0f && params.dry_penalty_last_n != 0) {
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_TOP_N_SIGMA:
+                    if (params.top_n_sigma > 0.0f) {
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_TOP_K:
+                    if (params.top_k > 0) {
+                        res.top_k = params.top_k;
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_MIN_P:
+                    if (params.min_p > 0.0f) {
+                        res.min_p    = params.min_p;
+                        res.min_keep = params.min_keep;
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_TOP_P:
+                    // needs the normalization over the whole vocab
+                    if (params.top_p < 1.0f) {
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_TYPICAL_P:
+                    if (params.typ_p < 1.0f) {
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_XTC:
+                    if (params.xtc_probability > 0.0f && params.xtc_threshold <= 0.5f) {
+                        return res;
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_TEMPERATURE:
+                    if (params.dynatemp_range > 0.0f) {
+                        return res;
+                    }
+                    if (params.temp <= 0.0f) {
+                        // greedy - everything after it only sees the first largest logit
+                        res.top_k = 1;
+                        return res;
+                    }
+                    res.temp *= params.temp;
+                    break;
+                default:
+                    return res;
+            }
+        }
+
+        return res;
+    }
+
+    // select the candidates from the raw logits, returns false if the whole vocab is needed
+    bool apply(const float * logits, int n_vocab, std::vector<llama_token_data> & cur) {
+        if (top_k <= 0 && min_p <= 0.0f) {
+            return false;
+        }
+
+        if (top_k >= n_vocab/16) {
+            return false;
+        }
+
+        // the max of each block of logits - the blocks are independent, so this does not stall on a single chain of
+        // comparisons, and blocks with a max below the threshold are skipped during the selection
+        constexpr int block = 16;
+
+        const int n_blocks = (n_vocab + block - 1)/block;
+
+        block_max.resize(n_blocks);
+
+        for (int ib = 0; ib < n_blocks; ++ib) {
+            const int i0 = ib*block;
+            const int i1 = std::min(i0 + block, n_vocab);
+
+            float vmax = logits[i0];
+            for (int i = i0 + 1; i < i1; ++i) {
+                vmax = logits[i] > vmax ? logits[i] : vmax;
+            }
+            block_max[ib] = vmax;
+        }
+
+        float thold;
+
+        if (min_p > 0.0f) {
+            const float vmax = *std::max_element(block_max.begin(), block_max.end());
+
+            // the min-p filter compares the logits after the temperature, allow for the rounding
+            thold = vmax + temp*logf(min_p);
+            thold -= 1e-4f*std::max(1.0f, std::fabs(thold));
+        } else {
+            // at least top_k blocks have a max that is not below the top_k-th largest block max, so at least top_k
+            // logits are not below it either
+            block_tmp = block_max;
+            std::nth_element(block_tmp.begin(), block_tmp.begin() + top_k - 1, block_tmp.end(), std::greater<float>());
+
+            thold = block_tmp[top_k - 1];
+        }
+
+        cur.clear();
+
+        for (int ib = 0; ib < n_blocks; ++ib) {
+            if (block_max[ib] < thold) {
+                continue;
+            }
+
+            const int i0 = ib*block;
+            const int i1 = std::min(i0 + block, n_vocab);
+
+            for (int i = i0; i < i1; ++i) {
+                if (logits[i] >= thold) {
+                    cur.push_back(llama_token_data{i, logits[i], 0.0f});
+                }
+            }
+        }
+
+        if (min_p > 0.0f) {
+            return cur.size() >= std::max<size_t>(min_keep, 1);
+        }
+
+        return (int) cur.size() >= top_k;
+    }
+
+    // scratch buffers
+    std::vector<float> block_max;
+    std::vector<float> block_tmp;
+};
+
 struct common_sampler {
     common_params_sampling params;
 
+    common_sampler_prefilter prefilter;
+
     struct llama_sampler * grmr;
     struct llama_sampler * chain;
 
@@ -112,13 +278,22 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // background application of the grammar to the whole vocab, see common_sampler_prepare
+    std::vector<llama_token_data> grmr_cur;
+    std::future<void>             grmr_prepare;
 
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
+    void wait_prepare() {
+        if (grmr_prepare.valid()) {
+            grmr_prepare.get();
+        }
+    }
 
-        const int n_vocab = llama_vocab_n_tokens(vocab);
+    // with use_prefilter, only the candidates that pass the prefilter are materialized
+    void set_logits(const float * logits, int n_vocab, bool use_prefilter = false) {
+        if (use_prefilter && prefilter.apply(logits, n_vocab, cur)) {
+            cur_p = { cur.data(), cur.size(), -1, false };
+            return;
+        }
 
         cur.resize(n_vocab);
 
@@ -214,12 +389,15 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
     }
 
     auto * result = new common_sampler {
-        /* .params = */ params,
+        /* .params    = */ params,
+        /* .prefilter = */ common_sampler_prefilter::from_params(params),
         /* .grmr   = */ grmr,
         /* .chain  = */ llama_sampler_chain_init(lparams),
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
         /* .cur_p  = */ {},
+        /* .grmr_cur     = */ {},
+        /* .grmr_prepare = */ {},
     };
 
     llama_sampler_chain_add(result->chain,
@@ -289,6 +467,8 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
 
 void common_sampler_free(struct common_sampler * gsmpl) {
     if (gsmpl) {
+        gsmpl->wait_prepare();
+
         llama_sampler_free(gsmpl->grmr);
 
         llama_sampler_free(gsmpl->chain);
@@ -298,6 +478,8 @@ void common_sampler_free(struct common_sampler * gsmpl) {
 }
 
 void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, bool accept_grammar) {
+    gsmpl->wait_prepare();
+
     if (accept_grammar) {
         llama_sampler_accept(gsmpl->grmr, token);
     }
@@ -308,19 +490,26 @@ void common_sampler_accept(struct common_sampler * gsmpl, llama_token token, boo
 }
 
 void common_sampler_reset(struct common_sampler * gsmpl) {
+    gsmpl->wait_prepare();
+
     llama_sampler_reset(gsmpl->grmr);
 
     llama_sampler_reset(gsmpl->chain);
 }
 
 struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
+    gsmpl->wait_prepare();
+
     return new common_sampler {
-        /* .params = */ gsmpl->params,
+        /* .params    = */ gsmpl->params,
+        /* .prefilter = */ gsmpl->prefilter,
         /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
         /* .chain  = */ llama_sampler_clone(gsmpl->chain),
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+        /* .grmr_cur     = */ {},
+        /* .grmr_prepare = */ {},
     };
 }
 
@@ -335,8 +524,13 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+// sample from the logits of one output, see common_sampler_sample
+// does not touch the context, so that different samplers can run on different threads
+static llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first) {
+    gsmpl->wait_prepare();
+
+    // the grammar has to see all tokens first, otherwise the chain filters the candidates before the grammar check
+    gsmpl->set_logits(logits, n_vocab, !grammar_first);
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -371,7 +565,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(logits, n_vocab);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -381,6 +575,207 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    const float * logits = llama_get_logits_ith(ctx, idx);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    return common_sampler_sample_logits(gsmpl, logits, n_vocab, grammar_first);
+}
+
+struct common_sampler_pool {
+    common_sampler_pool(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back([this]() { loop(); });
+        }
+    }
+
+    ~common_sampler_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+
+        cv_start.notify_all();
+
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    bool has_workers() const {
+        return !workers.empty();
+    }
+
+    // run fn on one of the workers in the background - the workers run these before the next job of run()
+    void submit(std::function<void()> fn) {
+        GGML_ASSERT(!workers.empty());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(fn));
+        }
+
+        cv_start.notify_one();
+    }
+
+    // run fn on all threads of the pool, including the calling one, and wait for all of them to return
+    void run(const std::function<void()> & fn) {
+        if (workers.empty()) {
+            fn();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job    = &fn;
+            n_busy = workers.size();
+            n_job++;
+        }
+
+        cv_start.notify_all();
+
+        fn();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() { return n_busy == 0; });
+
+        job = nullptr;
+    }
+
+private:
+    void loop() {
+        uint64_t n_seen = 0;
+
+        while (true) {
+            std::function<void()>         task;
+            const std::function<void()> * fn = nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_start.wait(lock, [&]() { return stop || !tasks.empty() || n_job != n_seen; });
+
+                // the submitted tasks go first, also when stopping, as the jobs of run() may wait for them
+                if (!tasks.empty()) {
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                } else if (stop) {
+                    return;
+                } else {
+                    n_seen = n_job;
+                    fn     = job;
+                }
+            }
+
+            if (task) {
+                task();
+                continue;
+            }
+
+            (*fn)();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--n_busy == 0) {
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    const std::function<void()> * job = nullptr;
+
+    std::deque<std::function<void()>> tasks;
+
+    uint64_t n_job  = 0;
+    size_t   n_busy = 0;
+    bool     stop   = false;
+};
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads) {
+    return new common_sampler_pool(std::max(1, n_threads));
+}
+
+void common_sampler_pool_free(struct common_sampler_pool * pool) {
+    delete pool;
+}
+
+void common_sampler_prepare(struct common_sampler * gsmpl, struct llama_context * ctx, struct common_sampler_pool * pool) {
+    gsmpl->wait_prepare();
+
+    if (pool == nullptr || !pool->has_workers() || gsmpl->params.grammar.empty()) {
+        return;
+    }
+
+    // a lazy grammar leaves the candidates as they are until it is triggered
+    if (llama_sampler_grammar_awaiting_trigger(gsmpl->grmr)) {
+        return;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    // the grammar sampler remembers the allowed tokens of the state, so that the next application of the grammar
+    // (to the sampled token or to all candidates) is a lookup
+    auto task = std::make_shared<std::packaged_task<void()>>([gsmpl, n_vocab]() {
+        auto & cur = gsmpl->grmr_cur;
+
+        cur.resize(n_vocab);
+
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, 0.0f, 0.0f};
+        }
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+        llama_sampler_apply(gsmpl->grmr, &cur_p);
+    });
+
+    gsmpl->grmr_prepare = task->get_future();
+
+    pool->submit([task]() { (*task)(); });
+}
+
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, struct common_sampler_pool * pool, bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size() && "gsmpls.size() must be idxs.size()");
+
+    const int n = gsmpls.size();
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    // the logits are fetched on this thread, as this synchronizes the context and reorders the outputs
+    std::vector<const float *> logits(n);
+    for (int i = 0; i < n; ++i) {
+        logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n);
+
+    // the samplers take very different times (e.g. with and without a grammar), so the threads pick them one by one
+    std::atomic<int> next { 0 };
+
+    const std::function<void()> worker = [&]() {
+        for (int i = next++; i < n; i = next++) {
+            result[i] = common_sampler_sample_logits(gsmpls[i], logits[i], n_vocab, grammar_first);
+        }
+    };
+
+    if (pool == nullptr || n < 2) {
+        worker();
+    } else {
+        pool->run(worker);
+    }
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -424,6 +819,14 @@ uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
 
+llama_token_data_array * common_sampler_apply_chain_testing(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool use_prefilter) {
+    gsmpl->set_logits(logits, n_vocab, use_prefilter);
+
+    llama_sampler_apply(gsmpl->chain, &gsmpl->cur_p);
+
+    return &gsmpl->cur_p;
+}
+
 // helpers
 
 llama_token_data_array * common_sampler_get_candidates(struct common_sampler * gsmpl, bool do_sort) {
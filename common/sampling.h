@@ -60,6 +60,32 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// a pool of threads for common_sampler_sample_batch, kept alive between the calls
+// the calling thread is one of the n_threads
+struct common_sampler_pool;
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads);
+
+void common_sampler_pool_free(struct common_sampler_pool * pool);
+
+// start applying the grammar (if any) to the whole vocab for the next token on a thread of the pool
+// call it after accepting a token and before llama_decode, so that the grammar masking overlaps with the computation
+// of the logits - the grammar remembers the result and the next common_sampler call waits for it to finish
+// does nothing without a pool with at least 2 threads, or while a lazy grammar has not been triggered
+void common_sampler_prepare(struct common_sampler * gsmpl, struct llama_context * ctx, struct common_sampler_pool * pool);
+
+// sample the outputs of several sequences at once, e.g. all slots of a decoded batch
+// gsmpls[i] samples from the logits at idxs[i] - the samplers must be distinct and are processed on the threads of the pool
+// without a pool, the samplers are processed on the calling thread
+//
+//      common_sampler_sample_batch({ gsmpl }, ctx, { idx }, nullptr);
+//
+// is equivalent to
+//
+//      common_sampler_sample(gsmpl, ctx, idx);
+//
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, struct common_sampler_pool * pool, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
@@ -83,6 +109,10 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
 
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
+// apply the sampling chain to the logits, with or without selecting the candidates with the prefilter first
+// only for testing - the prefilter must not change the result of the chain
+llama_token_data_array * common_sampler_apply_chain_testing(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool use_prefilter);
+
 // helpers
 
 // access the internal list of current candidate tokens
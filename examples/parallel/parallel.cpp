@@ -239,6 +239,9 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // threads for sampling the clients of a decoded batch in parallel
+    common_sampler_pool * smpl_pool = common_sampler_pool_init(std::min(n_clients, params.cpuparams.n_threads));
+
     std::vector<llama_token> tokens_system;
 
     tokens_system = common_tokenize(ctx, k_system, true);
@@ -425,6 +428,30 @@ int main(int argc, char ** argv) {
             // on successful decode, restore the original batch size
             n_batch = params.n_batch;
 
+            // sample all clients in this part of the batch at once
+            std::vector<llama_token> sampled(clients.size(), LLAMA_TOKEN_NULL);
+            {
+                std::vector<common_sampler *> smpls;
+                std::vector<int>              idxs;
+                std::vector<int>              ids;
+
+                for (const auto & client : clients) {
+                    if (client.i_batch < (int) i || client.i_batch >= (int) (i + n_tokens)) {
+                        continue;
+                    }
+
+                    smpls.push_back(client.smpl);
+                    idxs.push_back(client.i_batch - i);
+                    ids.push_back(client.id);
+                }
+
+                const auto tokens = common_sampler_sample_batch(smpls, ctx, idxs, smpl_pool);
+
+                for (size_t k = 0; k < ids.size(); ++k) {
+                    sampled[ids[k]] = tokens[k];
+                }
+            }
+
             for (auto & client : clients) {
                 if (client.i_batch < (int) i || client.i_batch >= (int) (i + n_tokens)) {
                     continue;
@@ -433,7 +460,7 @@ int main(int argc, char ** argv) {
                 //printf("client %d, seq %d, token %d, pos %d, batch %d\n",
                 //        client.id, client.seq_id, client.sampled, client.n_decoded, client.i_batch);
 
-                const llama_token id = common_sampler_sample(client.smpl, ctx, client.i_batch - i);
+                const llama_token id = sampled[client.id];
 
                 common_sampler_accept(client.smpl, id, true);
 
@@ -507,6 +534,8 @@ int main(int argc, char ** argv) {
     // TODO: print sampling/grammar timings for all clients
     llama_perf_context_print(ctx);
 
+    common_sampler_pool_free(smpl_pool);
+
     llama_batch_free(batch);
 
     llama_backend_free();
@@ -540,6 +540,68 @@ static inline __m128i get_scale_shuffle(int i) {
 }
 #endif
 
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+// the K-quant dot products below process 2 rows x 2 columns at once (nrc == 2) when VNNI is available
+// this lets mul_mat reuse each unpacked weight vector for two activation columns during prompt processing
+
+// multiply uint8_t with int8_t, add results in groups of 4 and return as int32 vector
+static inline __m256i mul_sum_us8_quads_int32(const __m256i ax, const __m256i sy) {
+    const __m256i zero = _mm256_setzero_si256();
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    return _mm256_dpbusd_epi32(zero, ax, sy);
+#else
+    return _mm256_dpbusd_avx_epi32(zero, ax, sy);
+#endif
+}
+
+static inline int64_t rep4_i16(int s) {
+    return (int64_t) ((uint64_t) (uint16_t) s * 0x0001000100010001ULL);
+}
+
+// apply 16-bit sub-block scales to two int32 dot vectors produced by mul_sum_us8_quads_int32
+// the scales are given per 128-bit lane: a_lo/a_hi for the dot products of a, b_lo/b_hi for those of b
+// the group sums must fit in int16, which holds for quants of up to 6 bits
+static inline __m256i scale_quads_int32(const __m256i a, const __m256i b, int a_lo, int a_hi, int b_lo, int b_hi) {
+    const __m256i scales = _mm256_set_epi64x(rep4_i16(b_hi), rep4_i16(a_hi), rep4_i16(b_lo), rep4_i16(a_lo));
+    return _mm256_madd_epi16(_mm256_packs_epi32(a, b), scales);
+}
+
+// horizontally add 4 int32 vectors and return the 4 sums
+static inline __m128i hsum_i32_8x4(const __m256i a, const __m256i b, const __m256i c, const __m256i d) {
+    const __m256i ab   = _mm256_hadd_epi32(a, b);
+    const __m256i cd   = _mm256_hadd_epi32(c, d);
+    const __m256i abcd = _mm256_hadd_epi32(ab, cd);
+    return _mm_add_epi32(_mm256_castsi256_si128(abcd), _mm256_extracti128_si256(abcd, 1));
+}
+
+// store the results of a 2x2 dot product, v = { x0*y0, x0*y1, x1*y0, x1*y1 }
+static inline void store_2x2_float(float * GGML_RESTRICT s, size_t bs, const __m128 v) {
+    _mm_storel_pi((__m64 *) s,        _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 2, 0)));
+    _mm_storel_pi((__m64 *) (s + bs), _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 0, 3, 1)));
+}
+
+// unpack the 6-bit scales and mins of a q4_K/q5_K block: bytes 0..7 of utmp are the scales, bytes 8..15 the mins
+static inline void unpack_scales_mins_k4(const uint8_t * GGML_RESTRICT scales, uint32_t * GGML_RESTRICT utmp) {
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    memcpy(utmp, scales, 12);
+    utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+    const uint32_t uaux = utmp[1] & kmask1;
+    utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+    utmp[2] = uaux;
+    utmp[0] &= kmask1;
+}
+
+// sum of the q8_K block sums weighted by the q4_K/q5_K mins of each sub-block
+static inline __m128i mul_mins_bsums_k4(const uint32_t * GGML_RESTRICT utmp, const int16_t * GGML_RESTRICT bsums) {
+    const __m128i mins = _mm_cvtepu8_epi16(_mm_set_epi32(0, 0, utmp[3], utmp[2]));
+    const __m128i q8s  = _mm_hadd_epi16(_mm_loadu_si128((const __m128i *) bsums), _mm_loadu_si128((const __m128i *) bsums + 1));
+    return _mm_madd_epi16(mins, q8s);
+}
+#endif
+
 void ggml_vec_dot_q4_0_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -1740,7 +1802,11 @@ void ggml_vec_dot_q3_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
 
 void ggml_vec_dot_q4_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc) {
     assert(n % QK_K == 0);
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    assert((nrc == 2) || (nrc == 1));
+#else
     assert(nrc == 1);
+#endif
     UNUSED(nrc);
     UNUSED(bx);
     UNUSED(by);
@@ -1757,6 +1823,80 @@ void ggml_vec_dot_q4_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
 
     uint32_t utmp[4];
 
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    if (nrc == 2) {
+        const block_q4_K * GGML_RESTRICT x0 = x;
+        const block_q4_K * GGML_RESTRICT x1 = (const block_q4_K *) ((const uint8_t *)vx + bx);
+        const block_q8_K * GGML_RESTRICT y0 = y;
+        const block_q8_K * GGML_RESTRICT y1 = (const block_q8_K *) ((const uint8_t *)vy + by);
+
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+
+        __m128 acc = _mm_setzero_ps();
+
+        for (int i = 0; i < nb; ++i) {
+            const float dx0 = GGML_CPU_FP16_TO_FP32(x0[i].d);
+            const float dx1 = GGML_CPU_FP16_TO_FP32(x1[i].d);
+            const float mx0 = GGML_CPU_FP16_TO_FP32(x0[i].dmin);
+            const float mx1 = GGML_CPU_FP16_TO_FP32(x1[i].dmin);
+
+            const __m128 d    = _mm_set_ps( dx1*y1[i].d,  dx1*y0[i].d,  dx0*y1[i].d,  dx0*y0[i].d);
+            const __m128 dmin = _mm_set_ps(-mx1*y1[i].d, -mx1*y0[i].d, -mx0*y1[i].d, -mx0*y0[i].d);
+
+            uint32_t utmp0[4];
+            uint32_t utmp1[4];
+            unpack_scales_mins_k4(x0[i].scales, utmp0);
+            unpack_scales_mins_k4(x1[i].scales, utmp1);
+
+            const __m128i summ = _mm_hadd_epi32(
+                    _mm_hadd_epi32(mul_mins_bsums_k4(utmp0, y0[i].bsums), mul_mins_bsums_k4(utmp0, y1[i].bsums)),
+                    _mm_hadd_epi32(mul_mins_bsums_k4(utmp1, y0[i].bsums), mul_mins_bsums_k4(utmp1, y1[i].bsums)));
+
+            const uint8_t * GGML_RESTRICT sc0 = (const uint8_t *) utmp0;
+            const uint8_t * GGML_RESTRICT sc1 = (const uint8_t *) utmp1;
+
+            __m256i sumi_00 = _mm256_setzero_si256();
+            __m256i sumi_01 = _mm256_setzero_si256();
+            __m256i sumi_10 = _mm256_setzero_si256();
+            __m256i sumi_11 = _mm256_setzero_si256();
+
+            for (int j = 0; j < QK_K/64; ++j) {
+                const __m256i q4bits0 = _mm256_loadu_si256((const __m256i *) (x0[i].qs + 32*j));
+                const __m256i q4bits1 = _mm256_loadu_si256((const __m256i *) (x1[i].qs + 32*j));
+
+                const __m256i q4l0 = _mm256_and_si256(q4bits0, m4);
+                const __m256i q4h0 = _mm256_and_si256(_mm256_srli_epi16(q4bits0, 4), m4);
+                const __m256i q4l1 = _mm256_and_si256(q4bits1, m4);
+                const __m256i q4h1 = _mm256_and_si256(_mm256_srli_epi16(q4bits1, 4), m4);
+
+                const __m256i q8l0 = _mm256_loadu_si256((const __m256i *) (y0[i].qs + 64*j));
+                const __m256i q8h0 = _mm256_loadu_si256((const __m256i *) (y0[i].qs + 64*j + 32));
+                const __m256i q8l1 = _mm256_loadu_si256((const __m256i *) (y1[i].qs + 64*j));
+                const __m256i q8h1 = _mm256_loadu_si256((const __m256i *) (y1[i].qs + 64*j + 32));
+
+                const int sl0 = sc0[2*j+0];
+                const int sh0 = sc0[2*j+1];
+                const int sl1 = sc1[2*j+0];
+                const int sh1 = sc1[2*j+1];
+
+                sumi_00 = _mm256_add_epi32(sumi_00, scale_quads_int32(mul_sum_us8_quads_int32(q4l0, q8l0), mul_sum_us8_quads_int32(q4h0, q8h0), sl0, sl0, sh0, sh0));
+                sumi_01 = _mm256_add_epi32(sumi_01, scale_quads_int32(mul_sum_us8_quads_int32(q4l0, q8l1), mul_sum_us8_quads_int32(q4h0, q8h1), sl0, sl0, sh0, sh0));
+                sumi_10 = _mm256_add_epi32(sumi_10, scale_quads_int32(mul_sum_us8_quads_int32(q4l1, q8l0), mul_sum_us8_quads_int32(q4h1, q8h0), sl1, sl1, sh1, sh1));
+                sumi_11 = _mm256_add_epi32(sumi_11, scale_quads_int32(mul_sum_us8_quads_int32(q4l1, q8l1), mul_sum_us8_quads_int32(q4h1, q8h1), sl1, sl1, sh1, sh1));
+            }
+
+            const __m128i sumi = hsum_i32_8x4(sumi_00, sumi_01, sumi_10, sumi_11);
+
+            acc = _mm_fmadd_ps(d,    _mm_cvtepi32_ps(sumi), acc);
+            acc = _mm_fmadd_ps(dmin, _mm_cvtepi32_ps(summ), acc);
+        }
+
+        store_2x2_float(s, bs, acc);
+
+        return;
+    }
+#endif
+
 #if defined __AVX2__
 
     const __m256i m4 = _mm256_set1_epi8(0xF);
@@ -1918,7 +2058,11 @@ void ggml_vec_dot_q4_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
 
 void ggml_vec_dot_q5_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy,  size_t by, int nrc) {
     assert(n % QK_K == 0);
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    assert((nrc == 2) || (nrc == 1));
+#else
     assert(nrc == 1);
+#endif
     UNUSED(nrc);
     UNUSED(bx);
     UNUSED(by);
@@ -1935,6 +2079,88 @@ void ggml_vec_dot_q5_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
 
     uint32_t utmp[4];
 
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    if (nrc == 2) {
+        const block_q5_K * GGML_RESTRICT x0 = x;
+        const block_q5_K * GGML_RESTRICT x1 = (const block_q5_K *) ((const uint8_t *)vx + bx);
+        const block_q8_K * GGML_RESTRICT y0 = y;
+        const block_q8_K * GGML_RESTRICT y1 = (const block_q8_K *) ((const uint8_t *)vy + by);
+
+        const __m256i m4  = _mm256_set1_epi8(0xF);
+        const __m256i m16 = _mm256_set1_epi8(0x10);
+
+        __m128 acc = _mm_setzero_ps();
+
+        for (int i = 0; i < nb; ++i) {
+            const float dx0 = GGML_CPU_FP16_TO_FP32(x0[i].d);
+            const float dx1 = GGML_CPU_FP16_TO_FP32(x1[i].d);
+            const float mx0 = GGML_CPU_FP16_TO_FP32(x0[i].dmin);
+            const float mx1 = GGML_CPU_FP16_TO_FP32(x1[i].dmin);
+
+            const __m128 d    = _mm_set_ps( dx1*y1[i].d,  dx1*y0[i].d,  dx0*y1[i].d,  dx0*y0[i].d);
+            const __m128 dmin = _mm_set_ps(-mx1*y1[i].d, -mx1*y0[i].d, -mx0*y1[i].d, -mx0*y0[i].d);
+
+            uint32_t utmp0[4];
+            uint32_t utmp1[4];
+            unpack_scales_mins_k4(x0[i].scales, utmp0);
+            unpack_scales_mins_k4(x1[i].scales, utmp1);
+
+            const __m128i summ = _mm_hadd_epi32(
+                    _mm_hadd_epi32(mul_mins_bsums_k4(utmp0, y0[i].bsums), mul_mins_bsums_k4(utmp0, y1[i].bsums)),
+                    _mm_hadd_epi32(mul_mins_bsums_k4(utmp1, y0[i].bsums), mul_mins_bsums_k4(utmp1, y1[i].bsums)));
+
+            const uint8_t * GGML_RESTRICT sc0 = (const uint8_t *) utmp0;
+            const uint8_t * GGML_RESTRICT sc1 = (const uint8_t *) utmp1;
+
+            const __m256i hbits0 = _mm256_loadu_si256((const __m256i *) x0[i].qh);
+            const __m256i hbits1 = _mm256_loadu_si256((const __m256i *) x1[i].qh);
+
+            __m256i sumi_00 = _mm256_setzero_si256();
+            __m256i sumi_01 = _mm256_setzero_si256();
+            __m256i sumi_10 = _mm256_setzero_si256();
+            __m256i sumi_11 = _mm256_setzero_si256();
+
+            for (int j = 0; j < QK_K/64; ++j) {
+                const __m256i q5bits0 = _mm256_loadu_si256((const __m256i *) (x0[i].qs + 32*j));
+                const __m256i q5bits1 = _mm256_loadu_si256((const __m256i *) (x1[i].qs + 32*j));
+
+                const __m256i q5l0 = _mm256_or_si256(_mm256_and_si256(q5bits0, m4),
+                                                     _mm256_and_si256(_mm256_slli_epi16(_mm256_srli_epi16(hbits0, 2*j+0), 4), m16));
+                const __m256i q5h0 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q5bits0, 4), m4),
+                                                     _mm256_and_si256(_mm256_slli_epi16(_mm256_srli_epi16(hbits0, 2*j+1), 4), m16));
+                const __m256i q5l1 = _mm256_or_si256(_mm256_and_si256(q5bits1, m4),
+                                                     _mm256_and_si256(_mm256_slli_epi16(_mm256_srli_epi16(hbits1, 2*j+0), 4), m16));
+                const __m256i q5h1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q5bits1, 4), m4),
+                                                     _mm256_and_si256(_mm256_slli_epi16(_mm256_srli_epi16(hbits1, 2*j+1), 4), m16));
+
+                const __m256i q8l0 = _mm256_loadu_si256((const __m256i *) (y0[i].qs + 64*j));
+                const __m256i q8h0 = _mm256_loadu_si256((const __m256i *) (y0[i].qs + 64*j + 32));
+                const __m256i q8l1 = _mm256_loadu_si256((const __m256i *) (y1[i].qs + 64*j));
+                const __m256i q8h1 = _mm256_loadu_si256((const __m256i *) (y1[i].qs + 64*j + 32));
+
+                const int sl0 = sc0[2*j+0];
+                const int sh0 = sc0[2*j+1];
+                const int sl1 = sc1[2*j+0];
+                const int sh1 = sc1[2*j+1];
+
+                sumi_00 = _mm256_add_epi32(sumi_00, scale_quads_int32(mul_sum_us8_quads_int32(q5l0, q8l0), mul_sum_us8_quads_int32(q5h0, q8h0), sl0, sl0, sh0, sh0));
+                sumi_01 = _mm256_add_epi32(sumi_01, scale_quads_int32(mul_sum_us8_quads_int32(q5l0, q8l1), mul_sum_us8_quads_int32(q5h0, q8h1), sl0, sl0, sh0, sh0));
+                sumi_10 = _mm256_add_epi32(sumi_10, scale_quads_int32(mul_sum_us8_quads_int32(q5l1, q8l0), mul_sum_us8_quads_int32(q5h1, q8h0), sl1, sl1, sh1, sh1));
+                sumi_11 = _mm256_add_epi32(sumi_11, scale_quads_int32(mul_sum_us8_quads_int32(q5l1, q8l1), mul_sum_us8_quads_int32(q5h1, q8h1), sl1, sl1, sh1, sh1));
+            }
+
+            const __m128i sumi = hsum_i32_8x4(sumi_00, sumi_01, sumi_10, sumi_11);
+
+            acc = _mm_fmadd_ps(d,    _mm_cvtepi32_ps(sumi), acc);
+            acc = _mm_fmadd_ps(dmin, _mm_cvtepi32_ps(summ), acc);
+        }
+
+        store_2x2_float(s, bs, acc);
+
+        return;
+    }
+#endif
+
 #if defined __AVX2__
 
     const __m256i m4 = _mm256_set1_epi8(0xF);
@@ -2128,7 +2354,11 @@ void ggml_vec_dot_q5_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
 
 void ggml_vec_dot_q6_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc) {
     assert(n % QK_K == 0);
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    assert((nrc == 2) || (nrc == 1));
+#else
     assert(nrc == 1);
+#endif
     UNUSED(nrc);
     UNUSED(bx);
     UNUSED(by);
@@ -2139,6 +2369,87 @@ void ggml_vec_dot_q6_K_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const voi
 
     const int nb = n / QK_K;
 
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    if (nrc == 2) {
+        const block_q6_K * GGML_RESTRICT x0 = x;
+        const block_q6_K * GGML_RESTRICT x1 = (const block_q6_K *) ((const uint8_t *)vx + bx);
+        const block_q8_K * GGML_RESTRICT y0 = y;
+        const block_q8_K * GGML_RESTRICT y1 = (const block_q8_K *) ((const uint8_t *)vy + by);
+
+        const __m256i m4 = _mm256_set1_epi8(0xF);
+        const __m256i m2 = _mm256_set1_epi8(3);
+
+        __m128 acc = _mm_setzero_ps();
+
+        for (int i = 0; i < nb; ++i) {
+            const float dx0 = GGML_CPU_FP16_TO_FP32(x0[i].d);
+            const float dx1 = GGML_CPU_FP16_TO_FP32(x1[i].d);
+
+            const __m128 d = _mm_set_ps(dx1*y1[i].d, dx1*y0[i].d, dx0*y1[i].d, dx0*y0[i].d);
+
+            const int8_t * GGML_RESTRICT sc0 = x0[i].scales;
+            const int8_t * GGML_RESTRICT sc1 = x1[i].scales;
+
+            __m256i sumi_00 = _mm256_setzero_si256();
+            __m256i sumi_01 = _mm256_setzero_si256();
+            __m256i sumi_10 = _mm256_setzero_si256();
+            __m256i sumi_11 = _mm256_setzero_si256();
+
+            for (int j = 0; j < QK_K/128; ++j) {
+                __m256i q6_0[4];
+                __m256i q6_1[4];
+
+                for (int r = 0; r < 2; ++r) {
+                    const block_q6_K * GGML_RESTRICT xr = r == 0 ? &x0[i] : &x1[i];
+                    __m256i * q6 = r == 0 ? q6_0 : q6_1;
+
+                    const __m256i q4bits1 = _mm256_loadu_si256((const __m256i *) (xr->ql + 64*j));
+                    const __m256i q4bits2 = _mm256_loadu_si256((const __m256i *) (xr->ql + 64*j + 32));
+                    const __m256i q4bitsH = _mm256_loadu_si256((const __m256i *) (xr->qh + 32*j));
+
+                    q6[0] = _mm256_or_si256(_mm256_and_si256(q4bits1, m4), _mm256_slli_epi16(_mm256_and_si256(q4bitsH, m2), 4));
+                    q6[1] = _mm256_or_si256(_mm256_and_si256(q4bits2, m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 2), m2), 4));
+                    q6[2] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits1, 4), m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 4), m2), 4));
+                    q6[3] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits2, 4), m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 6), m2), 4));
+                }
+
+                // the quants are kept unsigned here, the -32 offset is applied below using the block sums
+                for (int k = 0; k < 4; k += 2) {
+                    const int is = 8*j + 2*k;
+
+                    const __m256i q8a0 = _mm256_loadu_si256((const __m256i *) (y0[i].qs + 128*j + 32*k));
+                    const __m256i q8b0 = _mm256_loadu_si256((const __m256i *) (y0[i].qs + 128*j + 32*k + 32));
+                    const __m256i q8a1 = _mm256_loadu_si256((const __m256i *) (y1[i].qs + 128*j + 32*k));
+                    const __m256i q8b1 = _mm256_loadu_si256((const __m256i *) (y1[i].qs + 128*j + 32*k + 32));
+
+                    sumi_00 = _mm256_add_epi32(sumi_00, scale_quads_int32(mul_sum_us8_quads_int32(q6_0[k], q8a0), mul_sum_us8_quads_int32(q6_0[k+1], q8b0), sc0[is+0], sc0[is+1], sc0[is+2], sc0[is+3]));
+                    sumi_01 = _mm256_add_epi32(sumi_01, scale_quads_int32(mul_sum_us8_quads_int32(q6_0[k], q8a1), mul_sum_us8_quads_int32(q6_0[k+1], q8b1), sc0[is+0], sc0[is+1], sc0[is+2], sc0[is+3]));
+                    sumi_10 = _mm256_add_epi32(sumi_10, scale_quads_int32(mul_sum_us8_quads_int32(q6_1[k], q8a0), mul_sum_us8_quads_int32(q6_1[k+1], q8b0), sc1[is+0], sc1[is+1], sc1[is+2], sc1[is+3]));
+                    sumi_11 = _mm256_add_epi32(sumi_11, scale_quads_int32(mul_sum_us8_quads_int32(q6_1[k], q8a1), mul_sum_us8_quads_int32(q6_1[k+1], q8b1), sc1[is+0], sc1[is+1], sc1[is+2], sc1[is+3]));
+                }
+            }
+
+            const __m256i scales0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) sc0));
+            const __m256i scales1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) sc1));
+            const __m256i bsums0  = _mm256_loadu_si256((const __m256i *) y0[i].bsums);
+            const __m256i bsums1  = _mm256_loadu_si256((const __m256i *) y1[i].bsums);
+
+            sumi_00 = _mm256_sub_epi32(sumi_00, _mm256_slli_epi32(_mm256_madd_epi16(scales0, bsums0), 5));
+            sumi_01 = _mm256_sub_epi32(sumi_01, _mm256_slli_epi32(_mm256_madd_epi16(scales0, bsums1), 5));
+            sumi_10 = _mm256_sub_epi32(sumi_10, _mm256_slli_epi32(_mm256_madd_epi16(scales1, bsums0), 5));
+            sumi_11 = _mm256_sub_epi32(sumi_11, _mm256_slli_epi32(_mm256_madd_epi16(scales1, bsums1), 5));
+
+            const __m128i sumi = hsum_i32_8x4(sumi_00, sumi_01, sumi_10, sumi_11);
+
+            acc = _mm_fmadd_ps(d, _mm_cvtepi32_ps(sumi), acc);
+        }
+
+        store_2x2_float(s, bs, acc);
+
+        return;
+    }
+#endif
+
 #if defined __AVX2__
 
     const __m256i m4 = _mm256_set1_epi8(0xF);
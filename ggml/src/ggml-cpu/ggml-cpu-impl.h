@@ -514,6 +514,13 @@ static __m256 __lasx_xvreplfr2vr_s(const float val) {
 }
 #endif
 
+// prefetch the memory at address p into the cache for reading
+#if defined(__GNUC__) || defined(__clang__)
+#define GGML_PREFETCH(p) __builtin_prefetch((p), 0, 3)
+#else
+#define GGML_PREFETCH(p) ((void) (p))
+#endif
+
 // TODO: move to ggml-threading
 void ggml_barrier(struct ggml_threadpool * tp);
 
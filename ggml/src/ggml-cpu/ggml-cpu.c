@@ -275,7 +275,7 @@ static const struct ggml_type_traits_cpu type_traits_cpu[GGML_TYPE_COUNT] = {
         .from_float               = quantize_row_q4_K,
         .vec_dot                  = ggml_vec_dot_q4_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
-#if defined (__ARM_FEATURE_MATMUL_INT8)
+#if defined (__ARM_FEATURE_MATMUL_INT8) || (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
         .nrows                    = 2,
 #else
         .nrows                    = 1,
@@ -285,13 +285,17 @@ static const struct ggml_type_traits_cpu type_traits_cpu[GGML_TYPE_COUNT] = {
         .from_float               = quantize_row_q5_K,
         .vec_dot                  = ggml_vec_dot_q5_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+        .nrows                    = 2,
+#else
         .nrows                    = 1,
+#endif
     },
     [GGML_TYPE_Q6_K] = {
         .from_float               = quantize_row_q6_K,
         .vec_dot                  = ggml_vec_dot_q6_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
-#if defined (__ARM_FEATURE_MATMUL_INT8)
+#if defined (__ARM_FEATURE_MATMUL_INT8) || (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
         .nrows                    = 2,
 #else
         .nrows                    = 1,
@@ -1188,6 +1192,12 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 //}
 
                 for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir0_end; ir0 += num_rows_per_vec_dot) {
+                    // the hardware prefetcher stops at page boundaries - start the rows of the next block early
+                    if (ir1 == iir1 && ir0 + blck_0 < ir0_end) {
+                        for (int64_t ip = 0; ip < num_rows_per_vec_dot; ++ip) {
+                            GGML_PREFETCH(src0_row + (ir0 + blck_0 + ip) * nb01);
+                        }
+                    }
                     vec_dot(ne00, &tmp[ir0 - iir0], (num_rows_per_vec_dot > 1 ? 16 : 0), src0_row + ir0 * nb01, (num_rows_per_vec_dot > 1 ? nb01 : 0), src1_col, (num_rows_per_vec_dot > 1 ? src1_col_stride : 0), num_rows_per_vec_dot);
                 }
 
@@ -1465,6 +1475,108 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
     }
 }
 
+// expert-parallel mul_mat_id
+//
+// during token generation each selected expert only gets a few rows of src1. splitting every expert across all
+// threads makes each thread touch the weights of all selected experts and pay for a chunk counter per expert.
+// instead, the rows of the selected experts are concatenated and split into contiguous ranges, so each thread
+// works on one or two experts and streams their weights without any synchronization
+
+// max number of src1 rows per expert for which the expert-parallel path is used
+#define GGML_MMID_EXPERT_PARALLEL_MAX_ROWS 4
+
+// the ranges of the threads are aligned to this number of rows, so the threads do not share dst cache lines
+#define GGML_MMID_EXPERT_PARALLEL_BLCK 16
+
+// number of bytes of the next expert's weights to prefetch before starting on the current one
+#define GGML_MMID_EXPERT_PARALLEL_PREFETCH 4096
+
+static bool ggml_compute_forward_mul_mat_id_use_expert_parallel(const int64_t * matrix_row_counts, int n_as) {
+    int64_t max_rows = 0;
+    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+        max_rows = MAX(max_rows, matrix_row_counts[cur_a]);
+    }
+
+    return max_rows > 0 && max_rows <= GGML_MMID_EXPERT_PARALLEL_MAX_ROWS;
+}
+
+static void ggml_compute_forward_mul_mat_id_expert_parallel(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst,
+        const int64_t * matrix_row_counts,
+        const struct mmid_row_mapping * matrix_rows) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * ids  = dst->src[2];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
+
+    const bool   src1_cont = ggml_is_contiguous(src1);
+    const void * wdata     = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size  = ggml_row_size(vec_dot_type, ne10);
+
+    const int n_as = ne02;
+
+    int n_active = 0;
+    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+        n_active += matrix_row_counts[cur_a] > 0;
+    }
+
+    const int64_t nblk_expert = (ne01 + GGML_MMID_EXPERT_PARALLEL_BLCK - 1)/GGML_MMID_EXPERT_PARALLEL_BLCK;
+    const int64_t nblk        = n_active*nblk_expert;
+
+    const int64_t blk_start = (ith*nblk)/nth;
+    const int64_t blk_end   = ((ith + 1)*nblk)/nth;
+
+    // first block of the current expert in the concatenated range
+    int64_t blk0 = 0;
+
+    for (int cur_a = 0; cur_a < n_as && blk0 < blk_end; ++cur_a) {
+        const int64_t cne1 = matrix_row_counts[cur_a];
+
+        if (cne1 == 0) {
+            continue;
+        }
+
+        const int64_t b0 = MAX(blk0, blk_start);
+        const int64_t b1 = MIN(blk0 + nblk_expert, blk_end);
+
+        blk0 += nblk_expert;
+
+        if (b0 >= b1) {
+            continue;
+        }
+
+        // the range of this thread continues into the next selected expert - start fetching its weights
+        if (b1 < blk_end) {
+            for (int next_a = cur_a + 1; next_a < n_as; ++next_a) {
+                if (matrix_row_counts[next_a] > 0) {
+                    const char * next = (const char *) src0->data + next_a*nb02;
+                    for (size_t i = 0; i < MIN((size_t) GGML_MMID_EXPERT_PARALLEL_PREFETCH, ne01*nb01); i += CACHE_LINE_SIZE) {
+                        GGML_PREFETCH(next + i);
+                    }
+                    break;
+                }
+            }
+        }
+
+        const int64_t ir0_start = (b0 - (blk0 - nblk_expert))*GGML_MMID_EXPERT_PARALLEL_BLCK;
+        const int64_t ir0_end   = MIN((b1 - (blk0 - nblk_expert))*GGML_MMID_EXPERT_PARALLEL_BLCK, ne01);
+
+        ggml_compute_forward_mul_mat_id_one_chunk(
+            dst, src0, src1, ids, cur_a,
+            ir0_start, ir0_end, 0, cne1,
+            (const char *) src0->data + cur_a*nb02, matrix_rows, row_size, src1_cont, wdata
+        );
+    }
+}
+
 static void * incr_ptr_aligned(void ** p, size_t size, size_t align) {
 
     void * ptr = *p;
@@ -1586,6 +1698,11 @@ static void ggml_compute_forward_mul_mat_id(
 
     ggml_barrier(params->threadpool);
 
+    if (ggml_compute_forward_mul_mat_id_use_expert_parallel(matrix_row_counts, n_as)) {
+        ggml_compute_forward_mul_mat_id_expert_parallel(params, dst, matrix_row_counts, matrix_rows);
+        return;
+    }
+
     for (int cur_a = 0; cur_a < n_as; ++cur_a) {
         const int64_t cne1 = matrix_row_counts[cur_a];
 
@@ -2853,6 +2970,129 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+//
+// barrier elision
+//
+// the threads normally synchronize after every node of the graph. this is not needed when the next node
+// does not touch the memory produced or consumed by the nodes computed since the last barrier, as long as
+// all of these nodes only work on their own rows of dst and do not share state between the threads
+//
+
+// max number of nodes that can be computed without a barrier in between
+#define GGML_GRAPH_MAX_NODES_WITHOUT_BARRIER 32
+
+// nodes that do not compute anything
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// nodes that do not use the shared work buffer or the threadpool chunk counter, and have no internal barriers
+// returns 0 if the op does not qualify, 1 if it does not use the work buffer at all and 2 if it uses a per-thread slice of it
+static int ggml_graph_node_is_thread_local(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+            return ggml_is_quantized(node->src[0]->type) ? 2 : 1;
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SCALE:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_UNARY:
+        case GGML_OP_GLU:
+        case GGML_OP_SET_ROWS:
+            return 1;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return node->src[0]->type == node->type ? 1 : 2;
+        case GGML_OP_ROPE:
+        case GGML_OP_SOFT_MAX:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static bool ggml_graph_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// check if node reads or writes memory that is written by prev, or writes memory that is read by prev
+static bool ggml_graph_nodes_conflict(const struct ggml_tensor * prev, const struct ggml_tensor * node) {
+    if (ggml_graph_tensors_overlap(prev, node)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (node->src[i] && ggml_graph_tensors_overlap(node->src[i], prev)) {
+            return true;
+        }
+        if (prev->src[i] && ggml_graph_tensors_overlap(prev->src[i], node)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// check if the barrier between nodes [node_start, node_n] and node_n + 1 can be skipped
+// the result depends only on the graph, so all threads reach the same decision
+static bool ggml_graph_can_skip_barrier(const struct ggml_cgraph * cgraph, int node_start, int node_n) {
+    const struct ggml_tensor * next = cgraph->nodes[node_n + 1];
+
+    if (ggml_graph_node_is_noop(next)) {
+        return true;
+    }
+
+    if (node_n + 1 - node_start >= GGML_GRAPH_MAX_NODES_WITHOUT_BARRIER) {
+        return false;
+    }
+
+    int n_wdata = ggml_graph_node_is_thread_local(next);
+    if (n_wdata == 0) {
+        return false;
+    }
+    n_wdata -= 1;
+
+    for (int i = node_start; i <= node_n; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_graph_node_is_noop(node)) {
+            continue;
+        }
+
+        const int local = ggml_graph_node_is_thread_local(node);
+        if (local == 0) {
+            return false;
+        }
+
+        // the per-thread slices of the work buffer differ between ops, so only one node can use it
+        n_wdata += local - 1;
+        if (n_wdata > 1) {
+            return false;
+        }
+
+        if (ggml_graph_nodes_conflict(node, next)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2870,11 +3110,19 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
+    // first node computed since the last barrier
+    int node_start = 0;
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
         ggml_compute_forward(&params, node);
 
+        if (node_n + 1 < cgraph->n_nodes && ggml_graph_can_skip_barrier(cgraph, node_start, node_n)) {
+            continue;
+        }
+
+        // the abort is only checked before a barrier so that all threads stop at the same node
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
@@ -2883,6 +3131,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
         if (node_n + 1 < cgraph->n_nodes) {
             ggml_barrier(state->threadpool);
+            node_start = node_n + 1;
         }
     }
 
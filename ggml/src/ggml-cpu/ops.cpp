@@ -8613,6 +8613,11 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
     GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
 
+    // quantized V rows with a fused kernel are accumulated directly, without going through V32
+    void (* const v_mad_q)(int, float *, const void *, float) =
+        v->type == GGML_TYPE_Q8_0 ? ggml_vec_mad_q8_0 :
+        v->type == GGML_TYPE_Q4_0 ? ggml_vec_mad_q4_0 : nullptr;
+
     // loop over n_batch and n_head
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
@@ -8708,7 +8713,9 @@ static void ggml_compute_forward_flash_attn_ext_f16(
                 }
 
                 // V += v*expf(s - M)
-                if (v_to_float) {
+                if (v_mad_q) {
+                    v_mad_q(DV, VKQ32, v_data, vs);
+                } else if (v_to_float) {
                     v_to_float(v_data, V32, DV);
                     ggml_vec_mad_f32(DV, VKQ32, V32, vs);
                 } else {
@@ -1,3 +1,6 @@
+#define GGML_COMMON_DECL_CPP
+#include "ggml-common.h"
+
 #include "vec.h"
 
 #include <cassert>
@@ -336,6 +339,98 @@ void ggml_vec_dot_f16(int n, float * GGML_RESTRICT s, size_t bs, ggml_fp16_t * G
     *s = sumf;
 }
 
+void ggml_vec_mad_q8_0(const int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, const float v) {
+    assert(n % QK8_0 == 0);
+
+    const block_q8_0 * GGML_RESTRICT x = (const block_q8_0 *) vx;
+    const int nb = n / QK8_0;
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const float    d  = GGML_CPU_FP16_TO_FP32(x[ib].d)*v;
+        const int8_t * qs = x[ib].qs;
+        float        * yb = y + ib*QK8_0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+        const __m256 vd = _mm256_set1_ps(d);
+        for (int j = 0; j < QK8_0; j += 8) {
+            const __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(qs + j))));
+            _mm256_storeu_ps(yb + j, _mm256_fmadd_ps(q, vd, _mm256_loadu_ps(yb + j)));
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        const float32x4_t vd = vdupq_n_f32(d);
+        for (int j = 0; j < QK8_0; j += 16) {
+            const int8x16_t q8  = vld1q_s8(qs + j);
+            const int16x8_t q16[2] = { vmovl_s8(vget_low_s8(q8)), vmovl_s8(vget_high_s8(q8)) };
+            for (int k = 0; k < 2; ++k) {
+                float * yk = yb + j + 8*k;
+                vst1q_f32(yk + 0, vfmaq_f32(vld1q_f32(yk + 0), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q16[k]))), vd));
+                vst1q_f32(yk + 4, vfmaq_f32(vld1q_f32(yk + 4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16[k]))), vd));
+            }
+        }
+#else
+        for (int j = 0; j < QK8_0; ++j) {
+            yb[j] += qs[j]*d;
+        }
+#endif
+    }
+}
+
+void ggml_vec_mad_q4_0(const int n, float * GGML_RESTRICT y, const void * GGML_RESTRICT vx, const float v) {
+    assert(n % QK4_0 == 0);
+
+    const block_q4_0 * GGML_RESTRICT x = (const block_q4_0 *) vx;
+    const int nb = n / QK4_0;
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const float     d  = GGML_CPU_FP16_TO_FP32(x[ib].d)*v;
+        const uint8_t * qs = x[ib].qs;
+        float         * yb = y + ib*QK4_0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+        // low nibbles hold elements [0, QK4_0/2), high nibbles [QK4_0/2, QK4_0)
+        const __m128i m4 = _mm_set1_epi8(0x0F);
+        const __m128i o8 = _mm_set1_epi8(8);
+        const __m128i qb = _mm_loadu_si128((const __m128i *) qs);
+        const __m128i q[2] = {
+            _mm_sub_epi8(_mm_and_si128(qb, m4), o8),
+            _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(qb, 4), m4), o8),
+        };
+
+        const __m256 vd = _mm256_set1_ps(d);
+        for (int k = 0; k < 2; ++k) {
+            float * yk = yb + k*QK4_0/2;
+            const __m256 q0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q[k]));
+            const __m256 q1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q[k], 8)));
+            _mm256_storeu_ps(yk + 0, _mm256_fmadd_ps(q0, vd, _mm256_loadu_ps(yk + 0)));
+            _mm256_storeu_ps(yk + 8, _mm256_fmadd_ps(q1, vd, _mm256_loadu_ps(yk + 8)));
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        const uint8x16_t m4 = vdupq_n_u8(0x0F);
+        const int8x16_t  o8 = vdupq_n_s8(8);
+        const uint8x16_t qb = vld1q_u8(qs);
+        const int8x16_t  q[2] = {
+            vsubq_s8(vreinterpretq_s8_u8(vandq_u8(qb, m4)), o8),
+            vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(qb, 4)), o8),
+        };
+
+        const float32x4_t vd = vdupq_n_f32(d);
+        for (int k = 0; k < 2; ++k) {
+            const int16x8_t q16[2] = { vmovl_s8(vget_low_s8(q[k])), vmovl_s8(vget_high_s8(q[k])) };
+            for (int l = 0; l < 2; ++l) {
+                float * yl = yb + k*QK4_0/2 + 8*l;
+                vst1q_f32(yl + 0, vfmaq_f32(vld1q_f32(yl + 0), vcvtq_f32_s32(vmovl_s16(vget_low_s16 (q16[l]))), vd));
+                vst1q_f32(yl + 4, vfmaq_f32(vld1q_f32(yl + 4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(q16[l]))), vd));
+            }
+        }
+#else
+        for (int j = 0; j < QK4_0/2; ++j) {
+            yb[j          ] += ((qs[j] & 0x0F) - 8)*d;
+            yb[j + QK4_0/2] += ((qs[j] >>   4) - 8)*d;
+        }
+#endif
+    }
+}
+
 void ggml_vec_silu_f32(const int n, float * y, const float * x) {
     int i = 0;
 #if defined(__AVX512F__) && defined(__AVX512DQ__)
@@ -296,6 +296,7 @@ extern "C" {
         bool use_mlock;       // force system to keep model in RAM
         bool check_tensors;   // validate model tensor data
         bool use_extra_bufts; // use extra buffer types (used for weight repacking)
+        bool use_hugepages;   // back the CPU weight buffers with transparent huge pages (Linux only)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -321,7 +322,7 @@ extern "C" {
         float    yarn_beta_fast;   // YaRN low correction dim
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
-        float    defrag_thold;     // [DEPRECATED] defragment the KV cache if holes/size > thold, <= 0 disabled (default)
+        float    defrag_thold;     // compact the KV cache if holes/size > thold, <= 0 disabled (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -346,6 +347,17 @@ extern "C" {
         bool kv_unified;  // use a unified buffer across the input sequences when computing the attention
                           // try to disable when n_seq_max > 1 for improved performance when the sequences do not share a large prefix
                           // ref: https://github.com/ggml-org/llama.cpp/pull/14363
+
+        // when a sequence outgrows n_ctx/n_seq_max, keep its first n_sink tokens and evict the oldest ones after them,
+        // shifting the rest down, < 0 disabled (default)
+        // NOTE: positions change, so only batches without explicit positions evict - their positions follow the shift
+        int32_t n_sink;
+
+        // data types for the SWA cache of models with interleaved sliding-window attention, which only holds the
+        // recent tokens of each sequence - e.g. keep it in F16 while the full-context cache is quantized
+        // GGML_TYPE_COUNT = same as type_k/type_v (default) [EXPERIMENTAL]
+        enum ggml_type type_k_swa;
+        enum ggml_type type_v_swa;
     };
 
     // model quantization parameters
@@ -787,6 +799,27 @@ extern "C" {
                           size_t   n_token_capacity,
                           size_t * n_token_count_out);
 
+    // Save a sequence state previously captured with llama_state_seq_get_data() to a file
+    // The file has the same format as the one written by llama_state_seq_save_file()
+    // Does not use the context, so it can run on another thread while the context keeps decoding
+    LLAMA_API size_t llama_state_seq_save_file_data(
+                      const char * filepath,
+                   const uint8_t * src,
+                          size_t   size,
+               const llama_token * tokens,
+                          size_t   n_token_count);
+
+    // Read a sequence state file into host memory, to be restored later with llama_state_seq_set_data()
+    // Does not use the context, so it can run on another thread while the context keeps decoding
+    // Returns the size of the state written to dst, or zero if the file is invalid or the state does not fit
+    LLAMA_API size_t llama_state_seq_load_file_data(
+                      const char * filepath,
+                         uint8_t * dst,
+                          size_t   size,
+                     llama_token * tokens_out,
+                          size_t   n_token_capacity,
+                          size_t * n_token_count_out);
+
 #define LLAMA_STATE_SEQ_FLAGS_SWA_ONLY 1
 
     typedef uint32_t llama_state_seq_flags;
@@ -1016,6 +1049,18 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize, but long texts are tokenized in parallel chunks on up to n_threads threads
+    ///          The result is the same as with llama_tokenize. Only the BPE tokenizers use more than one thread
+    LLAMA_API int32_t llama_tokenize_ext(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1236,6 +1281,9 @@ extern "C" {
                const llama_token * trigger_tokens,
                             size_t num_trigger_tokens);
 
+    /// @details Returns true if smpl is a lazy grammar sampler that has not been triggered yet, so that applying it does not change the candidates.
+    LLAMA_API bool llama_sampler_grammar_awaiting_trigger(const struct llama_sampler * smpl);
+
 
     /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
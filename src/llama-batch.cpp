@@ -7,19 +7,12 @@
 #include <cassert>
 #include <cstring>
 #include <algorithm>
+#include <bitset>
 #include <sstream>
 
 llama_batch_allocr::llama_batch_allocr(uint32_t n_pos_per_embd) : n_pos_per_embd(n_pos_per_embd) {
     const char * LLAMA_BATCH_DEBUG = getenv("LLAMA_BATCH_DEBUG");
     debug = LLAMA_BATCH_DEBUG ? atoi(LLAMA_BATCH_DEBUG) : 0;
-
-    seq_pos.resize(LLAMA_MAX_SEQ);
-    seq_cpl.resize(LLAMA_MAX_SEQ);
-    for (auto & cur : seq_cpl) {
-        cur.resize(LLAMA_MAX_SEQ);
-    }
-
-    seq_idx.resize(LLAMA_MAX_SEQ, -1);
 }
 
 bool llama_batch_allocr::init(
@@ -57,6 +50,11 @@ bool llama_batch_allocr::init(
 
     if (batch.seq_id) {
         for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            if (batch.n_seq_id[i] <= 0) {
+                LLAMA_LOG_ERROR("%s: invalid n_seq_id[%d] = %d\n", __func__, i, batch.n_seq_id[i]);
+                return false;
+            }
+
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
                 if (batch.seq_id && (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= (llama_seq_id) n_seq_max)) {
                     LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d >= %d\n", __func__, i, s, batch.seq_id[i][s], (llama_seq_id) n_seq_max);
@@ -87,30 +85,55 @@ bool llama_batch_allocr::init(
         batch.seq_id = seq_id.data();
     }
 
+    // determine the unique sequence ids that participate in the batch
+    // the per-sequence data below is indexed by seq_idx[seq_id], in the order of increasing sequence ids
+    if (seq_idx.size() < n_seq_max) {
+        seq_idx.resize(n_seq_max, -1);
+    }
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            const llama_seq_id seq_id = batch.seq_id[i][s];
+
+            if (seq_idx[seq_id] < 0) {
+                seq_idx[seq_id] = 0;
+                seq_id_unq.push_back(seq_id);
+            }
+        }
+    }
+
+    std::sort(seq_id_unq.begin(), seq_id_unq.end());
+
+    for (size_t s = 0; s < seq_id_unq.size(); ++s) {
+        seq_idx[seq_id_unq[s]] = s;
+    }
+
+    const uint32_t n_seq_unq = seq_id_unq.size();
+
     if (!batch.pos) {
         pos.resize(batch.n_tokens);
 
         // initialize the starting position for each sequence based on the positions in the memory
-        llama_pos p0[LLAMA_MAX_SEQ];
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
+        std::vector<llama_pos> p0(n_seq_unq);
+        for (uint32_t s = 0; s < n_seq_unq; ++s) {
             if (!memory) {
                 // if no memory -> start from 0
                 p0[s] = 0;
             } else {
-                p0[s] = memory->seq_pos_max(s) + 1;
+                p0[s] = memory->seq_pos_max(seq_id_unq[s]) + 1;
             }
         }
 
         for (int32_t i = 0; i < batch.n_tokens; i++) {
             const llama_seq_id seq_id = batch.seq_id[i][0];
 
-            pos[i] = p0[seq_id];
+            pos[i] = p0[seq_idx[seq_id]];
 
             // update the starting position for all sequences that are assigned to the this token
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
                 const llama_seq_id seq_id = batch.seq_id[i][s];
 
-                p0[seq_id] = pos[i] + 1;
+                p0[seq_idx[seq_id]] = pos[i] + 1;
             }
         }
 
@@ -159,6 +182,9 @@ bool llama_batch_allocr::init(
 
     has_cpl = false;
 
+    seq_pos.resize(n_seq_unq);
+    seq_cpl.resize(n_seq_unq);
+
     // determine coupled sequences
     // these are pairs of sequences that have at least one token in the input batch that is assigned to both of them
     for (int32_t i = 0; i < batch.n_tokens; ++i) {
@@ -167,42 +193,55 @@ bool llama_batch_allocr::init(
         for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
             const llama_seq_id s1 = batch.seq_id[i][s];
 
-            seq_pos[s1].insert(batch.pos[i]);
+            seq_pos[seq_idx[s1]].insert(batch.pos[i]);
 
             if (s > 0) {
                 // mark that sequence s1 is coupled to s0
-                seq_cpl[s1][s0] = true;
+                seq_cpl[seq_idx[s1]].insert(s0);
 
                 // note: tracking the other way around is not necessary for now
-                //seq_cpl[s0][s1] = true;
+                //seq_cpl[seq_idx[s0]].insert(s1);
 
                 has_cpl = true;
             }
         }
     }
 
-    // precompute the sequence sets for each token and determine the unique sequence ids that participate in the batch
+    // precompute the sequence sets for each token
     {
-        seq_set_t seq_set_unq;
+        n_seq_words = (n_seq_unq + 63)/64;
+
+        seq_set_single.assign(n_seq_unq, -1);
+        seq_set_cur.assign(n_seq_words, 0);
+
+        seq_set.resize(batch.n_tokens);
 
         for (int32_t i = 0; i < batch.n_tokens; ++i) {
-            seq_set_t cur;
-            for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
-                const llama_seq_id seq_id = batch.seq_id[i][s];
+            int32_t k = -1;
 
-                cur        .set(seq_id);
-                seq_set_unq.set(seq_id);
-            }
+            if (batch.n_seq_id[i] == 1) {
+                // the common case - single sequence sets do not need a lookup
+                const int32_t idx = seq_idx[batch.seq_id[i][0]];
 
-            seq_set.push_back(cur);
-            seq_set_map[cur].push_back(i);
-        }
+                k = seq_set_single[idx];
+                if (k < 0) {
+                    seq_set_cur[idx/64] |= 1ull << (idx%64);
+                    k = seq_set_get();
+                    seq_set_cur[idx/64] = 0;
+                }
+            } else {
+                for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+                    const int32_t idx = seq_idx[batch.seq_id[i][s]];
+
+                    seq_set_cur[idx/64] |= 1ull << (idx%64);
+                }
 
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            if (seq_set_unq.test(s)) {
-                seq_idx[s] = seq_id_unq.size();
-                seq_id_unq.push_back(s);
+                k = seq_set_get();
+                std::fill(seq_set_cur.begin(), seq_set_cur.end(), 0);
             }
+
+            seq_set[i] = k;
+            seq_set_idxs[k].push_back(i);
         }
     }
 
@@ -229,16 +268,10 @@ bool llama_batch_allocr::init(
         ubatch_print(ubatch, debug);
 
         LLAMA_LOG_DEBUG("%s:   seq       = [\n", __func__);
-        for (int s0 = 0; s0 < (int) seq_pos.size(); ++s0) {
-            if (seq_pos[s0].empty()) {
-                continue;
-            }
-
+        for (const llama_seq_id s0 : seq_id_unq) {
             std::stringstream ss;
-            for (int s1 = 0; s1 < (int) seq_cpl[s0].size(); ++s1) {
-                if (seq_cpl[s0][s1]) {
-                    ss << s1 << " ";
-                }
+            for (const llama_seq_id s1 : seq_cpl[seq_idx[s0]]) {
+                ss << s1 << " ";
             }
 
             LLAMA_LOG_DEBUG("%s:  %4d: pos = [%4d, %4d], cpl = %s\n",
@@ -251,11 +284,7 @@ bool llama_batch_allocr::init(
     // consistency checks
     //
 
-    for (uint32_t s = 0; s < n_seq_max; ++s) {
-        if (seq_pos[s].empty()) {
-            continue;
-        }
-
+    for (const llama_seq_id s : seq_id_unq) {
         const llama_pos p0 = memory ? memory->seq_pos_max(s) : -1;
 
         if (p0 >= 0) {
@@ -287,21 +316,19 @@ bool llama_batch_allocr::init(
             }
         }
 
-        if (seq_pos_max(s) - seq_pos_min(s) + 1 > (int) seq_pos[s].size()) {
+        if (seq_pos_max(s) - seq_pos_min(s) + 1 > (int) seq_pos[seq_idx[s]].size()) {
             LLAMA_LOG_ERROR("%s: sequence %d positions are not continuous\n", __func__, s);
             return false;
         }
     }
 
     if (memory) {
-        for (uint32_t s0 = 0; s0 < n_seq_max; ++s0) {
-            for (uint32_t s1 = 0; s1 < n_seq_max; ++s1) {
-                if (seq_cpl[s0][s1]) {
-                    if (memory->seq_pos_min(s0) != memory->seq_pos_min(s1) ||
-                        memory->seq_pos_max(s0) != memory->seq_pos_max(s1)) {
-                        LLAMA_LOG_ERROR("%s: sequence %d is coupled to %d in the input batch, but have divereged\n", __func__, s0, s1);
-                        return false;
-                    }
+        for (const llama_seq_id s0 : seq_id_unq) {
+            for (const llama_seq_id s1 : seq_cpl[seq_idx[s0]]) {
+                if (memory->seq_pos_min(s0) != memory->seq_pos_min(s1) ||
+                    memory->seq_pos_max(s0) != memory->seq_pos_max(s1)) {
+                    LLAMA_LOG_ERROR("%s: sequence %d is coupled to %d in the input batch, but have divereged\n", __func__, s0, s1);
+                    return false;
                 }
             }
         }
@@ -325,30 +352,27 @@ bool llama_batch_allocr::init(
     // seq_id[i][0]: 0 0 1 1 0 1 0
     //
     {
-        seq_set_t cur_seq_set[LLAMA_MAX_SEQ];
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            cur_seq_set[s].set();
-        }
-
-        llama_pos cur_seq_pos[LLAMA_MAX_SEQ];
-        for (uint32_t s = 0; s < n_seq_max; ++s) {
-            cur_seq_pos[s] = -1;
-        }
+        // indexed by seq_idx[seq_id]
+        // cur_seq_set[idx] is the id of the intersection of the sequence sets that the sequence belongs to so far,
+        // -1 before its first token
+        std::vector<int32_t>   cur_seq_set(n_seq_unq, -1);
+        std::vector<llama_pos> cur_seq_pos(n_seq_unq, -1);
 
         for (int32_t i = 0; i < batch.n_tokens; ++i) {
             const llama_pos pos = batch.pos[i];
 
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
                 const llama_seq_id seq_id = batch.seq_id[i][s];
+                const int32_t      idx    = seq_idx[seq_id];
 
-                cur_seq_set[seq_id] &= seq_set[i];
+                cur_seq_set[idx] = cur_seq_set[idx] < 0 ? seq_set[i] : seq_set_intersect(cur_seq_set[idx], seq_set[i]);
 
-                if (cur_seq_set[seq_id].none()) {
+                if (cur_seq_set[idx] < 0) {
                     LLAMA_LOG_ERROR("%s: sequence %d belongs to incompatible sequence sets (not allowed)\n", __func__, seq_id);
                     return false;
                 }
 
-                if (pos < cur_seq_pos[seq_id]) {
+                if (pos < cur_seq_pos[idx]) {
                     LLAMA_LOG_ERROR("%s: sequence %d positions are decreasing (not allowed)\n", __func__, seq_id);
                     return false;
                 }
@@ -375,7 +399,7 @@ llama_ubatch llama_batch_allocr::ubatch_reserve(uint32_t n_seq_tokens, uint32_t
     udata->n_seq_id  .resize(n_tokens);
     udata->seq_id    .resize(n_tokens);
     udata->seq_id_unq.resize(0);
-    udata->seq_idx   .resize(LLAMA_MAX_SEQ, -1);
+    udata->seq_idx   .resize(n_seqs, -1);
     udata->output    .resize(n_tokens);
 
     for (uint32_t s = 0; s < n_seqs; ++s) {
@@ -425,11 +449,48 @@ std::vector<int32_t> & llama_batch_allocr::get_out_ids() {
 }
 
 llama_pos llama_batch_allocr::seq_pos_min(llama_seq_id seq_id) const {
-    return seq_pos[seq_id].empty() ? -1 : *seq_pos[seq_id].begin();
+    if (seq_id < 0 || seq_id >= (llama_seq_id) seq_idx.size() || seq_idx[seq_id] < 0) {
+        return -1;
+    }
+
+    return *seq_pos[seq_idx[seq_id]].begin();
 }
 
 llama_pos llama_batch_allocr::seq_pos_max(llama_seq_id seq_id) const {
-    return seq_pos[seq_id].empty() ? -1 : *seq_pos[seq_id].rbegin();
+    if (seq_id < 0 || seq_id >= (llama_seq_id) seq_idx.size() || seq_idx[seq_id] < 0) {
+        return -1;
+    }
+
+    return *seq_pos[seq_idx[seq_id]].rbegin();
+}
+
+const std::vector<llama_seq_id> & llama_batch_allocr::get_seq_id_unq() const {
+    return seq_id_unq;
+}
+
+bool llama_batch_allocr::has_coupled_seqs() const {
+    return has_cpl;
+}
+
+void llama_batch_allocr::seq_pos_add(llama_seq_id seq_id, llama_pos delta) {
+    GGML_ASSERT(!pos.empty() && batch.pos == pos.data() && "the positions of the batch must be auto-generated");
+    GGML_ASSERT(!has_cpl);
+    GGML_ASSERT(n_used == 0);
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        if (batch.seq_id[i][0] == seq_id) {
+            pos[i] += delta;
+        }
+    }
+
+    pos_set_t & sp = seq_pos[seq_idx[seq_id]];
+
+    pos_set_t res;
+    for (const llama_pos p : sp) {
+        res.insert(res.end(), p + delta);
+    }
+
+    sp = std::move(res);
 }
 
 void llama_batch_allocr::split_reset() {
@@ -482,7 +543,8 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
         return {};
     }
 
-    std::vector<seq_set_t> cur_seq_set;
+    // the ids of the sequence sets
+    std::vector<int32_t> cur_seq_set;
 
     llama_seq_id last_seq_id = -1;
 
@@ -496,7 +558,7 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
 
         for (uint32_t s = 0; s < cur_seq_set.size(); ++s) {
             // no overlap with existing sequence sets:
-            if (!(cur_seq_set[s] & seq_set[i]).none()) {
+            if (seq_set_overlap(cur_seq_set[s], seq_set[i])) {
                 add = false;
                 break;
             }
@@ -529,7 +591,7 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
     std::vector<int32_t> cur_idx(n_seqs, 0);
 
     for (uint32_t s = 0; s < n_seqs; ++s) {
-        while (used[seq_set_map[cur_seq_set[s]][cur_idx[s]]]) {
+        while (used[seq_set_idxs[cur_seq_set[s]][cur_idx[s]]]) {
             ++cur_idx[s];
         }
     }
@@ -544,7 +606,7 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
         bool can_expand = true;
 
         for (uint32_t s = 0; s < n_seqs; ++s) {
-            if (cur_idx[s] >= (int32_t) seq_set_map[cur_seq_set[s]].size()) {
+            if (cur_idx[s] >= (int32_t) seq_set_idxs[cur_seq_set[s]].size()) {
                 can_expand = false;
                 break;
             }
@@ -555,7 +617,7 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch, bool sequential)
         }
 
         for (uint32_t s = 0; s < n_seqs; ++s) {
-            const int32_t idx = seq_set_map[cur_seq_set[s]][cur_idx[s]];
+            const int32_t idx = seq_set_idxs[cur_seq_set[s]][cur_idx[s]];
 
             idxs_per_seq[s].push_back(idx);
 
@@ -610,7 +672,7 @@ llama_ubatch llama_batch_allocr::split_seq(uint32_t n_ubatch) {
 
         do {
             ++cur_idx;
-        } while (cur_idx < get_n_tokens() && (used[cur_idx] || ((cur_seq_set & seq_set[cur_idx]) != seq_set[cur_idx])));
+        } while (cur_idx < get_n_tokens() && (used[cur_idx] || !seq_set_subset(seq_set[cur_idx], cur_seq_set)));
 
         if (cur_idx == get_n_tokens()) {
             break;
@@ -630,7 +692,6 @@ void llama_batch_allocr::clear() {
     pos       .clear();
     n_seq_id  .clear();
     seq_id    .clear();
-    seq_id_unq.clear();
     output    .clear();
 
     for (auto & cur : seq_pos) {
@@ -638,14 +699,127 @@ void llama_batch_allocr::clear() {
     }
 
     for (auto & cur : seq_cpl) {
-        std::fill(cur.begin(), cur.end(), false);
+        cur.clear();
     }
 
     seq_set.clear();
 
-    seq_set_map.clear();
+    seq_set_data.clear();
+    seq_set_idxs.clear();
+    seq_set_multi.clear();
+
+    // reset only the entries of the sequences in the previous batch
+    for (const llama_seq_id s : seq_id_unq) {
+        seq_idx[s] = -1;
+    }
+
+    seq_id_unq.clear();
+}
+
+int32_t llama_batch_allocr::seq_set_get() {
+    int32_t n_seq = 0;
+    int32_t idx   = -1; // the first sequence in the set
+
+    for (uint32_t w = 0; w < n_seq_words; ++w) {
+        const uint64_t bits = seq_set_cur[w];
+        if (bits == 0) {
+            continue;
+        }
+
+        n_seq += std::bitset<64>(bits).count();
+
+        if (idx < 0) {
+            idx = w*64;
+            while (((bits >> (idx%64)) & 1) == 0) {
+                ++idx;
+            }
+        }
+    }
+
+    if (n_seq == 0) {
+        return -1;
+    }
+
+    if (n_seq == 1) {
+        if (seq_set_single[idx] >= 0) {
+            return seq_set_single[idx];
+        }
+    } else {
+        const auto it = seq_set_multi.find(seq_set_cur);
+        if (it != seq_set_multi.end()) {
+            return it->second;
+        }
+    }
+
+    const int32_t k = seq_set_idxs.size();
+
+    seq_set_data.insert(seq_set_data.end(), seq_set_cur.begin(), seq_set_cur.end());
+    seq_set_idxs.emplace_back();
+
+    if (n_seq == 1) {
+        seq_set_single[idx] = k;
+    } else {
+        seq_set_multi.emplace(seq_set_cur, k);
+    }
+
+    return k;
+}
+
+const uint64_t * llama_batch_allocr::seq_set_bits(int32_t k) const {
+    return seq_set_data.data() + (size_t) k*n_seq_words;
+}
+
+bool llama_batch_allocr::seq_set_overlap(int32_t k0, int32_t k1) const {
+    if (k0 == k1) {
+        return true;
+    }
+
+    const uint64_t * b0 = seq_set_bits(k0);
+    const uint64_t * b1 = seq_set_bits(k1);
+
+    for (uint32_t w = 0; w < n_seq_words; ++w) {
+        if (b0[w] & b1[w]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool llama_batch_allocr::seq_set_subset(int32_t k0, int32_t k1) const {
+    if (k0 == k1) {
+        return true;
+    }
+
+    const uint64_t * b0 = seq_set_bits(k0);
+    const uint64_t * b1 = seq_set_bits(k1);
+
+    for (uint32_t w = 0; w < n_seq_words; ++w) {
+        if (b0[w] & ~b1[w]) {
+            return false;
+        }
+    }
 
-    std::fill(seq_idx.begin(), seq_idx.end(), -1);
+    return true;
+}
+
+int32_t llama_batch_allocr::seq_set_intersect(int32_t k0, int32_t k1) {
+    if (k0 == k1) {
+        return k0;
+    }
+
+    const uint64_t * b0 = seq_set_bits(k0);
+    const uint64_t * b1 = seq_set_bits(k1);
+
+    for (uint32_t w = 0; w < n_seq_words; ++w) {
+        seq_set_cur[w] = b0[w] & b1[w];
+    }
+
+    const int32_t k = seq_set_get();
+
+    std::fill(seq_set_cur.begin(), seq_set_cur.end(), 0);
+
+    return k;
 }
 
 llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, uint32_t n_seqs, bool equal_seqs) {
@@ -666,11 +840,8 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
     udata->n_seq_id  .resize(n_tokens);
     udata->seq_id    .resize(n_tokens);
     udata->seq_id_unq.resize(0);
-    udata->seq_idx   .resize(LLAMA_MAX_SEQ, -1);
     udata->output    .resize(n_tokens);
 
-    seq_set_t seq_set_unq;
-
     for (size_t i = 0; i < idxs.size(); ++i) {
         if (batch.token) {
             udata->token[i] = batch.token[idxs[i]];
@@ -688,8 +859,11 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         udata->seq_id[i]   = batch.seq_id[idxs[i]];
         udata->output[i]   = batch.logits[idxs[i]];
 
-        for (int s = 0; s < udata->n_seq_id[i]; ++s) {
-            seq_set_unq.set(udata->seq_id[i][s]);
+        // the tokens of a sequence set are usually next to each other
+        if (i == 0 || seq_set[idxs[i]] != seq_set[idxs[i - 1]]) {
+            for (int s = 0; s < udata->n_seq_id[i]; ++s) {
+                udata->seq_id_unq.push_back(udata->seq_id[i][s]);
+            }
         }
 
         if (udata->output[i]) {
@@ -697,11 +871,14 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         }
     }
 
-    for (uint32_t s = 0; s < n_seq_max; ++s) {
-        if (seq_set_unq.test(s)) {
-            udata->seq_idx[s] = udata->seq_id_unq.size();
-            udata->seq_id_unq.push_back(s);
-        }
+    std::sort(udata->seq_id_unq.begin(), udata->seq_id_unq.end());
+    udata->seq_id_unq.erase(std::unique(udata->seq_id_unq.begin(), udata->seq_id_unq.end()), udata->seq_id_unq.end());
+
+    // indexed by the sequence ids of the ubatch
+    udata->seq_idx.resize(udata->seq_id_unq.empty() ? 0 : udata->seq_id_unq.back() + 1, -1);
+
+    for (size_t s = 0; s < udata->seq_id_unq.size(); ++s) {
+        udata->seq_idx[udata->seq_id_unq[s]] = s;
     }
 
     llama_ubatch res {
@@ -749,7 +926,9 @@ void llama_batch_allocr::ubatch_print(const llama_ubatch & ubatch, int debug) {
             ss_seq_id_unq << ubatch.seq_id_unq[s] << " ";
         }
 
-        for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        const llama_seq_id seq_id_max = ubatch.n_seqs_unq > 0 ? ubatch.seq_id_unq[ubatch.n_seqs_unq - 1] : -1;
+
+        for (llama_seq_id s = 0; s <= seq_id_max; ++s) {
             if (ubatch.seq_idx[s] >= 0) {
                 ss_seq_idx << ubatch.seq_idx[s]%10;
             } else {
@@ -6,10 +6,9 @@
 
 #include <array>
 #include <vector>
+#include <map>
 #include <set>
-#include <bitset>
 #include <memory>
-#include <unordered_map>
 
 // keep this struct lightweight
 struct llama_ubatch {
@@ -37,7 +36,7 @@ struct llama_ubatch {
     int32_t      *  n_seq_id;   // [n_tokens]         | i   | -
     llama_seq_id ** seq_id;     // [n_tokens]         | s   | s0, s1, seq_id
     llama_seq_id *  seq_id_unq; // [n_seqs_unq]       | s   | seq_id
-    int32_t      *  seq_idx;    // [LLAMA_MAX_SEQ]    | -   | seq_idx
+    int32_t      *  seq_idx;    // [seq_id_max + 1]   | -   | seq_idx
     int8_t       *  output;     // [n_tokens]         | i   | -
 
     struct data_t {
@@ -83,6 +82,16 @@ public:
     llama_pos seq_pos_min(llama_seq_id seq_id) const;
     llama_pos seq_pos_max(llama_seq_id seq_id) const;
 
+    // the sequence ids in the batch, in increasing order
+    const std::vector<llama_seq_id> & get_seq_id_unq() const;
+
+    // true if some tokens of the batch belong to more than one sequence
+    bool has_coupled_seqs() const;
+
+    // add delta to the positions of sequence seq_id, after the same shift has been applied to the memory
+    // only for batches with auto-generated positions and without coupled sequences, call before splitting the batch
+    void seq_pos_add(llama_seq_id seq_id, llama_pos delta);
+
     // call once before splitting the batch to reset the internal state
     void split_reset();
 
@@ -110,6 +119,17 @@ private:
     // for debugging, start with LLAMA_BATCH_DEBUG=2
     void ubatch_print(const llama_ubatch & ubatch, int debug);
 
+    // return the id of the sequence set in seq_set_cur, adding it if it is new
+    int32_t seq_set_get();
+
+    const uint64_t * seq_set_bits(int32_t k) const;
+
+    bool seq_set_overlap(int32_t k0, int32_t k1) const; // k0 & k1 is not empty
+    bool seq_set_subset (int32_t k0, int32_t k1) const; // k0 is a subset of k1
+
+    // the id of the intersection of k0 and k1, or -1 if it is empty
+    int32_t seq_set_intersect(int32_t k0, int32_t k1);
+
     llama_batch batch;
 
     // only for debugging purposes
@@ -133,20 +153,31 @@ private:
     std::vector<int8_t>         output;
 
     using pos_set_t = std::set<llama_pos>;
-    using seq_cpl_t = std::vector<bool>;
+    using seq_cpl_t = std::set<llama_seq_id>;
 
     // helper flag to quickly determine if there are any coupled sequences in the batch
     bool has_cpl = false;
 
-    std::vector<pos_set_t> seq_pos; // seq_pos[s]: the set of positions in sequence s
-    std::vector<seq_cpl_t> seq_cpl; // seq_cpl[s0][s1]: if sequence s0 is coupled to sequence s1
+    // the per-sequence data is indexed by seq_idx[s], so it is sized by the number of sequences in the batch
+    std::vector<pos_set_t> seq_pos; // seq_pos[seq_idx[s]]: the set of positions in sequence s
+    std::vector<seq_cpl_t> seq_cpl; // seq_cpl[seq_idx[s0]]: the sequences s1 to which sequence s0 is coupled
 
     using idx_vec_t = std::vector<int32_t>;
-    using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
 
-    std::vector<seq_set_t> seq_set; // seq_set[i]: the sequence set of token i
+    // a sequence set is a bitset over the indices seq_idx[s] of the sequences in the batch, stored as n_seq_words
+    // 64-bit words at offset k*n_seq_words of seq_set_data, where k is the id of the set
+    // the distinct sets are stored once, and the tokens refer to them by id
+    uint32_t n_seq_words = 0;
+
+    std::vector<uint64_t>  seq_set_data;
+    std::vector<idx_vec_t> seq_set_idxs;   // seq_set_idxs[k]: the batch indices at which the sequence set k appears
+    std::vector<int32_t>   seq_set_single; // seq_set_single[seq_idx[s]]: the id of the set {s}, or -1
+    std::map<std::vector<uint64_t>, int32_t> seq_set_multi; // the ids of the sets with more than one sequence
+
+    std::vector<int32_t> seq_set; // seq_set[i]: the id of the sequence set of token i
 
-    std::unordered_map<seq_set_t, idx_vec_t> seq_set_map; // the indices at which the sequence set appears
+    // scratch for building a sequence set
+    std::vector<uint64_t> seq_set_cur;
 
     // batch indices of the output
     std::vector<int32_t> out_ids;
@@ -103,6 +103,9 @@ llama_context::llama_context(
     cparams.op_offload = params.op_offload;
     cparams.kv_unified = params.kv_unified;
 
+    cparams.defrag_thold = params.defrag_thold;
+    cparams.n_sink       = params.n_sink;
+
     {
         const char * LLAMA_GRAPH_REUSE_DISABLE = getenv("LLAMA_GRAPH_REUSE_DISABLE");
         graph_reuse_disable = LLAMA_GRAPH_REUSE_DISABLE ? (atoi(LLAMA_GRAPH_REUSE_DISABLE) != 0) : graph_reuse_disable;
@@ -194,9 +197,11 @@ llama_context::llama_context(
     // init the memory module
     if (!hparams.vocab_only) {
         llama_memory_params params_mem = {
-            /*.type_k   =*/ params.type_k,
-            /*.type_v   =*/ params.type_v,
-            /*.swa_full =*/ params.swa_full,
+            /*.type_k     =*/ params.type_k,
+            /*.type_v     =*/ params.type_v,
+            /*.type_k_swa =*/ params.type_k_swa == GGML_TYPE_COUNT ? params.type_k : params.type_k_swa,
+            /*.type_v_swa =*/ params.type_v_swa == GGML_TYPE_COUNT ? params.type_v : params.type_v_swa,
+            /*.swa_full   =*/ params.swa_full,
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
@@ -323,7 +328,7 @@ llama_context::llama_context(
             if (fa_device_mismatch) {
                 cparams.flash_attn = false;
                 LLAMA_LOG_WARN("%s: Flash Attention was auto, set to disabled\n", __func__);
-                if (ggml_is_quantized(params.type_v)) {
+                if (ggml_is_quantized(params.type_v) || ggml_is_quantized(params.type_v_swa)) {
                     throw std::runtime_error("quantized V cache was requested, but this requires Flash Attention");
                 }
             } else {
@@ -982,6 +987,11 @@ int llama_context::decode(const llama_batch & batch_inp) {
         return -1;
     }
 
+    // only the positions generated by the batch allocator follow the shift of the memory
+    if (!batch_inp.pos) {
+        memory_evict(*balloc);
+    }
+
     const uint32_t n_tokens_all  = balloc->get_n_tokens();
     const uint32_t n_outputs_all = balloc->get_n_outputs();
 
@@ -1089,25 +1099,25 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
         if (!res) {
             // the last ubatch failed or was aborted -> remove all positions of that ubatch from the memory module
-            llama_pos pos_min[LLAMA_MAX_SEQ];
-            for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-                pos_min[s] = std::numeric_limits<llama_pos>::max();
-            }
+            // indexed by ubatch.seq_idx[seq_id]
+            std::vector<llama_pos> pos_min(ubatch.n_seqs_unq, std::numeric_limits<llama_pos>::max());
 
             for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
                 const auto & seq_id = ubatch.seq_id[i][0];
 
-                pos_min[seq_id] = std::min(pos_min[seq_id], ubatch.pos[i]);
+                pos_min[ubatch.seq_idx[seq_id]] = std::min(pos_min[ubatch.seq_idx[seq_id]], ubatch.pos[i]);
             }
 
-            for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
                 if (pos_min[s] == std::numeric_limits<llama_pos>::max()) {
                     continue;
                 }
 
-                LLAMA_LOG_WARN("%s: removing memory module entries for seq_id = %d, pos = [%d, +inf)\n", __func__, s, pos_min[s]);
+                const llama_seq_id seq_id = ubatch.seq_id_unq[s];
+
+                LLAMA_LOG_WARN("%s: removing memory module entries for seq_id = %d, pos = [%d, +inf)\n", __func__, seq_id, pos_min[s]);
 
-                memory->seq_rm(s, pos_min[s], -1);
+                memory->seq_rm(seq_id, pos_min[s], -1);
             }
 
             switch (status) {
@@ -1357,6 +1367,61 @@ void llama_context::output_reorder() {
     output_swaps.clear();
 }
 
+//
+// memory
+//
+
+void llama_context::memory_evict(llama_batch_allocr & balloc) {
+    if (cparams.n_sink < 0 || !memory || !memory->get_can_shift()) {
+        return;
+    }
+
+    const int32_t n_ctx_seq = n_ctx_per_seq();
+    const int32_t n_sink    = cparams.n_sink;
+
+    if (n_sink >= n_ctx_seq) {
+        return;
+    }
+
+    // the positions of a token shared by several sequences cannot follow the shift of only one of them
+    if (balloc.has_coupled_seqs()) {
+        return;
+    }
+
+    // evict at least this many tokens at a time, so that the shift of the remaining window is amortized
+    const int32_t n_chunk = std::max<int32_t>(1, std::min<int32_t>(cparams.n_ubatch, (n_ctx_seq - n_sink)/4));
+
+    for (const llama_seq_id seq_id : balloc.get_seq_id_unq()) {
+        const llama_pos p0 = memory->seq_pos_min(seq_id);
+        const llama_pos p1 = memory->seq_pos_max(seq_id);
+
+        if (p0 < 0) {
+            continue;
+        }
+
+        // the batch validated that its positions of the sequence continue the memory without gaps
+        const int32_t n_cur  = p1 - p0 + 1;
+        const int32_t n_over = balloc.seq_pos_max(seq_id) - p0 + 1 - n_ctx_seq;
+
+        if (n_over <= 0) {
+            continue;
+        }
+
+        const int32_t n_evict = std::min(std::max(n_over, n_chunk), n_cur - n_sink);
+
+        if (n_evict <= 0) {
+            continue;
+        }
+
+        LLAMA_LOG_DEBUG("%s: seq_id = %d, evicting positions [%d, %d), n_sink = %d\n", __func__, seq_id, p0 + n_sink, p0 + n_sink + n_evict, n_sink);
+
+        memory->seq_rm (seq_id, p0 + n_sink,           p0 + n_sink + n_evict);
+        memory->seq_add(seq_id, p0 + n_sink + n_evict, -1, -n_evict);
+
+        balloc.seq_pos_add(seq_id, -n_evict);
+    }
+}
+
 //
 // graph
 //
@@ -2278,6 +2343,9 @@ llama_context_params llama_context_default_params() {
         /*.op_offload                  =*/ true,
         /*.swa_full                    =*/ true,
         /*.kv_unified                  =*/ false,
+        /*.n_sink                      =*/ -1,
+        /*.type_k_swa                  =*/ GGML_TYPE_COUNT,
+        /*.type_v_swa                  =*/ GGML_TYPE_COUNT,
     };
 
     return result;
@@ -2306,27 +2374,39 @@ llama_context * llama_init_from_model(
         params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
     }
 
-    if (params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_AUTO && ggml_is_quantized(params.type_k)) {
-        const uint32_t blck_size = ggml_blck_size(params.type_k);
-        if (model->hparams.n_embd_head_k % blck_size != 0) {
-            LLAMA_LOG_ERROR("%s: K cache type %s with block size %u does not divide n_embd_head_k=%u\n",
-                __func__, ggml_type_name(params.type_k), blck_size, model->hparams.n_embd_head_k);
-            return nullptr;
-        }
+    if (params.type_k_swa == GGML_TYPE_COUNT) {
+        params.type_k_swa = params.type_k;
     }
 
-    if (params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_AUTO && ggml_is_quantized(params.type_v)) {
-        const uint32_t blck_size = ggml_blck_size(params.type_v);
-        if (model->hparams.n_embd_head_v % blck_size != 0) {
-            LLAMA_LOG_ERROR("%s: V cache type %s with block size %u does not divide n_embd_head_k=%u\n",
-                __func__, ggml_type_name(params.type_v), blck_size, model->hparams.n_embd_head_v);
-            return nullptr;
+    if (params.type_v_swa == GGML_TYPE_COUNT) {
+        params.type_v_swa = params.type_v;
+    }
+
+    for (const ggml_type type_k : { params.type_k, params.type_k_swa }) {
+        if (params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_AUTO && ggml_is_quantized(type_k)) {
+            const uint32_t blck_size = ggml_blck_size(type_k);
+            if (model->hparams.n_embd_head_k % blck_size != 0) {
+                LLAMA_LOG_ERROR("%s: K cache type %s with block size %u does not divide n_embd_head_k=%u\n",
+                    __func__, ggml_type_name(type_k), blck_size, model->hparams.n_embd_head_k);
+                return nullptr;
+            }
         }
     }
 
-    if (ggml_is_quantized(params.type_v) && params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_DISABLED) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
-        return nullptr;
+    for (const ggml_type type_v : { params.type_v, params.type_v_swa }) {
+        if (params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_AUTO && ggml_is_quantized(type_v)) {
+            const uint32_t blck_size = ggml_blck_size(type_v);
+            if (model->hparams.n_embd_head_v % blck_size != 0) {
+                LLAMA_LOG_ERROR("%s: V cache type %s with block size %u does not divide n_embd_head_k=%u\n",
+                    __func__, ggml_type_name(type_v), blck_size, model->hparams.n_embd_head_v);
+                return nullptr;
+            }
+        }
+
+        if (ggml_is_quantized(type_v) && params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_DISABLED) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+            return nullptr;
+        }
     }
 
     try {
@@ -2694,6 +2774,72 @@ size_t llama_state_seq_save_file(llama_context * ctx, const char * filepath, lla
     }
 }
 
+size_t llama_state_seq_save_file_data(const char * filepath, const uint8_t * src, size_t size, const llama_token * tokens, size_t n_token_count) {
+    try {
+        llama_file file(filepath, "wb");
+
+        file.write_u32(LLAMA_STATE_SEQ_MAGIC);
+        file.write_u32(LLAMA_STATE_SEQ_VERSION);
+
+        // save the prompt
+        file.write_u32((uint32_t) n_token_count);
+        file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+
+        // save the captured context state
+        file.write_raw(src, size);
+
+        return file.tell();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state file: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_load_file_data(const char * filepath, uint8_t * dst, size_t size, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        llama_file file(filepath, "rb");
+
+        // version checks
+        {
+            const uint32_t magic   = file.read_u32();
+            const uint32_t version = file.read_u32();
+
+            if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
+                LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
+                return 0;
+            }
+        }
+
+        // load the prompt
+        {
+            const uint32_t n_token_count = file.read_u32();
+
+            if (n_token_count > n_token_capacity) {
+                LLAMA_LOG_ERROR("%s: token count in sequence state file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+                return 0;
+            }
+
+            file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+            *n_token_count_out = n_token_count;
+        }
+
+        // read the context state
+        const size_t state_size = file.size() - file.tell();
+
+        if (state_size > size) {
+            LLAMA_LOG_ERROR("%s: state size in sequence state file exceeded capacity! %zu > %zu\n", __func__, state_size, size);
+            return 0;
+        }
+
+        file.read_raw(dst, state_size);
+
+        return state_size;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error loading sequence state file: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
 size_t llama_state_seq_load_file(llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     ctx->synchronize();
 
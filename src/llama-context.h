@@ -182,6 +182,14 @@ private:
 
     void output_reorder();
 
+    //
+    // memory
+    //
+
+    // make room for the validated batch by evicting the oldest non-sink tokens of the sequences that would not fit
+    // the positions of the batch are shifted together with the memory
+    void memory_evict(llama_batch_allocr & balloc);
+
     //
     // graph
     //
@@ -4,7 +4,7 @@
 
 #include <cstdint>
 
-#define LLAMA_MAX_SEQ 64
+#define LLAMA_MAX_SEQ 4096
 
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
@@ -25,6 +25,10 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
 
+    float defrag_thold;
+
+    int32_t n_sink;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
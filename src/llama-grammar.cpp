@@ -903,6 +903,210 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+llama_grammar_trie::llama_grammar_trie(const llama_vocab & vocab) : n_vocab(vocab.n_tokens()) {
+    // decode all pieces and sort them, so that the tokens that share a prefix are next to each other
+    std::vector<std::pair<std::vector<uint32_t>, token>> decoded;
+    decoded.reserve(n_vocab);
+
+    for (uint32_t i = 0; i < n_vocab; ++i) {
+        const llama_token   id    = i;
+        const std::string & piece = vocab.token_to_piece(id);
+
+        if (vocab.is_eog(id)) {
+            eog_tokens.push_back(id);
+            continue;
+        }
+
+        // empty pieces and invalid UTF-8 are never allowed
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto res = decode_utf8(piece, { 0, 0 });
+        if (res.second.n_remain < 0) {
+            continue;
+        }
+
+        // drop the terminating 0
+        res.first.pop_back();
+
+        decoded.push_back({ std::move(res.first), { id, res.second } });
+    }
+
+    std::sort(decoded.begin(), decoded.end(), [](const auto & a, const auto & b) {
+        return a.first < b.first;
+    });
+
+    nodes.push_back({ 0, 0, 0, 0, 0 });
+    tokens.reserve(decoded.size());
+
+    // last child of each node, while building
+    std::vector<uint32_t> last_child(1, 0);
+
+    // nodes on the path from the root to the node of the previous piece
+    std::vector<uint32_t> path(1, 0);
+
+    const std::vector<uint32_t> * prev = nullptr;
+
+    for (const auto & cur : decoded) {
+        const auto & code_points = cur.first;
+
+        size_t n_common = 0;
+        if (prev) {
+            while (n_common < prev->size() && n_common < code_points.size() && (*prev)[n_common] == code_points[n_common]) {
+                n_common++;
+            }
+        }
+
+        path.resize(n_common + 1);
+
+        for (size_t k = n_common; k < code_points.size(); ++k) {
+            const uint32_t parent = path.back();
+            const uint32_t child  = nodes.size();
+
+            nodes.push_back({ code_points[k], 0, 0, 0, 0 });
+            last_child.push_back(0);
+
+            if (last_child[parent] == 0) {
+                nodes[parent].first_child = child;
+            } else {
+                nodes[last_child[parent]].next_sibling = child;
+            }
+            last_child[parent] = child;
+
+            path.push_back(child);
+        }
+
+        // the tokens with the same piece are next to each other
+        node & nd = nodes[path.back()];
+        if (nd.token_begin == nd.token_end) {
+            nd.token_begin = tokens.size();
+            nd.token_end   = tokens.size();
+        }
+
+        tokens.push_back(cur.second);
+        nd.token_end++;
+
+        prev = &code_points;
+    }
+
+    LLAMA_LOG_DEBUG("%s: %zu tokens, %zu nodes\n", __func__, tokens.size(), nodes.size());
+}
+
+llama_grammar_mask_cache::key_t llama_grammar_mask_cache::make_key(const llama_grammar_stacks & stacks) {
+    std::vector<const llama_grammar_stack *> sorted;
+    sorted.reserve(stacks.size());
+
+    size_t n = 0;
+    for (const auto & stack : stacks) {
+        sorted.push_back(&stack);
+        n += stack.size() + 1;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const llama_grammar_stack * a, const llama_grammar_stack * b) {
+        return *a < *b;
+    });
+
+    key_t key;
+    key.reserve(n);
+
+    for (const auto * stack : sorted) {
+        key.insert(key.end(), stack->begin(), stack->end());
+        key.push_back(nullptr);
+    }
+
+    return key;
+}
+
+const std::vector<bool> * llama_grammar_mask_cache::get(const key_t & key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+        n_miss++;
+        return nullptr;
+    }
+
+    n_hit++;
+
+    entries.splice(entries.begin(), entries, it->second);
+
+    return &it->second->second;
+}
+
+const std::vector<bool> * llama_grammar_mask_cache::put(const key_t & key, std::vector<bool> && allowed) {
+    while (!entries.empty() && entries.size() >= n_max) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+
+    entries.emplace_front(key, std::move(allowed));
+    index[key] = entries.begin();
+
+    return &entries.front().second;
+}
+
+// marks the tokens that are allowed by the stack, walking the trie from the given nodes
+// this is llama_grammar_reject_candidates_for_stack, with the candidates that share a prefix matched together
+static void llama_grammar_trie_accept(
+        const llama_grammar_rules   & rules,
+        const llama_grammar_trie    & trie,
+        const llama_grammar_stack   & stack,
+        const std::vector<uint32_t> & nodes,
+              std::vector<bool>     & allowed) {
+    if (stack.empty()) {
+        // only the tokens that end here, on a complete code point, are allowed
+        for (const uint32_t i : nodes) {
+            const auto & nd = trie.nodes[i];
+            for (uint32_t j = nd.token_begin; j < nd.token_end; ++j) {
+                if (trie.tokens[j].partial_utf8.n_remain == 0) {
+                    allowed[trie.tokens[j].id] = true;
+                }
+            }
+        }
+        return;
+    }
+
+    const llama_grammar_element * stack_pos = stack.back();
+
+    std::vector<uint32_t> next_nodes;
+
+    for (const uint32_t i : nodes) {
+        const auto & nd = trie.nodes[i];
+
+        // reached the end of these tokens, allow them unless they end in a partial sequence that cannot satisfy
+        // this position in the grammar
+        for (uint32_t j = nd.token_begin; j < nd.token_end; ++j) {
+            const auto & tok = trie.tokens[j];
+            if (tok.partial_utf8.n_remain == 0 || llama_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+                allowed[tok.id] = true;
+            }
+        }
+
+        for (uint32_t c = nd.first_child; c != 0; c = trie.nodes[c].next_sibling) {
+            if (llama_grammar_match_char(stack_pos, trie.nodes[c].chr).first) {
+                next_nodes.push_back(c);
+            }
+        }
+    }
+
+    if (next_nodes.empty()) {
+        return;
+    }
+
+    const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
+
+    // update top of stack to next element, if any
+    llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
+        stack_after.push_back(stack_pos_after);
+    }
+    llama_grammar_stacks next_stacks;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+    for (const auto & next_stack : next_stacks) {
+        llama_grammar_trie_accept(rules, trie, next_stack, next_nodes, allowed);
+    }
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -970,6 +1174,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .mask_cache = */       {},
     };
 }
 
@@ -1075,6 +1280,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .mask_cache = */       {},
     };
 }
 
@@ -1097,6 +1303,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        /* .mask_cache = */ {},
     };
 
     // redirect elements in stacks to point to new rules
@@ -1130,6 +1337,41 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // the pieces in the trie are decoded from a code point boundary, so neither the trie nor the cached masks can be
+    // used in the middle of a UTF-8 sequence
+    if (grammar.partial_utf8.n_remain <= 0) {
+        const auto key = llama_grammar_mask_cache::make_key(grammar.stacks);
+
+        const std::vector<bool> * allowed = grammar.mask_cache.get(key);
+
+        // when most of the vocab is candidate, match all of it at once using the trie and remember the result
+        if (allowed == nullptr && 4*cur_p->size >= grammar.vocab->n_tokens()) {
+            const auto & trie = grammar.vocab->get_grammar_trie();
+
+            std::vector<bool> res(trie.n_vocab, false);
+
+            for (const auto & stack : grammar.stacks) {
+                llama_grammar_trie_accept(grammar.rules, trie, stack, { 0 }, res);
+            }
+
+            for (const llama_token id : trie.eog_tokens) {
+                res[id] = allow_eog;
+            }
+
+            allowed = grammar.mask_cache.put(key, std::move(res));
+        }
+
+        if (allowed != nullptr) {
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                if (!(*allowed)[cur_p->data[i].id]) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -2,6 +2,7 @@
 
 #include "llama.h"
 
+#include <list>
 #include <map>
 #include <regex>
 #include <string>
@@ -76,6 +77,58 @@ std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
         const llama_grammar_stack      & stack,
         const llama_grammar_candidates & candidates);
 
+// code points of the pieces of all tokens of a vocab, arranged in a trie, so that the tokens that share a prefix are
+// matched against the grammar once per prefix instead of once per token
+// built once per vocab (see llama_vocab::get_grammar_trie) and shared by all grammars
+struct llama_grammar_trie {
+    struct node {
+        uint32_t chr;          // code point of the edge from the parent
+        uint32_t first_child;  // 0 - none
+        uint32_t next_sibling; // 0 - none
+        uint32_t token_begin;  // the tokens whose piece ends at this node are tokens[token_begin, token_end)
+        uint32_t token_end;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // incomplete UTF-8 sequence at the end of the piece, if any
+    };
+
+    std::vector<node>  nodes; // nodes[0] is the root
+    std::vector<token> tokens;
+
+    // EOG tokens are not in the trie, they are allowed iff the grammar can end
+    std::vector<llama_token> eog_tokens;
+
+    // number of tokens in the vocab
+    uint32_t n_vocab = 0;
+
+    explicit llama_grammar_trie(const llama_vocab & vocab);
+};
+
+// allowed tokens of the whole vocab for the grammar states seen so far, so that revisiting a state (e.g. inside a
+// string, after a comma) is a mask lookup instead of a match of the vocab
+// the key is the sorted stacks of the state, separated by nullptr - only states on a code point boundary are cached
+// the stacks point into the rules of the grammar, so the cache is not shared with clones
+struct llama_grammar_mask_cache {
+    using key_t = std::vector<const llama_grammar_element *>;
+
+    static key_t make_key(const llama_grammar_stacks & stacks);
+
+    // nullptr if not cached
+    const std::vector<bool> * get(const key_t & key);
+    const std::vector<bool> * put(const key_t & key, std::vector<bool> && allowed);
+
+    // max number of cached states, the least recently used one is evicted first
+    size_t n_max = 64;
+
+    size_t n_hit  = 0;
+    size_t n_miss = 0;
+
+    std::list<std::pair<key_t, std::vector<bool>>> entries; // most recently used first
+    std::map<key_t, std::list<std::pair<key_t, std::vector<bool>>>::iterator> index;
+};
+
 struct llama_grammar_parser {
     std::map<std::string, uint32_t> symbol_ids;
 
@@ -132,6 +185,7 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    mutable llama_grammar_mask_cache mask_cache;
 };
 
 //
@@ -11,6 +11,7 @@
 #include <limits>
 #include <map>
 #include <stdexcept>
+#include <tuple>
 
 //
 // llama_kv_cache
@@ -228,15 +229,9 @@ bool llama_kv_cache::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
 
         uint32_t new_head = cells.size();
 
-        for (uint32_t i = 0; i < cells.size(); ++i) {
-            if (!cells.pos_in(i, p0, p1)) {
-                continue;
-            }
-
-            if (cells.seq_has(i, seq_id) && cells.seq_rm(i, seq_id)) {
-                if (new_head == cells.size()) {
-                    new_head = i;
-                }
+        for (const uint32_t i : cells.seq_cells(seq_id, p0, p1)) {
+            if (cells.seq_rm(i, seq_id)) {
+                new_head = std::min(new_head, i);
             }
         }
 
@@ -252,7 +247,10 @@ bool llama_kv_cache::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
 
             uint32_t new_head = cells.size();
 
-            for (uint32_t i = 0; i < cells.size(); ++i) {
+            // only the used range can contain cells within [p0, p1)
+            const uint32_t i1 = cells.used_max_p1();
+
+            for (uint32_t i = cells.used_min(); i < i1; ++i) {
                 if (!cells.pos_in(i, p0, p1)) {
                     continue;
                 }
@@ -299,12 +297,8 @@ void llama_kv_cache::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, ll
             p1 = std::numeric_limits<llama_pos>::max();
         }
 
-        for (uint32_t i = 0; i < cells.size(); ++i) {
-            if (!cells.pos_in(i, p0, p1)) {
-                continue;
-            }
-
-            if (cells.seq_has(i, seq_id_src)) {
+        for (const uint32_t i : cells.seq_cells(seq_id_src, p0, p1)) {
+            if (!cells.seq_has(i, seq_id_dst)) {
                 cells.seq_add(i, seq_id_dst);
             }
         }
@@ -326,30 +320,36 @@ void llama_kv_cache::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, ll
 
     GGML_ASSERT(is_full && "seq_cp() is only supported for full KV buffers");
 
-    // enqueue the copy operation - the buffer copy will be performed during the next update
-    sc_info.ssrc.push_back(s0);
-    sc_info.sdst.push_back(s1);
+    uint32_t i0 = v_cells[s0].size();
+    uint32_t i1 = 0;
 
     v_cells[s1].reset();
-    for (uint32_t i = 0; i < v_cells[s0].size(); ++i) {
-        if (v_cells[s0].seq_has(i, seq_id_src)) {
-            llama_pos pos   = v_cells[s0].pos_get(i);
-            llama_pos shift = v_cells[s0].get_shift(i);
-
-            if (shift != 0) {
-                pos -= shift;
-                assert(pos >= 0);
-            }
+    for (const uint32_t i : v_cells[s0].seq_cells(seq_id_src, 0, std::numeric_limits<llama_pos>::max())) {
+        llama_pos pos   = v_cells[s0].pos_get(i);
+        llama_pos shift = v_cells[s0].get_shift(i);
 
-            v_cells[s1].pos_set(i, pos);
-            v_cells[s1].seq_add(i, seq_id_dst);
+        if (shift != 0) {
+            pos -= shift;
+            assert(pos >= 0);
+        }
 
-            if (shift != 0) {
-                v_cells[s1].pos_add(i, shift);
-            }
+        v_cells[s1].pos_set(i, pos);
+        v_cells[s1].seq_add(i, seq_id_dst);
+
+        if (shift != 0) {
+            v_cells[s1].pos_add(i, shift);
         }
+
+        i0 = std::min(i0, i);
+        i1 = std::max(i1, i + 1);
     }
 
+    // enqueue the copy operation - the buffer copy will be performed during the next update
+    sc_info.ssrc.push_back(s0);
+    sc_info.sdst.push_back(s1);
+    sc_info.i0  .push_back(std::min(i0, i1));
+    sc_info.i1  .push_back(i1);
+
     v_heads[s1] = v_heads[s0];
 
     //for (uint32_t s = 0; s < n_stream; ++s) {
@@ -365,7 +365,9 @@ void llama_kv_cache::seq_keep(llama_seq_id seq_id) {
 
     uint32_t new_head = cells.size();
 
-    for (uint32_t i = 0; i < cells.size(); ++i) {
+    const uint32_t i1 = cells.used_max_p1();
+
+    for (uint32_t i = cells.used_min(); i < i1; ++i) {
         if (cells.seq_keep(i, seq_id)) {
             if (new_head == cells.size()) {
                 new_head = i;
@@ -404,17 +406,9 @@ void llama_kv_cache::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, ll
         return;
     }
 
-    for (uint32_t i = 0; i < cells.size(); ++i) {
-        if (!cells.pos_in(i, p0, p1)) {
-            continue;
-        }
-
-        if (cells.seq_has(i, seq_id)) {
-            if (cells.pos_add(i, shift)) {
-                if (new_head == cells.size()) {
-                    new_head = i;
-                }
-            }
+    for (const uint32_t i : cells.seq_cells(seq_id, p0, p1)) {
+        if (cells.pos_add(i, shift)) {
+            new_head = std::min(new_head, i);
         }
     }
 
@@ -445,14 +439,8 @@ void llama_kv_cache::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, in
         return;
     }
 
-    for (uint32_t i = 0; i < cells.size(); ++i) {
-        if (!cells.pos_in(i, p0, p1)) {
-            continue;
-        }
-
-        if (cells.seq_has(i, seq_id)) {
-            cells.pos_div(i, d);
-        }
+    for (const uint32_t i : cells.seq_cells(seq_id, p0, p1)) {
+        cells.pos_div(i, d);
     }
 }
 
@@ -514,11 +502,23 @@ llama_memory_context_ptr llama_kv_cache::init_full() {
 }
 
 llama_memory_context_ptr llama_kv_cache::init_update(llama_context * lctx, bool optimize) {
-    GGML_UNUSED(optimize);
-
     bool do_shift = get_has_shift();
 
-    return std::make_unique<llama_kv_cache_context>(this, lctx, do_shift, std::move(sc_info));
+    defrag_info dinfo;
+
+    // compact the cache if it is fragmented beyond the threshold, or if explicitly requested
+    // the number of cells moved per update is limited to n_ubatch, so this is spread over several updates
+    {
+        const auto & cparams = lctx->get_cparams();
+
+        const float thold = optimize ? 0.0f : cparams.defrag_thold;
+
+        if (optimize || thold > 0.0f) {
+            dinfo = defrag_prepare(lctx->graph_max_nodes(), cparams.n_ubatch, thold);
+        }
+    }
+
+    return std::make_unique<llama_kv_cache_context>(this, lctx, do_shift, std::move(sc_info), std::move(dinfo));
 }
 
 llama_kv_cache::slot_info_vec_t llama_kv_cache::prepare(const std::vector<llama_ubatch> & ubatches) {
@@ -587,7 +587,8 @@ llama_kv_cache::slot_info_vec_t llama_kv_cache::prepare(const std::vector<llama_
     return res;
 }
 
-bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_copy_info & sc_info) {
+// copy the rows [i0, i1) of the stream view src into the stream view dst (used for cross-stream sequence copies)
+bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_copy_info & sc_info, const defrag_info & dinfo) {
     bool updated = false;
 
     auto * sched = lctx->get_sched();
@@ -595,28 +596,36 @@ bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_co
     if (!sc_info.empty()) {
         assert(n_stream > 1 && "stream copy should never happen with a single stream");
 
-        llama_synchronize(lctx);
+        LLAMA_LOG_DEBUG("%s: copying KV buffer between streams\n", __func__);
 
-        const size_t n_copy = sc_info.ssrc.size();
+        // each copy needs 6 nodes per layer: 2 views + 1 cpy for each of K and V
+        const size_t n_copy     = sc_info.ssrc.size();
+        const size_t n_copy_max = std::max<size_t>(1, lctx->graph_max_nodes()/(6*std::max<size_t>(1, layers.size())));
 
-        for (size_t i = 0; i < n_copy; ++i) {
-            const auto ssrc = sc_info.ssrc[i];
-            const auto sdst = sc_info.sdst[i];
+        for (size_t c0 = 0; c0 < n_copy; c0 += n_copy_max) {
+            const size_t c1 = std::min(n_copy, c0 + n_copy_max);
 
-            assert(ssrc < n_stream);
-            assert(sdst < n_stream);
+            ggml_backend_sched_reset(sched);
 
-            LLAMA_LOG_DEBUG("%s: copying KV buffer: stream %d to stream %d\n", __func__, ssrc, sdst);
+            auto * res = lctx->get_gf_res_reserve();
 
-            assert(ssrc != sdst);
+            res->reset();
 
-            for (uint32_t il = 0; il < layers.size(); ++il) {
-                const auto & layer = layers[il];
+            auto * gf = build_graph_stream_copy(res, sc_info, c0, c1);
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                LLAMA_LOG_ERROR("%s: failed to allocate compute graph for the stream copy\n", __func__);
+                return updated;
+            }
+
+            res->set_inputs(nullptr);
 
-                ggml_backend_tensor_copy(layer.k_stream[ssrc], layer.k_stream[sdst]);
-                ggml_backend_tensor_copy(layer.v_stream[ssrc], layer.v_stream[sdst]);
+            if (lctx->graph_compute(gf, false) != GGML_STATUS_SUCCESS) {
+                LLAMA_LOG_ERROR("%s: failed to compute the stream copy\n", __func__);
+                return updated;
             }
         }
+
+        updated = true;
     }
 
     if (do_shift) {
@@ -657,6 +666,39 @@ bool llama_kv_cache::update(llama_context * lctx, bool do_shift, const stream_co
         }
     }
 
+    if (!dinfo.empty()) {
+        LLAMA_LOG_DEBUG("%s: defragmenting KV cache\n", __func__);
+
+        ggml_backend_sched_reset(sched);
+
+        auto * res = lctx->get_gf_res_reserve();
+
+        res->reset();
+
+        auto * gf = build_graph_defrag(res, dinfo);
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            LLAMA_LOG_ERROR("%s: failed to allocate compute graph for defrag\n", __func__);
+            return updated;
+        }
+
+        res->set_inputs(nullptr);
+
+        if (lctx->graph_compute(gf, false) != GGML_STATUS_SUCCESS) {
+            LLAMA_LOG_ERROR("%s: failed to compute defrag\n", __func__);
+            return updated;
+        }
+
+        for (size_t i = 0; i < dinfo.strm.size(); ++i) {
+            auto & cells = v_cells[dinfo.strm[i]];
+
+            for (uint32_t j = 0; j < dinfo.len[i]; ++j) {
+                cells.mv(dinfo.src[i] + j, dinfo.dst[i] + j);
+            }
+        }
+
+        updated = true;
+    }
+
     return updated;
 }
 
@@ -862,10 +904,7 @@ llama_kv_cache::slot_info llama_kv_cache::find_slot(const llama_ubatch & ubatch,
 void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
     // keep track of the max sequence position that we would overwrite with this ubatch
     // for non-SWA cache, this would be always empty
-    llama_seq_id seq_pos_max_rm[LLAMA_MAX_SEQ];
-    for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-        seq_pos_max_rm[s] = -1;
-    }
+    std::vector<std::pair<llama_seq_id, llama_pos>> seq_pos_max_rm;
 
     assert(ubatch.n_tokens == sinfo.n_stream()*sinfo.size());
 
@@ -883,7 +922,12 @@ void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch &
                 const llama_seq_id seq_id = cells.seq_get(idx);
                 const llama_pos    pos    = cells.pos_get(idx);
 
-                seq_pos_max_rm[seq_id] = std::max(seq_pos_max_rm[seq_id], pos);
+                auto it = std::find_if(seq_pos_max_rm.begin(), seq_pos_max_rm.end(), [&](const auto & p) { return p.first == seq_id; });
+                if (it == seq_pos_max_rm.end()) {
+                    seq_pos_max_rm.emplace_back(seq_id, pos);
+                } else {
+                    it->second = std::max(it->second, pos);
+                }
 
                 cells.rm(idx);
             }
@@ -899,20 +943,16 @@ void llama_kv_cache::apply_ubatch(const slot_info & sinfo, const llama_ubatch &
     // note: we want to preserve the invariant that all positions between [pos_min, pos_max] for each sequence
     //       will be present in the cache. so we have to purge any position which is less than those we would overwrite
     //       ref: https://github.com/ggml-org/llama.cpp/pull/13746#issuecomment-2916057092
-    for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-        if (seq_pos_max_rm[s] == -1) {
-            continue;
-        }
-
-        GGML_ASSERT(s < seq_to_stream.size());
+    for (const auto & [s, pos_max_rm] : seq_pos_max_rm) {
+        GGML_ASSERT(s < (llama_seq_id) seq_to_stream.size());
 
         auto & cells = v_cells[seq_to_stream[s]];
 
-        if (cells.seq_pos_min(s) <= seq_pos_max_rm[s]) {
+        if (cells.seq_pos_min(s) <= pos_max_rm) {
             LLAMA_LOG_DEBUG("%s: purging positions [%d, %d] of sequence %d from KV cache\n",
-                    __func__, cells.seq_pos_min(s), seq_pos_max_rm[s], s);
+                    __func__, cells.seq_pos_min(s), pos_max_rm, s);
 
-            seq_rm(s, cells.seq_pos_min(s), seq_pos_max_rm[s] + 1);
+            seq_rm(s, cells.seq_pos_min(s), pos_max_rm + 1);
         }
     }
 
@@ -1167,8 +1207,6 @@ void llama_kv_cache::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * u
     const int64_t n_tps     = n_tokens/n_stream;
     const int64_t n_tps_pad = GGML_PAD(n_tps, GGML_KQ_MASK_PAD);
 
-    std::fill(data, data + ggml_nelements(dst), -INFINITY);
-
     // Use only the previous KV cells of the correct sequence for each token of the ubatch.
     // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
     // Example with a cache of 10 tokens, 2 tokens populated in cache and 3 tokens in batch:
@@ -1181,45 +1219,97 @@ void llama_kv_cache::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * u
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
-    // TODO: optimize this section
+    //
+    // For each sequence in a stream, the positions of its cells are gathered once into a row of n_kv values
+    // (-1 for cells that are empty or belong to other sequences). The set of cells visible to a token is then
+    // an interval [p0_min, p0_max] of positions, so each mask row is a single branchless pass over that array.
+    // Without ALiBi, rows with the same (seq, p0_min, p0_max) are identical and are copied instead.
+    const bool causal = causal_attn;
+
+    std::vector<llama_pos> seq_pos_cells;
+    std::map<llama_seq_id, size_t> seq_pos_off;
+    std::map<std::tuple<llama_seq_id, llama_pos, llama_pos>, uint64_t> rows;
+
     for (uint32_t h = 0; h < 1; ++h) {
         for (uint32_t s = 0; s < n_stream; ++s) {
+            seq_pos_off.clear();
+            rows.clear();
+
             for (uint32_t ii = 0; ii < n_tps; ++ii) {
                 const uint32_t i = s*n_tps + ii;
 
                 const llama_seq_id seq_id = ubatch->seq_id[i][0];
 
-                const auto & cells = v_cells[seq_to_stream[seq_id]];
-
                 const llama_pos p1 = ubatch->pos[i];
 
+                llama_pos p0_min = 0;
+                llama_pos p0_max = causal ? p1 : std::numeric_limits<llama_pos>::max();
+
+                // must match llama_hparams::is_masked_swa()
+                switch (hparams.swa_type) {
+                    case LLAMA_SWA_TYPE_NONE:
+                        break;
+                    case LLAMA_SWA_TYPE_STANDARD:
+                        p0_min = std::max(p0_min, p1 - (llama_pos) hparams.n_swa + 1);
+                        break;
+                    case LLAMA_SWA_TYPE_CHUNKED:
+                        p0_min = std::max(p0_min, (p1 / (llama_pos) hparams.n_swa) * (llama_pos) hparams.n_swa);
+                        break;
+                    case LLAMA_SWA_TYPE_SYMMETRIC:
+                        p0_min = std::max(p0_min, p1 - (llama_pos) hparams.n_swa/2);
+                        p0_max = std::min(p0_max, p1 + (llama_pos) hparams.n_swa/2);
+                        break;
+                }
+
                 const uint64_t idst = n_kv*(h*n_stream*n_tps_pad + s*n_tps_pad + ii);
 
-                for (uint32_t j = 0; j < n_kv; ++j) {
-                    if (cells.is_empty(j)) {
-                        continue;
-                    }
+                float * row = data + idst;
 
-                    // mask the token if not the same sequence
-                    if (!cells.seq_has(j, seq_id)) {
+                if (!hparams.use_alibi) {
+                    const auto it = rows.find({ seq_id, p0_min, p0_max });
+                    if (it != rows.end()) {
+                        std::copy(data + it->second, data + it->second + n_kv, row);
                         continue;
                     }
+                    rows.emplace(std::make_tuple(seq_id, p0_min, p0_max), idst);
+                }
 
-                    const llama_pos p0 = cells.pos_get(j);
+                auto it_off = seq_pos_off.find(seq_id);
+                if (it_off == seq_pos_off.end()) {
+                    const auto & cells = v_cells[seq_to_stream[seq_id]];
 
-                    // mask future tokens
-                    if (causal_attn && p0 > p1) {
-                        continue;
-                    }
+                    const size_t off = seq_pos_cells.size();
+                    seq_pos_cells.resize(off + n_kv);
 
-                    // apply SWA if any
-                    if (is_masked_swa(p0, p1)) {
-                        continue;
+                    llama_pos * pos = seq_pos_cells.data() + off;
+                    for (uint32_t j = 0; j < n_kv; ++j) {
+                        pos[j] = !cells.is_empty(j) && cells.seq_has(j, seq_id) ? cells.pos_get(j) : -1;
                     }
 
-                    data[idst + j] = hparams.use_alibi ? -std::abs(p0 - p1) : 0.0f;
+                    it_off = seq_pos_off.emplace(seq_id, off).first;
+                }
+
+                const llama_pos * pos = seq_pos_cells.data() + it_off->second;
+
+                // p0_min >= 0, so the -1 entries are always masked
+                if (hparams.use_alibi) {
+                    for (uint32_t j = 0; j < n_kv; ++j) {
+                        const llama_pos p0 = pos[j];
+                        row[j] = p0 >= p0_min && p0 <= p0_max ? (float) -std::abs(p0 - p1) : -INFINITY;
+                    }
+                } else {
+                    for (uint32_t j = 0; j < n_kv; ++j) {
+                        const llama_pos p0 = pos[j];
+                        row[j] = p0 >= p0_min && p0 <= p0_max ? 0.0f : -INFINITY;
+                    }
                 }
             }
+
+            // padded rows
+            const uint64_t ipad = n_kv*(h*n_stream*n_tps_pad + s*n_tps_pad + n_tps);
+            std::fill(data + ipad, data + ipad + n_kv*(n_tps_pad - n_tps), -INFINITY);
+
+            seq_pos_cells.clear();
         }
     }
 }
@@ -1395,6 +1485,152 @@ bool llama_kv_cache::is_masked_swa(llama_pos p0, llama_pos p1) const {
     return hparams.is_masked_swa(p0, p1);
 }
 
+void llama_kv_cache::build_copy_cells(
+        ggml_context * ctx,
+         ggml_cgraph * gf,
+            uint32_t   ssrc,
+            uint32_t   isrc,
+            uint32_t   sdst,
+            uint32_t   idst,
+            uint32_t   n) const {
+    const uint32_t kv_size = get_size();
+
+    for (const auto & layer : layers) {
+        auto * k = layer.k;
+        auto * v = layer.v;
+
+        ggml_tensor * view_k_src = ggml_view_2d(ctx, k,
+                k->ne[0], n,
+                k->nb[1],
+                ssrc*k->nb[2] + isrc*k->nb[1]);
+
+        ggml_tensor * view_k_dst = ggml_view_2d(ctx, k,
+                k->ne[0], n,
+                k->nb[1],
+                sdst*k->nb[2] + idst*k->nb[1]);
+
+        ggml_tensor * view_v_src;
+        ggml_tensor * view_v_dst;
+
+        if (!v_trans) {
+            view_v_src = ggml_view_2d(ctx, v,
+                    v->ne[0], n,
+                    v->nb[1],
+                    ssrc*v->nb[2] + isrc*v->nb[1]);
+
+            view_v_dst = ggml_view_2d(ctx, v,
+                    v->ne[0], n,
+                    v->nb[1],
+                    sdst*v->nb[2] + idst*v->nb[1]);
+        } else {
+            // the cells are the innermost dimension of the transposed V
+            view_v_src = ggml_view_2d(ctx, v,
+                    n, v->ne[0],
+                    ggml_row_size(v->type, kv_size),
+                    ssrc*v->nb[2] + ggml_row_size(v->type, isrc));
+
+            view_v_dst = ggml_view_2d(ctx, v,
+                    n, v->ne[0],
+                    ggml_row_size(v->type, kv_size),
+                    sdst*v->nb[2] + ggml_row_size(v->type, idst));
+        }
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+    }
+}
+
+ggml_cgraph * llama_kv_cache::build_graph_stream_copy(
+        llm_graph_result * res,
+        const stream_copy_info & sc_info,
+        size_t c0,
+        size_t c1) const {
+    auto * ctx = res->get_ctx();
+    auto * gf  = res->get_gf();
+
+    for (size_t i = c0; i < c1; ++i) {
+        const uint32_t ssrc = sc_info.ssrc[i];
+        const uint32_t sdst = sc_info.sdst[i];
+        const uint32_t i0   = sc_info.i0[i];
+        const uint32_t nm   = sc_info.i1[i] - i0;
+
+        assert(ssrc < n_stream);
+        assert(sdst < n_stream);
+        assert(ssrc != sdst);
+
+        LLAMA_LOG_DEBUG("%s: copying KV buffer: stream %d to stream %d, cells [%d, %d)\n", __func__, ssrc, sdst, i0, i0 + nm);
+
+        if (nm == 0) {
+            continue;
+        }
+
+        build_copy_cells(ctx, gf, ssrc, i0, sdst, i0, nm);
+    }
+
+    return gf;
+}
+
+ggml_cgraph * llama_kv_cache::build_graph_defrag(
+        llm_graph_result * res,
+        const defrag_info & dinfo) const {
+    auto * ctx = res->get_ctx();
+    auto * gf  = res->get_gf();
+
+    for (size_t i = 0; i < dinfo.strm.size(); ++i) {
+        build_copy_cells(ctx, gf, dinfo.strm[i], dinfo.src[i], dinfo.strm[i], dinfo.dst[i], dinfo.len[i]);
+    }
+
+    return gf;
+}
+
+llama_kv_cache::defrag_info llama_kv_cache::defrag_prepare(uint32_t n_max_nodes, uint32_t n_max_moves, float thold) const {
+    defrag_info res;
+
+    // each run of moved cells needs 6 nodes per layer: 2 views + 1 cpy for each of K and V
+    const uint32_t n_max_runs = n_max_nodes/(6*std::max<uint32_t>(1, layers.size()));
+
+    uint32_t n_moves = 0;
+
+    for (uint32_t s = 0; s < n_stream; ++s) {
+        const auto & cells = v_cells[s];
+
+        const uint32_t n_used = cells.get_used();
+        const uint32_t n_kv   = GGML_PAD(cells.used_max_p1(), n_pad);
+
+        if (n_kv == 0) {
+            continue;
+        }
+
+        // holes smaller than the padding do not reduce n_kv
+        const float fragmentation = std::max(0.0f, 1.0f - float(n_used + n_pad)/n_kv);
+
+        if (fragmentation <= thold) {
+            continue;
+        }
+
+        const auto runs = cells.compact_plan(n_max_moves - n_moves, n_max_runs - res.strm.size());
+
+        for (const auto & run : runs) {
+            res.strm.push_back(s);
+            res.src .push_back(run.src);
+            res.dst .push_back(run.dst);
+            res.len .push_back(run.len);
+
+            n_moves += run.len;
+        }
+
+        if (n_moves >= n_max_moves || res.strm.size() >= n_max_runs) {
+            break;
+        }
+    }
+
+    if (!res.empty()) {
+        LLAMA_LOG_DEBUG("%s: moving %u cells in %zu runs\n", __func__, n_moves, res.strm.size());
+    }
+
+    return res;
+}
+
 void llama_kv_cache::state_write(llama_io_write_i & io, llama_seq_id seq_id, llama_state_seq_flags flags) const {
     GGML_UNUSED(flags);
 
@@ -1867,8 +2103,9 @@ llama_kv_cache_context::llama_kv_cache_context(
         llama_kv_cache * kv,
         llama_context * lctx,
         bool do_shift,
-        stream_copy_info sc_info) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), sc_info(std::move(sc_info)) {
-    if (!do_shift && this->sc_info.empty()) {
+        stream_copy_info sc_info,
+        defrag_info dinfo) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), sc_info(std::move(sc_info)), dinfo(std::move(dinfo)) {
+    if (!do_shift && this->sc_info.empty() && this->dinfo.empty()) {
         status = LLAMA_MEMORY_STATUS_NO_UPDATE;
     }
 }
@@ -1896,7 +2133,7 @@ bool llama_kv_cache_context::apply() {
 
     // no ubatches -> this is a KV cache update
     if (ubatches.empty()) {
-        kv->update(lctx, do_shift, sc_info);
+        kv->update(lctx, do_shift, sc_info, dinfo);
 
         return true;
     }
@@ -29,6 +29,22 @@ public:
 
         std::vector<uint32_t> ssrc;
         std::vector<uint32_t> sdst;
+
+        // only the cells [i0, i1) of the source stream hold the copied sequence and need to be copied
+        std::vector<uint32_t> i0;
+        std::vector<uint32_t> i1;
+    };
+
+    // runs of cells to move: [src[i], src[i] + len[i]) -> [dst[i], dst[i] + len[i]) within stream strm[i]
+    struct defrag_info {
+        bool empty() const {
+            return strm.empty();
+        }
+
+        std::vector<uint32_t> strm;
+        std::vector<uint32_t> src;
+        std::vector<uint32_t> dst;
+        std::vector<uint32_t> len;
     };
 
     // for each ubatch, create a slot_info that contains information about where the ubatch should be inserted in the
@@ -156,7 +172,7 @@ public:
     // return empty vector on failure
     slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
 
-    bool update(llama_context * lctx, bool do_shift, const stream_copy_info & sc_info);
+    bool update(llama_context * lctx, bool do_shift, const stream_copy_info & sc_info, const defrag_info & dinfo);
 
     // find a slot of kv cells that can hold the ubatch
     // if cont == true, then the slot must be continuous
@@ -238,6 +254,10 @@ private:
 
     bool is_masked_swa(llama_pos p0, llama_pos p1) const;
 
+    // plan the next compaction step: move the last used cells of each fragmented stream into the holes below them
+    // at most n_max_moves cells are moved per step, so the cost of one step is bounded
+    defrag_info defrag_prepare(uint32_t n_max_nodes, uint32_t n_max_moves, float thold) const;
+
     ggml_tensor * build_rope_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
@@ -247,6 +267,27 @@ private:
                           float   freq_base,
                           float   freq_scale) const;
 
+    // copy the cells [isrc, isrc + n) of stream ssrc to the cells [idst, idst + n) of stream sdst, in all layers
+    void build_copy_cells(
+            ggml_context * ctx,
+             ggml_cgraph * gf,
+                uint32_t   ssrc,
+                uint32_t   isrc,
+                uint32_t   sdst,
+                uint32_t   idst,
+                uint32_t   n) const;
+
+    // copy the cells [i0, i1) of the stream copies [c0, c1) of sc_info
+    ggml_cgraph * build_graph_stream_copy(
+            llm_graph_result * res,
+            const stream_copy_info & sc_info,
+            size_t c0,
+            size_t c1) const;
+
+    ggml_cgraph * build_graph_defrag(
+            llm_graph_result * res,
+            const defrag_info & dinfo) const;
+
     ggml_cgraph * build_graph_shift(
                llm_graph_result * res,
                   llama_context * lctx) const;
@@ -269,6 +310,7 @@ public:
     // some shorthands
     using slot_info_vec_t  = llama_kv_cache::slot_info_vec_t;
     using stream_copy_info = llama_kv_cache::stream_copy_info;
+    using defrag_info      = llama_kv_cache::defrag_info;
 
     // used for errors
     llama_kv_cache_context(llama_memory_status status);
@@ -282,7 +324,8 @@ public:
             llama_kv_cache * kv,
             llama_context * lctx,
             bool do_shift,
-            stream_copy_info sc_info);
+            stream_copy_info sc_info,
+            defrag_info dinfo);
 
     // used to create a batch procesing context from a batch
     llama_kv_cache_context(
@@ -340,6 +383,8 @@ private:
 
     stream_copy_info sc_info;
 
+    defrag_info dinfo;
+
     //
     // batch processing context
     //
@@ -3,11 +3,13 @@
 #include "llama.h"
 #include "llama-cparams.h"
 
+#include <algorithm>
 #include <bitset>
 #include <cassert>
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_map>
 
 // meta information about KV cells that can be part of multiple sequences at the same time
 // TODO: add unit tests
@@ -17,16 +19,17 @@ public:
         for (uint32_t i = 0; i < pos.size(); ++i) {
             pos[i]   = -1;
             shift[i] =  0;
-            seq[i].reset();
+            seq[i]   = -1;
         }
 
         has_shift = false;
 
         used.clear();
 
-        for (uint32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            seq_pos[s].clear();
-        }
+        seq_shared.clear();
+        seq_shared_free.clear();
+
+        seq_pos.clear();
     }
 
     void reset_shift() {
@@ -77,24 +80,81 @@ public:
     }
 
     // move cell isrc to idst (used during defrag)
-    //void mv(uint32_t isrc, uint32_t idst) {
-    //    assert(isrc < pos.size());
-    //    assert(idst < pos.size());
+    void mv(uint32_t isrc, uint32_t idst) {
+        assert(isrc < pos.size());
+        assert(idst < pos.size());
+
+        assert(pos[idst] == -1);
+        assert(pos[isrc] != -1);
+
+        // seq_pos refers to the cells by index
+        seq_pos_rm(isrc);
+
+        pos  [idst] = pos  [isrc];
+        shift[idst] = shift[isrc];
+        seq  [idst] = seq  [isrc]; // a shared set changes owner, no need to copy it
+
+        pos  [isrc] = -1;
+        shift[isrc] =  0;
+        seq  [isrc] = -1;
+
+        seq_pos_add(idst);
+
+        used.erase (isrc);
+        used.insert(idst);
+    }
+
+    // a run of cells to move with mv(): [src, src + len) -> [dst, dst + len)
+    struct mv_run {
+        uint32_t src;
+        uint32_t dst;
+        uint32_t len;
+    };
+
+    // plan a compaction step (used during defrag): all holes below get_used() are filled with the used cells at or
+    // above it, so that after the full compaction the used cells are exactly [0, get_used())
+    // the first holes are paired with the last used cells, in ascending order, so that contiguous cells form one run
+    // at most n_max_moves cells in at most n_max_runs runs are planned, the cells themselves are not changed
+    std::vector<mv_run> compact_plan(uint32_t n_max_moves, uint32_t n_max_runs) const {
+        std::vector<mv_run> res;
 
-    //    assert(pos[idst] == -1);
-    //    assert(pos[isrc] != -1);
+        const uint32_t n_used = get_used();
 
-    //    pos  [idst] = pos  [isrc];
-    //    shift[idst] = shift[isrc];
-    //    seq  [idst] = seq  [isrc];
+        std::vector<uint32_t> holes;
+        std::vector<uint32_t> srcs;
 
-    //    pos  [isrc] = -1;
-    //    shift[isrc] =  0;
-    //    seq  [isrc].reset();
+        for (uint32_t i = 0; i < n_used; ++i) {
+            if (is_empty(i)) {
+                holes.push_back(i);
+            }
+        }
+
+        for (auto it = used.lower_bound(n_used); it != used.end(); ++it) {
+            srcs.push_back(*it);
+        }
+
+        assert(holes.size() == srcs.size());
+
+        const size_t n_cur = std::min<size_t>(holes.size(), n_max_moves);
+        const size_t i0    = srcs.size() - n_cur;
+
+        for (size_t j = 0; j < n_cur; ++j) {
+            const uint32_t is = srcs[i0 + j];
+            const uint32_t id = holes[j];
+
+            if (!res.empty() && res.back().src + res.back().len == is && res.back().dst + res.back().len == id) {
+                res.back().len++;
+            } else {
+                if (res.size() >= n_max_runs) {
+                    break;
+                }
+
+                res.push_back({ is, id, 1 });
+            }
+        }
 
-    //    used.erase (isrc);
-    //    used.insert(idst);
-    //}
+        return res;
+    }
 
     // copy the state of cells [i, i + n) (used for save/restore the state of the cells)
     llama_kv_cells cp(uint32_t i, uint32_t n) const {
@@ -108,7 +168,7 @@ public:
             const auto idx = i + j;
 
             res.pos[j] = pos[idx];
-            res.seq[j] = seq[idx];
+            res.seq_assign(j, *this, idx);
 
             assert(shift[idx] == 0);
         }
@@ -126,7 +186,7 @@ public:
             const auto idx = idxs[j];
 
             res.pos[j] = pos[idx];
-            res.seq[j] = seq[idx];
+            res.seq_assign(j, *this, idx);
 
             assert(shift[idx] == 0);
         }
@@ -154,7 +214,7 @@ public:
             }
 
             pos[idx] = other.pos[j];
-            seq[idx] = other.seq[j];
+            seq_assign(idx, other, j);
 
             if (pos[idx] != -1) {
                 seq_pos_add(i + j);
@@ -184,7 +244,7 @@ public:
             }
 
             pos[idx] = other.pos[j];
-            seq[idx] = other.seq[j];
+            seq_assign(idx, other, j);
 
             if (pos[idx] != -1) {
                 seq_pos_add(idx);
@@ -200,7 +260,7 @@ public:
         assert(pos[i] != -1);
 
         seq_pos_rm(i);
-        seq[i].reset();
+        seq_clear(i);
 
         pos[i] = -1;
         shift[i] = 0;
@@ -212,14 +272,15 @@ public:
     // return true if the cell becomes empty
     bool seq_rm(uint32_t i, llama_seq_id seq_id) {
         assert(i < pos.size());
-        assert(seq[i].test(seq_id));
+        assert(seq_has(i, seq_id));
         assert(pos[i] != -1);
         assert(seq_id >= 0);
 
-        seq[i].reset(seq_id);
-        seq_pos_dec(seq_id, pos[i]);
+        seq_pos_dec(seq_id, pos[i], i);
+
+        if (seq[i] >= 0) {
+            seq[i] = -1;
 
-        if (seq[i].none()) {
             pos[i] = -1;
             shift[i] = 0;
 
@@ -228,6 +289,25 @@ public:
             return true;
         }
 
+        seq_shared_t & cur = seq_shared[-seq[i] - 2];
+
+        cur.mask.reset(seq_id);
+        for (size_t k = 0; k < cur.ids.size(); ++k) {
+            if (cur.ids[k] == seq_id) {
+                cur.ids[k] = cur.ids.back();
+                cur.ids.pop_back();
+                break;
+            }
+        }
+
+        // a shared set always has at least 2 sequences - go back to the single-owner form
+        if (cur.ids.size() == 1) {
+            const llama_seq_id seq_id_last = cur.ids[0];
+
+            seq_clear(i);
+            seq[i] = seq_id_last;
+        }
+
         return false;
     }
 
@@ -235,19 +315,19 @@ public:
     bool seq_keep(uint32_t i, llama_seq_id seq_id) {
         assert(i < pos.size());
 
-        if (seq[i].test(seq_id)) {
+        if (seq_has(i, seq_id)) {
             seq_pos_rm(i);
-            seq[i].reset();
+            seq_clear(i);
 
-            seq[i].set(seq_id);
-            seq_pos_inc(seq_id, pos[i]);
+            seq[i] = seq_id;
+            seq_pos_inc(seq_id, pos[i], i);
 
             return false;
         }
 
-        if (seq[i].any()) {
+        if (seq[i] != -1) {
             seq_pos_rm(i);
-            seq[i].reset();
+            seq_clear(i);
 
             pos[i] = -1;
             shift[i] = 0;
@@ -267,7 +347,11 @@ public:
         assert(i < pos.size());
         assert(pos[i] != -1);
 
-        return seq[i].count();
+        if (seq[i] < -1) {
+            return seq_shared[-seq[i] - 2].ids.size();
+        }
+
+        return seq[i] >= 0 ? 1 : 0;
     }
 
     // check if the cell contains seq_id
@@ -275,31 +359,47 @@ public:
         assert(i < pos.size());
         assert(seq_id >= 0);
 
-        return seq[i].test(seq_id);
+        if (seq[i] < -1) {
+            return seq_shared[-seq[i] - 2].mask.test(seq_id);
+        }
+
+        return seq[i] == seq_id;
     }
 
     // note: call only if the cell is not empty and the seq_id is not in the cell
     void seq_add(uint32_t i, llama_seq_id seq_id) {
         assert(i < pos.size());
         assert(pos[i] != -1);
-        assert(!seq[i].test(seq_id));
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+        assert(!seq_has(i, seq_id));
+
+        if (seq[i] == -1) {
+            seq[i] = seq_id;
+        } else {
+            if (seq[i] >= 0) {
+                const llama_seq_id seq_id_prev = seq[i];
+
+                seq[i] = -seq_shared_alloc() - 2;
+
+                seq_shared_t & cur = seq_shared[-seq[i] - 2];
+                cur.mask.set(seq_id_prev);
+                cur.ids.push_back(seq_id_prev);
+            }
+
+            seq_shared_t & cur = seq_shared[-seq[i] - 2];
+            cur.mask.set(seq_id);
+            cur.ids.push_back(seq_id);
+        }
 
-        seq[i].set(seq_id);
-        seq_pos_inc(seq_id, pos[i]);
+        seq_pos_inc(seq_id, pos[i], i);
     }
 
     // return the sequence id of this cell
     // note: call only for cells with exactly one sequence
     llama_seq_id seq_get(uint32_t i) const {
-        assert(seq[i].count() == 1);
+        assert(seq[i] >= 0);
 
-        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq[i].test(s)) {
-                return s;
-            }
-        }
-
-        return -1;
+        return seq[i];
     }
 
     // the minimum position of sequence seq_id currently present in any of the cells
@@ -308,13 +408,12 @@ public:
         assert(seq_id >= 0);
         assert(seq_id < LLAMA_MAX_SEQ);
 
-        if (seq_pos[seq_id].empty()) {
+        const auto it = seq_pos.find(seq_id);
+        if (it == seq_pos.end()) {
             return -1;
         }
 
-        assert(seq_pos[seq_id].begin()->second > 0);
-
-        return seq_pos[seq_id].begin()->first;
+        return it->second.begin()->first;
     }
 
     // the maximum position of sequence seq_id currently present in any of the cells
@@ -323,13 +422,32 @@ public:
         assert(seq_id >= 0);
         assert(seq_id < LLAMA_MAX_SEQ);
 
-        if (seq_pos[seq_id].empty()) {
+        const auto it = seq_pos.find(seq_id);
+        if (it == seq_pos.end()) {
             return -1;
         }
 
-        assert(seq_pos[seq_id].rbegin()->second > 0);
+        return it->second.rbegin()->first;
+    }
+
+    // the indices of the cells that contain seq_id and have a position within [p0, p1)
+    // the cost is proportional to the number of cells of the sequence, not to the size of the cache
+    std::vector<uint32_t> seq_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+        assert(seq_id >= 0);
+        assert(seq_id < LLAMA_MAX_SEQ);
+
+        std::vector<uint32_t> res;
+
+        const auto it_s = seq_pos.find(seq_id);
+        if (it_s == seq_pos.end()) {
+            return res;
+        }
 
-        return seq_pos[seq_id].rbegin()->first;
+        for (auto it = it_s->second.lower_bound(p0); it != it_s->second.end() && it->first < p1; ++it) {
+            res.push_back(it->second);
+        }
+
+        return res;
     }
 
     // note: call only if the cell is not empty
@@ -361,7 +479,7 @@ public:
     void pos_set(uint32_t i, llama_pos p) {
         assert(i < pos.size());
         assert(pos[i] == -1);
-        assert(seq[i].none());
+        assert(seq[i] == -1);
 
         pos[i] = p;
 
@@ -383,7 +501,7 @@ public:
         has_shift = true;
 
         if (pos[i] < 0) {
-            seq[i].reset();
+            seq_clear(i);
             pos[i] = -1;
             shift[i] = 0;
 
@@ -443,48 +561,123 @@ private:
 
     using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
 
-    // the bitset seq[i] tells us which sequences are currently occupying the i-th cell
-    std::vector<seq_set_t> seq;
+    // a set of 2 or more sequences sharing a cell
+    // the mask gives O(1) membership tests, the ids give O(n) iteration over the members
+    struct seq_shared_t {
+        seq_set_t mask;
+
+        std::vector<llama_seq_id> ids;
+    };
+
+    // seq[i] tells us which sequences are currently occupying the i-th cell:
+    //
+    //   seq[i] >=  0: the cell belongs only to sequence seq[i] (the common case)
+    //   seq[i] == -1: the cell does not belong to any sequence
+    //   seq[i] <= -2: the cell is shared by the sequences in seq_shared[-seq[i] - 2]
+    //
+    // this keeps the per-cell cost independent of LLAMA_MAX_SEQ for cells that are not shared
+    std::vector<int32_t> seq;
+
+    std::vector<seq_shared_t> seq_shared;
+    std::vector<int32_t>      seq_shared_free; // unused entries of seq_shared
 
-    // the set seq_pos[s][p] tells us how many times the position p is currently present for sequence s
-    // if the position p is not present, seq_pos[s][p] is not set
+    // the multimap seq_pos[s] maps each position p of sequence s to the indices of the cells that hold it
     // this way seq_pos[s].begin() and seq_pos[s].rbegin() give us the min/max positions currently in the cache
+    // and the cells of a sequence in a range of positions can be visited without scanning the whole cache
     //
-    // note that we cannot a use an std::set because in some cases a position can occur more than once for the same seq:
+    // note that a position can occur more than once for the same seq:
     //  - during performing a cache reuse via (rm + add)
     //  - some vision models have input embeddings with repeating positions
     //
-    std::map<llama_pos, int> seq_pos[LLAMA_MAX_SEQ];
+    // only the sequences that are present in the cells have an entry
+    //
+    std::unordered_map<llama_seq_id, std::multimap<llama_pos, uint32_t>> seq_pos;
+
+    // helper functions for the shared sequence sets:
+
+    int32_t seq_shared_alloc() {
+        if (!seq_shared_free.empty()) {
+            const int32_t res = seq_shared_free.back();
+            seq_shared_free.pop_back();
+
+            return res;
+        }
+
+        seq_shared.emplace_back();
+
+        return seq_shared.size() - 1;
+    }
+
+    // remove all sequences from cell i, without updating `seq_pos`
+    void seq_clear(uint32_t i) {
+        if (seq[i] < -1) {
+            const int32_t idx = -seq[i] - 2;
+
+            seq_shared[idx].mask.reset();
+            seq_shared[idx].ids.clear();
+
+            seq_shared_free.push_back(idx);
+        }
+
+        seq[i] = -1;
+    }
+
+    // set the sequences of cell i to the ones of cell j in other, without updating `seq_pos`
+    void seq_assign(uint32_t i, const llama_kv_cells & other, uint32_t j) {
+        seq_clear(i);
+
+        if (other.seq[j] < -1) {
+            const int32_t idx = seq_shared_alloc();
+
+            seq_shared[idx] = other.seq_shared[-other.seq[j] - 2];
+
+            seq[i] = -idx - 2;
+        } else {
+            seq[i] = other.seq[j];
+        }
+    }
 
     // helper functions for updating `seq_pos`, once cell at a time:
 
-    void seq_pos_dec(llama_seq_id s, llama_pos p) {
-        auto it = seq_pos[s].find(p);
-        assert(it != seq_pos[s].end());
+    void seq_pos_dec(llama_seq_id s, llama_pos p, uint32_t i) {
+        auto it_s = seq_pos.find(s);
+        assert(it_s != seq_pos.end());
+
+        auto range = it_s->second.equal_range(p);
+        while (range.first != range.second && range.first->second != i) {
+            ++range.first;
+        }
+        assert(range.first != range.second);
+
+        it_s->second.erase(range.first);
 
-        if (--it->second == 0) {
-            seq_pos[s].erase(it);
+        if (it_s->second.empty()) {
+            seq_pos.erase(it_s);
         }
     }
 
-    void seq_pos_inc(llama_seq_id s, llama_pos p) {
-        seq_pos[s][p]++;
+    void seq_pos_inc(llama_seq_id s, llama_pos p, uint32_t i) {
+        seq_pos[s].emplace(p, i);
     }
 
     // remove cell i
     void seq_pos_rm(uint32_t i) {
-        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq[i].test(s)) {
-                seq_pos_dec(s, pos[i]);
+        if (seq[i] >= 0) {
+            seq_pos_dec(seq[i], pos[i], i);
+        } else if (seq[i] < -1) {
+            for (const llama_seq_id s : seq_shared[-seq[i] - 2].ids) {
+                seq_pos_dec(s, pos[i], i);
             }
         }
     }
 
     // add cell i
     void seq_pos_add(uint32_t i) {
-        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq[i].test(s)) {
-                seq_pos_inc(s, pos[i]);
+        if (seq[i] >= 0) {
+            seq_pos_inc(seq[i], pos[i], i);
+        } else if (seq[i] < -1) {
+            for (const llama_seq_id s : seq_shared[-seq[i] - 2].ids) {
+                seq_pos_inc(s, pos[i], i);
             }
         }
     }
@@ -17,6 +17,10 @@ struct llama_memory_params {
     ggml_type type_k;
     ggml_type type_v;
 
+    // kv cache of the SWA layers
+    ggml_type type_k_swa;
+    ggml_type type_v_swa;
+
     // use full-size SWA cache
     bool swa_full;
 };
@@ -273,7 +273,7 @@ struct llama_mmap::impl {
 #ifdef _POSIX_MAPPED_FILES
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         size = file->size();
         int fd = file->file_id();
         int flags = MAP_SHARED;
@@ -283,13 +283,19 @@ struct llama_mmap::impl {
             LLAMA_LOG_WARN("warning: posix_fadvise(.., POSIX_FADV_SEQUENTIAL) failed: %s\n",
                     strerror(errno));
         }
-        if (prefetch) { flags |= MAP_POPULATE; }
+        // with huge pages the pages must be faulted in after madvise(MADV_HUGEPAGE), so MAP_POPULATE is
+        // replaced by the POSIX_MADV_WILLNEED below
+        if (prefetch && !hugepages) { flags |= MAP_POPULATE; }
 #endif
         addr = mmap(NULL, file->size(), PROT_READ, flags, fd, 0);
         if (addr == MAP_FAILED) {
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
 
+        if (hugepages) {
+            llama_madvise_hugepages(addr, file->size());
+        }
+
         if (prefetch > 0) {
             if (posix_madvise(addr, std::min(file->size(), prefetch), POSIX_MADV_WILLNEED)) {
                 LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
@@ -362,8 +368,9 @@ struct llama_mmap::impl {
         }
     }
 #elif defined(_WIN32)
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         size = file->size();
 
@@ -418,10 +425,11 @@ struct llama_mmap::impl {
         }
     }
 #else
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         GGML_UNUSED(file);
         GGML_UNUSED(prefetch);
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         throw std::runtime_error("mmap not supported");
     }
@@ -438,7 +446,7 @@ struct llama_mmap::impl {
     size_t size;
 };
 
-llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa) : pimpl(std::make_unique<impl>(file, prefetch, numa)) {}
+llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) : pimpl(std::make_unique<impl>(file, prefetch, numa, hugepages)) {}
 llama_mmap::~llama_mmap() = default;
 
 size_t llama_mmap::size() const { return pimpl->size; }
@@ -598,3 +606,29 @@ const bool llama_mlock::SUPPORTED = false;
 size_t llama_path_max() {
     return PATH_MAX;
 }
+
+bool llama_madvise_hugepages(void * addr, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // madvise requires a page-aligned start, so shrink the range to the whole pages inside of it
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t first  = ((uintptr_t) addr + page_size - 1) & ~(uintptr_t) (page_size - 1);
+    const uintptr_t last   = ((uintptr_t) addr + size) & ~(uintptr_t) (page_size - 1);
+    if (last <= first) {
+        return false;
+    }
+
+    if (madvise((void *) first, last - first, MADV_HUGEPAGE)) {
+        LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n"
+                "Check that transparent huge pages are enabled ('/sys/kernel/mm/transparent_hugepage/enabled').\n",
+                strerror(errno));
+        return false;
+    }
+
+    return true;
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+
+    return false;
+#endif
+}
@@ -36,7 +36,7 @@ private:
 
 struct llama_mmap {
     llama_mmap(const llama_mmap &) = delete;
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false);
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false, bool hugepages = false);
     ~llama_mmap();
 
     size_t size() const;
@@ -66,3 +66,6 @@ private:
 };
 
 size_t llama_path_max();
+
+// advise the kernel to back [addr, addr + size) with transparent huge pages, returns false if not supported or failed
+bool llama_madvise_hugepages(void * addr, size_t size);
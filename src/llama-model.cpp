@@ -1969,13 +1969,15 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     const auto & split_mode   = params.split_mode;
     const auto & n_gpu_layers = params.n_gpu_layers;
     const auto & use_mlock    = params.use_mlock;
+    const auto & use_hugepages = params.use_hugepages;
     const auto & tensor_split = params.tensor_split;
 
     const int n_layer = hparams.n_layer;
 
     const bool use_mmap_buffer = true;
 
-    LLAMA_LOG_INFO("%s: loading model tensors, this can take a while... (mmap = %s)\n", __func__, ml.use_mmap ? "true" : "false");
+    LLAMA_LOG_INFO("%s: loading model tensors, this can take a while... (mmap = %s, hugepages = %s)\n", __func__,
+            ml.use_mmap ? "true" : "false", use_hugepages ? "true" : "false");
 
     // build a list of buffer types for the CPU and GPU devices
     pimpl->cpu_buft_list = make_cpu_buft_list(devices, params.use_extra_bufts);
@@ -5732,7 +5734,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr, use_hugepages);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -5795,6 +5797,10 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
             }
             pimpl->bufs.emplace_back(buf);
+            if (use_hugepages && ggml_backend_buffer_is_host(buf)) {
+                // the buffer is still untouched here, so the pages are faulted in as huge pages when the weights are read into it
+                llama_madvise_hugepages(ggml_backend_buffer_get_base(buf), ggml_backend_buffer_get_size(buf));
+            }
             if (use_mlock && ggml_backend_buffer_is_host(buf)) {
                 pimpl->mlock_bufs.emplace_back(new llama_mlock);
                 auto & mlock_buf = pimpl->mlock_bufs.back();
@@ -18726,6 +18732,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 *this,
                                 params.type_k,
                                 params.type_v,
+                                params.type_k_swa,
+                                params.type_v_swa,
                                 !cparams.flash_attn,
                                 cparams.offload_kqv,
                                 params.swa_full,
@@ -19160,6 +19168,7 @@ llama_model_params llama_model_default_params() {
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
         /*.use_extra_bufts             =*/ true,
+        /*.use_hugepages               =*/ false,
     };
 
     return result;
@@ -128,10 +128,27 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+// scratch buffers of a sampler, reused across calls so that the sampling loop does not allocate once they have grown
+// to the number of candidates
+struct llama_sampler_scratch {
+    std::vector<llama_token_data>   data;
+    std::vector<int>                bucket_idx;
+    std::vector<int>                histo;
+    std::vector<llama_token_data *> bucket_ptrs;
+    std::vector<float>              scores;
+    std::vector<size_t>             indices;
+};
+
 // writes result in res, does not mutate cur
-static void llama_token_data_array_partial_sort(const llama_token_data_array & cur, int npartial, std::vector<llama_token_data> & res) {
+// descending logits, the ties in the order of the token ids - the result does not depend on the order of the candidates,
+// so a subset that contains the top candidates (e.g. from the prefilter in common_sampler) sorts the same way
+static bool llama_token_data_greater(const llama_token_data & a, const llama_token_data & b) {
+    return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+}
+
+static void llama_token_data_array_partial_sort(const llama_token_data_array & cur, int npartial, std::vector<llama_token_data> & res, llama_sampler_scratch & scratch) {
     static const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
-        return a.logit > b.logit;
+        return llama_token_data_greater(a, b);
     };
 
     constexpr int   nbuckets     = 128;
@@ -140,13 +157,15 @@ static void llama_token_data_array_partial_sort(const llama_token_data_array & c
     constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
     constexpr float bucket_inter = -bucket_low * bucket_scale;
 
-    std::vector<int> bucket_idx;
-    std::vector<int> histo(nbuckets, 0);
-
-    std::vector<llama_token_data*> bucket_ptrs;
+    auto & bucket_idx  = scratch.bucket_idx;
+    auto & histo       = scratch.histo;
+    auto & bucket_ptrs = scratch.bucket_ptrs;
 
+    bucket_idx.clear();
     bucket_idx.reserve(cur.size);
 
+    histo.assign(nbuckets, 0);
+
     for (int i = 0; i < (int)cur.size; ++i) {
         const float val = cur.data[i].logit;
         int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
@@ -164,6 +183,7 @@ static void llama_token_data_array_partial_sort(const llama_token_data_array & c
     }
     res.resize(nhave);
     auto * ptr = res.data();
+    bucket_ptrs.clear();
     bucket_ptrs.reserve(nbuckets - ib);
     for (int j = nbuckets - 1; j >= ib; --j) {
         bucket_ptrs.push_back(ptr);
@@ -187,9 +207,9 @@ static void llama_token_data_array_partial_sort(const llama_token_data_array & c
 }
 
 // reduces the size of cur_p to npartial, keeping only the top npartial elements
-static void llama_token_data_array_partial_sort_inplace(llama_token_data_array * cur_p, int npartial) {
+static void llama_token_data_array_partial_sort_inplace(llama_token_data_array * cur_p, int npartial, llama_sampler_scratch & scratch) {
     static const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
-        return a.logit > b.logit;
+        return llama_token_data_greater(a, b);
     };
 
     if (npartial <= 128) {
@@ -201,9 +221,9 @@ static void llama_token_data_array_partial_sort_inplace(llama_token_data_array *
         return;
     }
 
-    std::vector<llama_token_data> tmp;
+    auto & tmp = scratch.data;
 
-    llama_token_data_array_partial_sort(*cur_p, npartial, tmp);
+    llama_token_data_array_partial_sort(*cur_p, npartial, tmp, scratch);
 
     std::copy(tmp.data(), tmp.data() + npartial, cur_p->data);
 
@@ -211,36 +231,30 @@ static void llama_token_data_array_partial_sort_inplace(llama_token_data_array *
     cur_p->sorted = true;
 }
 
+// same as std::discrete_distribution over the probabilities (and the same draws with libstdc++), without allocating
+// the cumulative probabilities
 static int llama_sample_dist(llama_token_data_array * cur_p, std::mt19937 & rng) {
-    // iterator for the probabilities
-#ifdef __GNUC__
-    #pragma GCC diagnostic push
-    #pragma GCC diagnostic ignored "-Wunused-local-typedefs"
-#endif
-
-    struct probs_iterator {
-        typedef std::input_iterator_tag iterator_category;
-        typedef float value_type;
-        typedef float * pointer;
-        typedef float & reference;
-        typedef ptrdiff_t difference_type;
-
-        const llama_token_data * data;
+    if (cur_p->size < 2) {
+        return 0;
+    }
 
-        bool operator==(const probs_iterator & other) const { return data == other.data; }
-        bool operator!=(const probs_iterator & other) const { return data != other.data; }
-        const float & operator*() const { return data->p; }
-        probs_iterator & operator++() { ++data; return *this; }
-        probs_iterator operator++(int) { probs_iterator tmp = *this; ++data; return tmp; }
-    };
+    double sum = 0.0;
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        sum += cur_p->data[i].p;
+    }
 
-#ifdef __GNUC__
-    #pragma GCC diagnostic pop
-#endif
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    const double rnd = dist(rng);
 
-    std::discrete_distribution<int> dist(probs_iterator{cur_p->data}, probs_iterator{cur_p->data + cur_p->size});
+    double cum = 0.0;
+    for (size_t i = 0; i + 1 < cur_p->size; ++i) {
+        cum += cur_p->data[i].p / sum;
+        if (cum >= rnd) {
+            return i;
+        }
+    }
 
-    return dist(rng);
+    return cur_p->size - 1;
 }
 
 /*
@@ -283,12 +297,12 @@ static void llama_sampler_temp_impl(llama_token_data_array * cur_p, float temp)
     }
 }
 
-static void llama_sampler_softmax_impl(llama_token_data_array * cur_p, bool do_sort) {
+static void llama_sampler_softmax_impl(llama_token_data_array * cur_p, bool do_sort, llama_sampler_scratch & scratch) {
     GGML_ASSERT(cur_p->size > 0);
 
     // Sort the logits in descending order if requested
     if (do_sort && !cur_p->sorted) {
-        llama_token_data_array_partial_sort_inplace(cur_p, cur_p->size);
+        llama_token_data_array_partial_sort_inplace(cur_p, cur_p->size, scratch);
     }
 
     float max_l = cur_p->data[0].logit;
@@ -311,7 +325,7 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p, bool do_s
     }
 }
 
-static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
+static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k, llama_sampler_scratch & scratch) {
     // if (k >= (int32_t)cur_p->size) {
     //     return;
     // }
@@ -324,7 +338,7 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
 
     // Sort scores in descending order
     if (!cur_p->sorted) {
-        llama_token_data_array_partial_sort_inplace(cur_p, k);
+        llama_token_data_array_partial_sort_inplace(cur_p, k, scratch);
     }
 
     cur_p->size = k;
@@ -404,39 +418,6 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
-llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
-
-    const int n_vocab = llama_vocab_n_tokens(vocab);
-
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-
-    llama_token_data_array cur_p = {
-        /* .data       = */ cur.data(),
-        /* .size       = */ cur.size(),
-        /* .selected   = */ -1,
-        /* .sorted     = */ false,
-    };
-
-    llama_sampler_apply(smpl, &cur_p);
-
-    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
-
-    auto token = cur_p.data[cur_p.selected].id;
-
-    llama_sampler_accept(smpl, token);
-
-    return token;
-}
-
 // sampler chain
 
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
@@ -513,12 +494,49 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
         /* .ctx   = */ new llama_sampler_chain {
             /* .params      = */ params,
             /* .samplers    = */ {},
+            /* .cur         = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
         }
     );
 }
 
+llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
+    const auto * logits = llama_get_logits_ith(ctx, idx);
+
+    const llama_model * model = llama_get_model(ctx);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    // a chain keeps the candidates buffer across calls
+    std::vector<llama_token_data> cur_local;
+
+    auto & cur = smpl->iface == &llama_sampler_chain_i ? ((llama_sampler_chain *) smpl->ctx)->cur : cur_local;
+
+    cur.resize(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+
+    llama_token_data_array cur_p = {
+        /* .data       = */ cur.data(),
+        /* .size       = */ cur.size(),
+        /* .selected   = */ -1,
+        /* .sorted     = */ false,
+    };
+
+    llama_sampler_apply(smpl, &cur_p);
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    auto token = cur_p.data[cur_p.selected].id;
+
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
 void llama_sampler_chain_add(struct llama_sampler * chain, struct llama_sampler * smpl) {
     auto * p = (llama_sampler_chain *) chain->ctx;
     p->samplers.push_back(smpl);
@@ -722,6 +740,8 @@ struct llama_sampler * llama_sampler_init_dist(uint32_t seed) {
 
 struct llama_sampler_top_k {
     const int32_t k;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_top_k_name(const struct llama_sampler * /*smpl*/) {
@@ -730,7 +750,7 @@ static const char * llama_sampler_top_k_name(const struct llama_sampler * /*smpl
 
 static void llama_sampler_top_k_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_top_k *) smpl->ctx;
-    llama_sampler_top_k_impl(cur_p, ctx->k);
+    llama_sampler_top_k_impl(cur_p, ctx->k, ctx->scratch);
 }
 
 static struct llama_sampler * llama_sampler_top_k_clone(const struct llama_sampler * smpl) {
@@ -755,7 +775,8 @@ struct llama_sampler * llama_sampler_init_top_k(int32_t k) {
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_top_k_i,
         /* .ctx   = */ new llama_sampler_top_k {
-            /* .k = */ k,
+            /* .k       = */ k,
+            /* .scratch = */ {},
         }
     );
 }
@@ -767,6 +788,8 @@ struct llama_sampler_top_p {
     const size_t min_keep;
 
     std::vector<llama_token_data> buf_sort;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_top_p_name(const struct llama_sampler * /*smpl*/) {
@@ -780,7 +803,7 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         return;
     }
 
-    llama_sampler_softmax_impl(cur_p, false);
+    llama_sampler_softmax_impl(cur_p, false, ctx->scratch);
 
     size_t k = cur_p->size;
     auto * pdata = cur_p->data;
@@ -790,11 +813,11 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
     // if not sorted, try adaptive top-k sorting
     if (!cur_p->sorted && cur_p->size > 1024) {
         k = std::min<size_t>(256, cur_p->size);
-        llama_token_data_array_partial_sort(*cur_p, k, buf_sort);
+        llama_token_data_array_partial_sort(*cur_p, k, buf_sort, ctx->scratch);
         pdata = buf_sort.data();
     } else if (!cur_p->sorted) {
         // small candidates -> sort inplace
-        llama_token_data_array_partial_sort_inplace(cur_p, k);
+        llama_token_data_array_partial_sort_inplace(cur_p, k, ctx->scratch);
     }
 
     // Compute the cumulative probabilities
@@ -814,7 +837,7 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         // we exceeded the current top-k heuristic -> increase k and continue
         if (!cur_p->sorted && i == k - 1) {
             k = cur_p->size;
-            llama_token_data_array_partial_sort(*cur_p, k, buf_sort);
+            llama_token_data_array_partial_sort(*cur_p, k, buf_sort, ctx->scratch);
             pdata = buf_sort.data();
         }
     }
@@ -853,6 +876,7 @@ struct llama_sampler * llama_sampler_init_top_p(float p, size_t min_keep) {
             /* .p        = */ p,
             /* .min_keep = */ min_keep,
             /* .buf_sort = */ {},
+            /* .scratch  = */ {},
         }
     );
 }
@@ -862,6 +886,8 @@ struct llama_sampler * llama_sampler_init_top_p(float p, size_t min_keep) {
 struct llama_sampler_min_p {
     const float  p;
     const size_t min_keep;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_min_p_name(const struct llama_sampler * /*smpl*/) {
@@ -879,7 +905,8 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
 
     // if the cur_p aren't sorted, try the unsorted implementation first
     if (!cur_p->sorted) {
-        std::vector<llama_token_data> filtered_tokens;
+        auto & filtered_tokens = ctx->scratch.data;
+        filtered_tokens.clear();
 
         float max_logit = -FLT_MAX;
         for (size_t i = 0; i < cur_p->size; ++i) {
@@ -905,7 +932,7 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
     if (!min_p_applied) {
         // Sort the logits in descending order
         if (!cur_p->sorted) {
-            llama_token_data_array_partial_sort_inplace(cur_p, cur_p->size);
+            llama_token_data_array_partial_sort_inplace(cur_p, cur_p->size, ctx->scratch);
         }
 
         const float min_logit = cur_p->data[0].logit + logf(ctx->p); // min logit for p_i >= p * p_max
@@ -946,6 +973,7 @@ struct llama_sampler * llama_sampler_init_min_p(float p, size_t min_keep) {
         /* .ctx   = */ new llama_sampler_min_p {
             /* .p        = */ p,
             /* .min_keep = */ min_keep,
+            /* .scratch  = */ {},
         }
     );
 }
@@ -955,6 +983,8 @@ struct llama_sampler * llama_sampler_init_min_p(float p, size_t min_keep) {
 struct llama_sampler_typical {
     const float  p;
     const size_t min_keep;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_typical_name(const struct llama_sampler * /*smpl*/) {
@@ -971,7 +1001,7 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
     }
 
     // Compute the softmax of logits and calculate entropy
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
     float entropy = 0.0f;
     for (size_t i = 0; i < cur_p->size; ++i) {
@@ -979,14 +1009,16 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
     }
 
     // Compute the absolute difference between negative log probability and entropy for each candidate
-    std::vector<float> shifted_scores;
+    auto & shifted_scores = ctx->scratch.scores;
+    shifted_scores.clear();
     for (size_t i = 0; i < cur_p->size; ++i) {
         float shifted_score = fabsf(-logf(cur_p->data[i].p) - entropy);
         shifted_scores.push_back(shifted_score);
     }
 
     // Sort tokens based on the shifted_scores and their corresponding indices
-    std::vector<size_t> indices(cur_p->size);
+    auto & indices = ctx->scratch.indices;
+    indices.resize(cur_p->size);
     std::iota(indices.begin(), indices.end(), 0);
 
     std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
@@ -1009,7 +1041,8 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
     }
 
     // Resize the output vector to keep only the locally typical tokens
-    std::vector<llama_token_data> cur_p_new;
+    auto & cur_p_new = ctx->scratch.data;
+    cur_p_new.clear();
     for (size_t i = 0; i < last_idx; ++i) {
         size_t idx = indices[i];
         cur_p_new.push_back(cur_p->data[idx]);
@@ -1045,6 +1078,7 @@ struct llama_sampler * llama_sampler_init_typical(float p, size_t min_keep) {
         /* .ctx   = */ new llama_sampler_typical {
             /* .p        = */ p,
             /* .min_keep = */ min_keep,
+            /* .scratch  = */ {},
         }
     );
 }
@@ -1098,6 +1132,8 @@ struct llama_sampler_temp_ext {
     const float temp;
     const float delta;
     const float exponent;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_temp_ext_name(const struct llama_sampler * /*smpl*/) {
@@ -1120,7 +1156,7 @@ static void llama_sampler_temp_ext_apply(struct llama_sampler * smpl, llama_toke
         // Calculate maximum possible entropy
         float max_entropy = -logf(1.0f / cur_p->size);
 
-        llama_sampler_softmax_impl(cur_p, true);
+        llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
         // Calculate entropy of the softmax probabilities
         float entropy = 0.0f;
@@ -1200,6 +1236,7 @@ struct llama_sampler * llama_sampler_init_temp_ext(float temp, float delta, floa
             /* .temp     = */ temp,
             /* .delta    = */ delta,
             /* .exponent = */ exponent,
+            /* .scratch  = */ {},
         }
     );
 }
@@ -1215,6 +1252,8 @@ struct llama_sampler_xtc {
     uint32_t       seed_cur;
 
     std::mt19937    rng;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_xtc_name(const struct llama_sampler * /*smpl*/) {
@@ -1236,7 +1275,7 @@ static void llama_sample_xtc_apply(struct llama_sampler * smpl, llama_token_data
         return;
     }
 
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
     int pos_last = 0;
 
@@ -1298,6 +1337,7 @@ struct llama_sampler * llama_sampler_init_xtc(float p, float t, size_t min_keep,
             /* .seed          = */ seed,
             /* .seed_cur      = */ seed_cur,
             /* .rng           = */ std::mt19937(seed_cur),
+            /* .scratch       = */ {},
         }
     );
 }
@@ -1318,6 +1358,8 @@ struct llama_sampler_mirostat {
     float mu;
 
     std::mt19937    rng;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_mirostat_name(const struct llama_sampler * /*smpl*/) {
@@ -1327,7 +1369,7 @@ static const char * llama_sampler_mirostat_name(const struct llama_sampler * /*s
 static void llama_sampler_mirostat_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_mirostat *) smpl->ctx;
 
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
     // Estimate s_hat using the most probable m tokens
     float s_hat = 0.0;
@@ -1345,9 +1387,9 @@ static void llama_sampler_mirostat_apply(struct llama_sampler * smpl, llama_toke
     float epsilon_hat = s_hat - 1;
     float k = powf((epsilon_hat * powf(2, ctx->mu)) / (1 - powf(ctx->n_vocab, -epsilon_hat)), 1 / s_hat);
 
-    llama_sampler_top_k_impl(cur_p, std::max(int(k), 1));
+    llama_sampler_top_k_impl(cur_p, std::max(int(k), 1), ctx->scratch);
 
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
     const int idx = llama_sample_dist(cur_p, ctx->rng);
 
@@ -1408,6 +1450,7 @@ struct llama_sampler * llama_sampler_init_mirostat(int32_t n_vocab, uint32_t see
             /* .m        = */ m,
             /* .mu       = */ 2.0f*tau,
             /* .rng      = */ std::mt19937(seed_cur),
+            /* .scratch  = */ {},
         }
     );
 }
@@ -1424,6 +1467,8 @@ struct llama_sampler_mirostat_v2 {
     float mu;
 
     std::mt19937 rng;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_mirostat_v2_name(const struct llama_sampler * /*smpl*/) {
@@ -1433,7 +1478,7 @@ static const char * llama_sampler_mirostat_v2_name(const struct llama_sampler *
 static void llama_sampler_mirostat_v2_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_mirostat_v2 *) smpl->ctx;
 
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
     // Truncate the words with surprise values greater than mu
     cur_p->size = std::distance(cur_p->data, std::find_if(cur_p->data, cur_p->data + cur_p->size, [&](const llama_token_data & candidate) {
@@ -1445,7 +1490,7 @@ static void llama_sampler_mirostat_v2_apply(struct llama_sampler * smpl, llama_t
     }
 
     // Normalize the probabilities of the remaining words
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
     const int idx = llama_sample_dist(cur_p, ctx->rng);
 
@@ -1505,6 +1550,7 @@ struct llama_sampler * llama_sampler_init_mirostat_v2(uint32_t seed, float tau,
             /* .eta      = */ eta,
             /* .mu       = */ 2.0f*tau,
             /* .rng      = */ std::mt19937(seed_cur),
+            /* .scratch  = */ {},
         }
     );
 }
@@ -1695,8 +1741,26 @@ struct llama_sampler * llama_sampler_init_grammar_lazy_patterns(
     return llama_sampler_init_grammar_impl(vocab, grammar_str, grammar_root, /* lazy= */ true, nullptr, 0, trigger_tokens, num_trigger_tokens, trigger_patterns, num_trigger_patterns);
 }
 
+bool llama_sampler_grammar_awaiting_trigger(const struct llama_sampler * smpl) {
+    if (smpl == nullptr || smpl->iface != &llama_sampler_grammar_i) {
+        return false;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+
+    return ctx->grammar != nullptr && ctx->grammar->awaiting_trigger;
+}
+
 // penalties
 
+// lower bound of a token in a vector of (token, value) pairs sorted by token
+// the samplers below use these vectors instead of maps, so that they do not allocate once the vectors have grown
+static std::vector<std::pair<llama_token, int>>::iterator llama_token_pairs_find(std::vector<std::pair<llama_token, int>> & pairs, llama_token token) {
+    return std::lower_bound(pairs.begin(), pairs.end(), token, [](const std::pair<llama_token, int> & a, llama_token b) {
+        return a.first < b;
+    });
+}
+
 struct llama_sampler_penalties {
     const int32_t penalty_last_n;
     const float   penalty_repeat;
@@ -1705,8 +1769,9 @@ struct llama_sampler_penalties {
 
     ring_buffer<llama_token> prev;
 
-    // a frequency map to count token occurrences
-    std::unordered_map<llama_token, int> token_count;
+    // the count of each token in the window, sorted by token
+    // there are at most penalty_last_n + 1 entries, so that it does not allocate after the init
+    std::vector<std::pair<llama_token, int>> token_count;
 };
 
 static const char * llama_sampler_penalties_name(const struct llama_sampler * /*smpl*/) {
@@ -1719,15 +1784,24 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         return;
     }
 
-    ctx->token_count[token]++;
+    auto & token_count = ctx->token_count;
+
+    {
+        auto it = llama_token_pairs_find(token_count, token);
+        if (it != token_count.end() && it->first == token) {
+            it->second++;
+        } else {
+            token_count.insert(it, { token, 1 });
+        }
+    }
 
     // if the ring buffer is full, remove the oldest token
     if (ctx->prev.size() >= (size_t) ctx->penalty_last_n) {
         const auto old = ctx->prev.front();
 
-        ctx->token_count[old]--;
-        if (ctx->token_count[old] == 0) {
-            ctx->token_count.erase(old);
+        auto it = llama_token_pairs_find(token_count, old);
+        if (--it->second == 0) {
+            token_count.erase(it);
         }
     }
 
@@ -1740,7 +1814,10 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         tmp[ctx->prev.rat(i)]++;
     }
 
-    assert(ctx->token_count == tmp);
+    assert(ctx->token_count.size() == tmp.size());
+    for (const auto & [token, count] : ctx->token_count) {
+        assert(tmp.at(token) == count);
+    }
 #endif
 }
 
@@ -1752,26 +1829,43 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    const auto apply_penalty = [ctx](llama_token_data & td, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (td.logit <= 0) {
+            td.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            td.logit /= ctx->penalty_repeat;
         }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+        td.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
+
+    // the candidates usually are the whole vocab in token order - then the penalized tokens can be indexed directly
+    bool direct = true;
+    for (const auto & [token, count] : ctx->token_count) {
+        if ((size_t) token >= cur_p->size || cur_p->data[token].id != token) {
+            direct = false;
+            break;
+        }
+    }
+
+    // Apply frequency and presence penalties to the cur_p
+    if (direct) {
+        for (const auto & [token, count] : ctx->token_count) {
+            apply_penalty(cur_p->data[token], count);
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto token_iter = llama_token_pairs_find(ctx->token_count, cur_p->data[i].id);
+            if (token_iter == ctx->token_count.end() || token_iter->first != cur_p->data[i].id) {
+                continue;
+            }
+
+            apply_penalty(cur_p->data[i], token_iter->second);
+        }
     }
 
     cur_p->sorted = false;
@@ -1795,7 +1889,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
     }
 
     return result;
@@ -1821,16 +1916,20 @@ struct llama_sampler * llama_sampler_init_penalties(
         float penalty_present) {
     penalty_last_n = std::max(penalty_last_n, 0);
 
+    auto * ctx = new llama_sampler_penalties {
+        /* .penalty_last_n  = */ penalty_last_n,
+        /* .penalty_repeat  = */ penalty_repeat,
+        /* .penalty_freq    = */ penalty_freq,
+        /* .penalty_present = */ penalty_present,
+        /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
+        /* .token_count     = */ {},
+    };
+
+    ctx->token_count.reserve(penalty_last_n + 1);
+
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_penalties_i,
-        /* .ctx   = */ new llama_sampler_penalties {
-            /* .penalty_last_n  = */ penalty_last_n,
-            /* .penalty_repeat  = */ penalty_repeat,
-            /* .penalty_freq    = */ penalty_freq,
-            /* .penalty_present = */ penalty_present,
-            /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
-            /* .token_count     = */ {},
-        }
+        /* .ctx   = */ ctx
     );
 }
 
@@ -1838,6 +1937,8 @@ struct llama_sampler * llama_sampler_init_penalties(
 
 struct llama_sampler_top_n_sigma {
     const float n;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_top_n_sigma_name(const struct llama_sampler * /*smpl*/) {
@@ -1884,7 +1985,7 @@ static void llama_sampler_top_n_sigma_apply(struct llama_sampler * smpl, llama_t
         }
     }
 
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 }
 
 static struct llama_sampler * llama_sampler_top_n_sigma_clone(const struct llama_sampler * smpl) {
@@ -1909,7 +2010,8 @@ struct llama_sampler * llama_sampler_init_top_n_sigma(float n) {
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_top_n_sigma_i,
         /* .ctx   = */ new llama_sampler_top_n_sigma {
-            /* .n = */ n,
+            /* .n       = */ n,
+            /* .scratch = */ {},
         }
     );
 }
@@ -1926,7 +2028,7 @@ struct llama_sampler_dry {
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
     std::vector<int> dry_repeat_count;
-    std::unordered_map<llama_token, int> dry_max_token_repeat;
+    std::vector<std::pair<llama_token, int>> dry_max_token_repeat; // sorted by token
     ring_buffer<llama_token> last_tokens;
 };
 
@@ -2148,14 +2250,23 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
             // By convention, the value of `repeat_len` only includes the tokens currently
             // in the context, not the new token that would be added.
             llama_token token = ctx->last_tokens.rat(last_n_repeat - 2 - i);
-            // Track the maximum sequence ending in this token.
-            const auto& it = ctx->dry_max_token_repeat.find(token);
-            if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
-                ctx->dry_max_token_repeat[token] = repeat_len;
-            }
+            ctx->dry_max_token_repeat.emplace_back(token, repeat_len);
         }
     }
 
+    // Track the maximum sequence ending in each token.
+    {
+        auto & max_repeat = ctx->dry_max_token_repeat;
+
+        std::sort(max_repeat.begin(), max_repeat.end(), [](const std::pair<llama_token, int> & a, const std::pair<llama_token, int> & b) {
+            return a.first < b.first || (a.first == b.first && a.second > b.second);
+        });
+
+        max_repeat.erase(std::unique(max_repeat.begin(), max_repeat.end(), [](const std::pair<llama_token, int> & a, const std::pair<llama_token, int> & b) {
+            return a.first == b.first;
+        }), max_repeat.end());
+    }
+
     // Step 4: Apply logit penalties based on the maximum repeat length for relevant tokens.
 
     // Prevent floating point overflow in `pow(penalty_base, exponent)` by clamping to `max_exponent`.
@@ -2167,8 +2278,8 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
     }
 
     for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != ctx->dry_max_token_repeat.end()) {
+        const auto af_kvp = llama_token_pairs_find(ctx->dry_max_token_repeat, cur_p->data[i].id);
+        if (af_kvp != ctx->dry_max_token_repeat.end() && af_kvp->first == cur_p->data[i].id) {
             // Check all sequence breakers starting with this token
             auto range = ctx->dry_processed_breakers.equal_range(cur_p->data[i].id);
             bool is_single_token_breaker = false;
@@ -2266,19 +2377,25 @@ struct llama_sampler * llama_sampler_init_dry(const struct llama_vocab * vocab,
         }
     }
 
+    auto * ctx = new llama_sampler_dry {
+        /* .total_context_size     = */ n_ctx_train,
+        /* .dry_multiplier         = */ dry_multiplier,
+        /* .dry_base               = */ dry_base,
+        /* .dry_allowed_length     = */ dry_allowed_length,
+        /* .dry_penalty_last_n     = */ dry_penalty_last_n,
+        /* .dry_processed_breakers = */ std::move(processed_breakers),
+        /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
+        /* .dry_max_token_repeat   = */ {},
+        /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
+    };
+
+    if (dry_enabled) {
+        ctx->dry_max_token_repeat.reserve(effective_dry_penalty_last_n);
+    }
+
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_dry_i,
-        /* .ctx   = */ new llama_sampler_dry {
-            /* .total_context_size     = */ n_ctx_train,
-            /* .dry_multiplier         = */ dry_multiplier,
-            /* .dry_base               = */ dry_base,
-            /* .dry_allowed_length     = */ dry_allowed_length,
-            /* .dry_penalty_last_n     = */ dry_penalty_last_n,
-            /* .dry_processed_breakers = */ std::move(processed_breakers),
-            /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
-            /* .dry_max_token_repeat   = */ {},
-            /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
-        }
+        /* .ctx   = */ ctx
     );
 }
 
@@ -2399,6 +2516,8 @@ struct llama_sampler_infill {
 
     std::vector<char> buf0;
     std::vector<char> buf1;
+
+    llama_sampler_scratch scratch;
 };
 
 static const char * llama_sampler_infill_name(const struct llama_sampler * /*smpl*/) {
@@ -2408,7 +2527,7 @@ static const char * llama_sampler_infill_name(const struct llama_sampler * /*smp
 static void llama_sampler_infill_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_infill *) smpl->ctx;
 
-    llama_sampler_softmax_impl(cur_p, true);
+    llama_sampler_softmax_impl(cur_p, true, ctx->scratch);
 
 #if defined(GGML_DEBUG_SAMPLER_INFILL)
 #define LOG_DBG_CUR LLAMA_LOG_DEBUG
@@ -2605,9 +2724,10 @@ struct llama_sampler * llama_sampler_init_infill(const struct llama_vocab * voca
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_infill_i,
         /* .ctx   = */ new llama_sampler_infill {
-            /* .vocab = */ vocab,
-            /* .buf0  = */ std::vector<char>(512),
-            /* .buf1  = */ std::vector<char>(512),
+            /* .vocab   = */ vocab,
+            /* .buf0    = */ std::vector<char>(512),
+            /* .buf1    = */ std::vector<char>(512),
+            /* .scratch = */ {},
         }
     );
 }
@@ -3,22 +3,28 @@
 #include "ggml.h"
 #include "gguf.h"
 #include "llama-impl.h"
+#include "llama-grammar.h"
 #include "llama-model-loader.h"
 
 #include "unicode.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
 #include <cmath>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <forward_list>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -276,177 +282,216 @@ struct llm_bigram_bpe {
     size_t size;
 };
 
+std::vector<std::string> llama_vocab_pre_type_regexes(llama_vocab_pre_type pre_type) {
+    switch (pre_type) {
+        case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
+            return {
+                // original regex from tokenizer.json
+                //"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+
+                // adapted: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2080233989
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_DBRX:
+        case LLAMA_VOCAB_PRE_TYPE_SMAUG:
+            return {
+                // same as llama3
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
+            return {
+                "[\r\n]",
+                "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
+                "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
+                "\\s+$",
+                "[一-龥ࠀ-一가-퟿]+",
+                "\\p{N}+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
+        case LLAMA_VOCAB_PRE_TYPE_HUNYUAN_DENSE:
+            return {
+                "\\p{N}{1,3}",
+                "[一-龥぀-ゟ゠-ヿ]+",
+                "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
+            return {
+                "[\r\n]",
+                "\\s?\\p{L}+",
+                "\\s?\\p{P}+",
+                "[一-龥ࠀ-一가-퟿]+",
+                "\\p{N}",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_FALCON:
+            return {
+                "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+                "[0-9][0-9][0-9]",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_STARCODER:
+        case LLAMA_VOCAB_PRE_TYPE_REFACT:
+        case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
+        case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
+        case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
+        case LLAMA_VOCAB_PRE_TYPE_EXAONE:
+        case LLAMA_VOCAB_PRE_TYPE_MINERVA:
+            return {
+                "\\p{N}",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_GPT2:
+        case LLAMA_VOCAB_PRE_TYPE_MPT:
+        case LLAMA_VOCAB_PRE_TYPE_OLMO:
+        case LLAMA_VOCAB_PRE_TYPE_JAIS:
+        case LLAMA_VOCAB_PRE_TYPE_TRILLION:
+            return {
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
+        case LLAMA_VOCAB_PRE_TYPE_QWEN2:
+        case LLAMA_VOCAB_PRE_TYPE_HUNYUAN:
+            return {
+                // original regex from tokenizer.json
+                // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_PORO:
+        case LLAMA_VOCAB_PRE_TYPE_BLOOM:
+        case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
+            return {
+                " ?[^(\\s|.,!?…。，、।۔،)]+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
+            return {
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_VIKING:
+            return {
+                " ?[^(\\s|.,!?…。，、।۔،)]+",
+                "\\p{N}",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
+            // original regex from tokenizer.json
+            // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+            return {
+                "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
+            // Note: in theory, the special token (sentinel and image token) regex_exprs below
+            // are unnecessary, as they are split in `tokenizer_st_partition` anyway.
+            // However, since the upstream pre-tokenizer uses them, they are also
+            // included here (see https://huggingface.co/facebook/chameleon-7b).
+            return {
+                "<sentinel:[0-9]+>",  // Sentinel tokens
+                "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",  // Image tokens
+                "([\\t\\n]|    |  )",  // directly from tokenizer.json
+                "\\p{N}", // Individual digits
+                "[\\p{P}!-/:-@\\[-`{-~]",  // Punctuation, Isolated
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_GPT4O:
+            return {
+                // original regex from tokenizer.json
+                // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+                "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_KIMI_K2:
+            return {
+                // K2 trigger pattern - this will activate the custom K2 handler in unicode.cpp
+                // The custom handler implements all K2 patterns with proper Han character exclusion
+                "\\p{Han}+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_SUPERBPE:
+            return {
+                "\\p{N}+",
+                "(?=(\\d{3})+(?!\\d))",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
+            return {
+                // original regex from tokenizer.json
+                // "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
+                // FIXME? Changed possessive quantifiers (?+ and ++) to greedy to avoid errors and imatrix hanging (tried atomic grouping but it's not supported?)
+                "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
+            };
+        case LLAMA_VOCAB_PRE_TYPE_SEED_CODER:
+            return {
+                // original regex from tokenizer.json
+                // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\r\n]+|\\s*[\r\n]+|\\s+(?!\\S)|\\s+"
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+        default:
+            // default regex for BPE tokenization pre-processing
+            return {
+                "[\\p{P}\\$\\+<=>\\^~\\|]+",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+                "\\p{N}+",
+                "[0-9][0-9][0-9]",
+            };
+    }
+}
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
-        switch (vocab.get_pre_type()) {
-            case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    //"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-
-                    // adapted: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2080233989
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DBRX:
-            case LLAMA_VOCAB_PRE_TYPE_SMAUG:
-                regex_exprs = {
-                    // same as llama3
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
-                regex_exprs = {
-                    "[\r\n]",
-                    "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
-                    "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
-                    "\\s+$",
-                    "[一-龥ࠀ-一가-퟿]+",
-                    "\\p{N}+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
-            case LLAMA_VOCAB_PRE_TYPE_HUNYUAN_DENSE:
-                regex_exprs = {
-                    "\\p{N}{1,3}",
-                    "[一-龥぀-ゟ゠-ヿ]+",
-                    "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
-                regex_exprs = {
-                    "[\r\n]",
-                    "\\s?\\p{L}+",
-                    "\\s?\\p{P}+",
-                    "[一-龥ࠀ-一가-퟿]+",
-                    "\\p{N}",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_FALCON:
-                regex_exprs = {
-                    "[\\p{P}\\$\\+<=>\\^~\\|`]+",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                    "[0-9][0-9][0-9]",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_STARCODER:
-            case LLAMA_VOCAB_PRE_TYPE_REFACT:
-            case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
-            case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
-            case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
-            case LLAMA_VOCAB_PRE_TYPE_EXAONE:
-            case LLAMA_VOCAB_PRE_TYPE_MINERVA:
-                regex_exprs = {
-                    "\\p{N}",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_GPT2:
-            case LLAMA_VOCAB_PRE_TYPE_MPT:
-            case LLAMA_VOCAB_PRE_TYPE_OLMO:
-            case LLAMA_VOCAB_PRE_TYPE_JAIS:
-            case LLAMA_VOCAB_PRE_TYPE_TRILLION:
-                regex_exprs = {
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
-            case LLAMA_VOCAB_PRE_TYPE_QWEN2:
-            case LLAMA_VOCAB_PRE_TYPE_HUNYUAN:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_PORO:
-            case LLAMA_VOCAB_PRE_TYPE_BLOOM:
-            case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
-                regex_exprs = {
-                    " ?[^(\\s|.,!?…。，、।۔،)]+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
-                regex_exprs = {
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_VIKING:
-                regex_exprs = {
-                    " ?[^(\\s|.,!?…。，、।۔،)]+",
-                    "\\p{N}",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
-                // original regex from tokenizer.json
-                // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
-                regex_exprs = {
-                    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
-                // Note: in theory, the special token (sentinel and image token) regex_exprs below
-                // are unnecessary, as they are split in `tokenizer_st_partition` anyway.
-                // However, since the upstream pre-tokenizer uses them, they are also
-                // included here (see https://huggingface.co/facebook/chameleon-7b).
-                regex_exprs = {
-                    "<sentinel:[0-9]+>",  // Sentinel tokens
-                    "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",  // Image tokens
-                    "([\\t\\n]|    |  )",  // directly from tokenizer.json
-                    "\\p{N}", // Individual digits
-                    "[\\p{P}!-/:-@\\[-`{-~]",  // Punctuation, Isolated
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_GPT4O:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_KIMI_K2:
-                regex_exprs = {
-                    // K2 trigger pattern - this will activate the custom K2 handler in unicode.cpp
-                    // The custom handler implements all K2 patterns with proper Han character exclusion
-                    "\\p{Han}+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_SUPERBPE:
-                regex_exprs = {
-                    "\\p{N}+",
-                    "(?=(\\d{3})+(?!\\d))",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
-                    // FIXME? Changed possessive quantifiers (?+ and ++) to greedy to avoid errors and imatrix hanging (tried atomic grouping but it's not supported?)
-                    "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_SEED_CODER:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\r\n]+|\\s*[\r\n]+|\\s+(?!\\S)|\\s+"
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            default:
-                // default regex for BPE tokenization pre-processing
-                regex_exprs = {
-                    "[\\p{P}\\$\\+<=>\\^~\\|]+",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                    "\\p{N}+",
-                    "[0-9][0-9][0-9]",
-                };
-                break;
+
+        regex_exprs = llama_vocab_pre_type_regexes(vocab.get_pre_type());
+
+        // the tokens of superbpe span several words
+        split_at_spaces = vocab.get_pre_type() != LLAMA_VOCAB_PRE_TYPE_SUPERBPE;
+    }
+
+    // returns true and appends the tokens of the word to output if the word is in the cache
+    bool word_cache_get(const std::string & word, std::vector<llama_token> & output) const {
+        auto & stripe = word_cache[std::hash<std::string>{}(word) % WORD_CACHE_N_STRIPES];
+
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        const auto it = stripe.words.find(word);
+        if (it == stripe.words.end()) {
+            return false;
+        }
+
+        output.insert(output.end(), it->second.begin(), it->second.end());
+
+        return true;
+    }
+
+    void word_cache_put(const std::string & word, const llama_token * tokens, size_t n_tokens) const {
+        if (word.size() > WORD_CACHE_MAX_WORD_LEN) {
+            return;
         }
+
+        auto & stripe = word_cache[std::hash<std::string>{}(word) % WORD_CACHE_N_STRIPES];
+
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+
+        // keep the memory bounded - the frequent words come back quickly after the stripe is cleared
+        if (stripe.words.size() >= WORD_CACHE_STRIPE_SIZE) {
+            stripe.words.clear();
+        }
+
+        stripe.words.emplace(word, std::vector<llama_token>(tokens, tokens + n_tokens));
     }
 
     std::vector<std::string> regex_exprs;
+
+    // the regexes start a new word at a space between two ASCII letters, so a long text can be split there and the
+    // parts tokenized independently
+    bool split_at_spaces = true;
+
+private:
+    // the merges of a word depend only on the word, so the tokens of the frequent words are cached and shared by all
+    // sessions of the vocab - the cache is split in stripes with a lock each, so that concurrent sessions rarely wait
+    static constexpr size_t WORD_CACHE_N_STRIPES    = 16;
+    static constexpr size_t WORD_CACHE_STRIPE_SIZE  = 4096; // max number of words in a stripe
+    static constexpr size_t WORD_CACHE_MAX_WORD_LEN = 64;   // longer words are rarely repeated and are not cached
+
+    struct word_cache_stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<llama_token>> words;
+    };
+
+    mutable std::array<word_cache_stripe, WORD_CACHE_N_STRIPES> word_cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -490,111 +535,103 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            if (tokenizer.word_cache_get(word, output)) {
+                continue;
+            }
 
-            int index = 0;
-            size_t offset = 0;
+            const size_t n_output = output.size();
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
+            tokenize_word(word, output);
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
+            tokenizer.word_cache_put(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        int index = 0;
+        size_t offset = 0;
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        // the merges only move symbols to the left, so the remaining symbols are in order
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.text_to_token(str);
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (token == LLAMA_TOKEN_NULL) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(token);
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
@@ -625,10 +662,77 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
 };
 
+// long texts are split in chunks that are tokenized on several threads
+// the chunks end before a space between two ASCII letters, where all pre-tokenizers with split_at_spaces start a new
+// word, so the result is the same as with a single session
+
+static constexpr size_t BPE_CHUNK_SIZE_MIN = 16*1024; // bytes
+
+// the [begin, end) byte ranges of the chunks, each at least chunk_size bytes long (except the last one)
+static std::vector<std::pair<size_t, size_t>> llm_tokenizer_bpe_chunks(const std::string & text, size_t chunk_size) {
+    const auto is_letter = [&](size_t i) {
+        const char c = text[i];
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    };
+
+    std::vector<std::pair<size_t, size_t>> chunks;
+
+    size_t begin = 0;
+    while (text.size() - begin > chunk_size) {
+        size_t end = begin + chunk_size;
+        while (end + 1 < text.size() && !(text[end] == ' ' && is_letter(end - 1) && is_letter(end + 1))) {
+            end++;
+        }
+        if (end + 1 >= text.size()) {
+            break;
+        }
+
+        chunks.emplace_back(begin, end);
+        begin = end;
+    }
+
+    chunks.emplace_back(begin, text.size());
+
+    return chunks;
+}
+
+static void llm_tokenizer_bpe_tokenize_parallel(const llama_vocab & vocab, const llm_tokenizer_bpe & tokenizer, const std::string & text, int n_threads, std::vector<llama_token> & output) {
+    // a few chunks per thread, so that the threads finish at about the same time
+    const auto chunks = llm_tokenizer_bpe_chunks(text, std::max(BPE_CHUNK_SIZE_MIN, text.size() / (4*n_threads)));
+
+    n_threads = std::min<int>(n_threads, chunks.size());
+
+    std::vector<std::vector<llama_token>> outputs(chunks.size());
+    std::atomic<size_t> next_chunk { 0 };
+
+    const auto worker = [&]() {
+        llm_tokenizer_bpe_session session(vocab, tokenizer);
+
+        for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+            session.tokenize(text.substr(chunks[i].first, chunks[i].second - chunks[i].first), outputs[i]);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    for (const auto & out : outputs) {
+        output.insert(output.end(), out.begin(), out.end());
+    }
+}
+
 //
 // WPM tokenizer
 //
@@ -1584,6 +1688,9 @@ struct llama_vocab::impl {
 
     std::vector<char> precompiled_charsmap;
 
+    std::once_flag                      grammar_trie_once;
+    std::unique_ptr<llama_grammar_trie> grammar_trie;
+
     impl(const llama_vocab & vocab) : vocab(vocab) {
     }
 
@@ -1619,7 +1726,8 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
 
     int32_t tokenize(
                    const char * text,
@@ -2767,7 +2875,8 @@ static std::string llama_decode_text(const std::string & text) {
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads) const {
     GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
@@ -2832,9 +2941,10 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
             } break;
         case LLAMA_VOCAB_TYPE_BPE:
             {
-                llm_tokenizer_bpe_session session(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()));
                 // it calls some other methods that are not exist in llm_tokenizer,
                 // here just cast it to bpe tokenizer object
+                const auto & tokenizer_bpe = *static_cast<const llm_tokenizer_bpe *>(tokenizer.get());
+                llm_tokenizer_bpe_session session(vocab, tokenizer_bpe);
                 if (add_special) {
                     session.append_bos(output);
                 }
@@ -2845,7 +2955,11 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
+                        if (n_threads > 1 && tokenizer_bpe.split_at_spaces && text.size() >= 2*BPE_CHUNK_SIZE_MIN) {
+                            llm_tokenizer_bpe_tokenize_parallel(vocab, tokenizer_bpe, text, n_threads, output);
+                        } else {
+                            session.tokenize(text, output);
+                        }
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         session.append(fragment.token, output);
                     }
@@ -3484,8 +3598,9 @@ int32_t llama_vocab::tokenize(
                  llama_token * tokens,
                      int32_t   n_tokens_max,
                         bool   add_special,
-                        bool   parse_special) const {
-    auto res = tokenize(std::string(text, text_len), add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    auto res = tokenize(std::string(text, text_len), add_special, parse_special, n_threads);
     if (res.size() >= static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
         LLAMA_LOG_ERROR("%s: tokenization result size %zu exceeds int32_t limit\n", __func__, res.size());
         return std::numeric_limits<int32_t>::min();
@@ -3506,14 +3621,23 @@ int32_t llama_vocab::tokenize(
 std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads);
 }
 
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
+const llama_grammar_trie & llama_vocab::get_grammar_trie() const {
+    std::call_once(pimpl->grammar_trie_once, [this]() {
+        pimpl->grammar_trie = std::make_unique<llama_grammar_trie>(*this);
+    });
+
+    return *pimpl->grammar_trie;
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
@@ -3770,6 +3894,18 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_ext(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
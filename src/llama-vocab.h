@@ -49,8 +49,12 @@ enum llama_vocab_pre_type {
     LLAMA_VOCAB_PRE_TYPE_HUNYUAN_DENSE  = 38,
 };
 
+// the regexes that split the text in words before the BPE merges
+std::vector<std::string> llama_vocab_pre_type_regexes(llama_vocab_pre_type pre_type);
+
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_trie;
 
 struct llama_vocab {
     struct token_data {
@@ -138,12 +142,15 @@ struct llama_vocab {
                   llama_token * tokens,
                       int32_t   n_tokens_max,
                          bool   add_special,
-                         bool   parse_special) const;
+                         bool   parse_special,
+                      int32_t   n_threads = 1) const;
 
+    // n_threads > 1 tokenizes long texts in parallel chunks (BPE only)
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
 
     // does not write null-terminator to buf
     int32_t token_to_piece(
@@ -156,6 +163,9 @@ struct llama_vocab {
     // use cached data
     const std::string & token_to_piece(llama_token token) const;
 
+    // trie of the token pieces used by the grammar sampler, built on first use
+    const llama_grammar_trie & get_grammar_trie() const;
+
     int32_t detokenize(
             const llama_token * tokens,
                       int32_t   n_tokens,
@@ -6,12 +6,17 @@
 #include "unicode-data.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cctype>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -119,8 +124,26 @@ uint32_t unicode_cpt_from_utf8(const std::string & utf8, size_t & offset) {
 //    return result;
 //}
 
-static std::vector<unicode_cpt_flags> unicode_cpt_flags_array() {
-    std::vector<unicode_cpt_flags> cpt_flags(MAX_CODEPOINTS, unicode_cpt_flags::UNDEFINED);
+// the flags of all codepoints in a two-level table: the codepoints are split in blocks of 256 and the blocks with the
+// same flags (most of the CJK, Hangul and unassigned ranges) are stored only once
+// this takes ~170 KB instead of 2.2 MB for one entry per codepoint, so the used parts stay in the cache
+struct unicode_cpt_flags_table {
+    static constexpr uint32_t BLOCK_BITS = 8;
+    static constexpr uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+
+    std::vector<uint16_t>          index;  // the block of each BLOCK_SIZE codepoints
+    std::vector<unicode_cpt_flags> blocks; // the flags of the distinct blocks
+
+    unicode_cpt_flags get(uint32_t cpt) const {
+        if (cpt >= MAX_CODEPOINTS) {
+            return unicode_cpt_flags(unicode_cpt_flags::UNDEFINED);
+        }
+        return blocks[((uint32_t) index[cpt >> BLOCK_BITS] << BLOCK_BITS) | (cpt & (BLOCK_SIZE - 1))];
+    }
+};
+
+static unicode_cpt_flags_table unicode_cpt_flags_table_init() {
+    std::vector<uint16_t> cpt_flags(MAX_CODEPOINTS, unicode_cpt_flags::UNDEFINED);
 
     assert (unicode_ranges_flags.begin()[0].first == 0);
     assert (unicode_ranges_flags.begin()[unicode_ranges_flags.size()-1].first == MAX_CODEPOINTS);
@@ -132,23 +155,54 @@ static std::vector<unicode_cpt_flags> unicode_cpt_flags_array() {
         }
     }
 
+    const auto set_flag = [&](uint32_t cpt, auto setter) {
+        unicode_cpt_flags flags(cpt_flags[cpt]);
+        setter(flags);
+        cpt_flags[cpt] = flags.as_uint();
+    };
+
     for (auto cpt : unicode_set_whitespace) {
-        cpt_flags[cpt].is_whitespace = true;
+        set_flag(cpt, [](unicode_cpt_flags & flags) { flags.is_whitespace = true; });
     }
 
     for (auto p : unicode_map_lowercase) {
-        cpt_flags[p.second].is_lowercase = true;
+        set_flag(p.second, [](unicode_cpt_flags & flags) { flags.is_lowercase = true; });
     }
 
     for (auto p : unicode_map_uppercase) {
-        cpt_flags[p.second].is_uppercase = true;
+        set_flag(p.second, [](unicode_cpt_flags & flags) { flags.is_uppercase = true; });
     }
 
     for (auto &range : unicode_ranges_nfd) {  // start, last, nfd
-        cpt_flags[range.nfd].is_nfd = true;
+        set_flag(range.nfd, [](unicode_cpt_flags & flags) { flags.is_nfd = true; });
     }
 
-    return cpt_flags;
+    // store each distinct block once
+    static_assert(MAX_CODEPOINTS % unicode_cpt_flags_table::BLOCK_SIZE == 0, "MAX_CODEPOINTS must be a multiple of the block size");
+    static_assert(MAX_CODEPOINTS / unicode_cpt_flags_table::BLOCK_SIZE <= UINT16_MAX, "too many blocks for uint16_t ids");
+
+    unicode_cpt_flags_table table;
+    table.index.resize(MAX_CODEPOINTS / unicode_cpt_flags_table::BLOCK_SIZE);
+
+    std::map<std::vector<uint16_t>, uint16_t> block_ids;
+    for (size_t i = 0; i < table.index.size(); ++i) {
+        const auto begin = cpt_flags.begin() + i*unicode_cpt_flags_table::BLOCK_SIZE;
+        std::vector<uint16_t> block(begin, begin + unicode_cpt_flags_table::BLOCK_SIZE);
+
+        auto it = block_ids.find(block);
+        if (it == block_ids.end()) {
+            it = block_ids.emplace(block, (uint16_t) block_ids.size()).first;
+            table.blocks.insert(table.blocks.end(), block.begin(), block.end());
+        }
+        table.index[i] = it->second;
+    }
+
+    return table;
+}
+
+static const unicode_cpt_flags_table & unicode_cpt_flags_table_get() {
+    static const unicode_cpt_flags_table table = unicode_cpt_flags_table_init();
+    return table;
 }
 
 static std::unordered_map<uint8_t, std::string> unicode_byte_to_utf8_map() {
@@ -220,30 +274,75 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
+// the UTF-8 bytes of a codepoint, without allocating - returns the number of bytes
+static size_t unicode_cpt_to_utf8(uint32_t cpt, char * buf) {
+    if (/* 0x00 <= cpt && */ cpt <= 0x7f) {
+        buf[0] = cpt;
+        return 1;
+    }
+    if (0x80 <= cpt && cpt <= 0x7ff) {
+        buf[0] = 0xc0 | ((cpt >> 6) & 0x1f);
+        buf[1] = 0x80 | (cpt & 0x3f);
+        return 2;
+    }
+    if (0x800 <= cpt && cpt <= 0xffff) {
+        buf[0] = 0xe0 | ((cpt >> 12) & 0x0f);
+        buf[1] = 0x80 | ((cpt >> 6) & 0x3f);
+        buf[2] = 0x80 | (cpt & 0x3f);
+        return 3;
+    }
+    if (0x10000 <= cpt && cpt <= 0x10ffff) {
+        buf[0] = 0xf0 | ((cpt >> 18) & 0x07);
+        buf[1] = 0x80 | ((cpt >> 12) & 0x3f);
+        buf[2] = 0x80 | ((cpt >> 6) & 0x3f);
+        buf[3] = 0x80 | (cpt & 0x3f);
+        return 4;
+    }
+
+    throw std::invalid_argument("invalid codepoint");
+}
+
+// the words of the split text in the byte-level BPE representation, where each UTF-8 byte is mapped to a codepoint
+static std::vector<std::string> unicode_byte_encoding_process(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
+    static const auto byte_to_utf8 = []() {
+        const auto map = unicode_byte_to_utf8_map();
+
+        std::array<std::string, 256> res;
+        for (const auto & it : map) {
+            res[it.first] = it.second;
         }
+        return res;
+    }();
+
+    std::vector<std::string> bpe_encoded_words;
+    bpe_encoded_words.reserve(offsets.size());
 
+    size_t start = 0;
+    for (auto offset : offsets) {
         std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
+        encoded_token.reserve(2*offset);
+
+        for (size_t i = start; i < start + offset; ++i) {
+            char buf[4];
+            const size_t n = unicode_cpt_to_utf8(cpts[i], buf);
+            for (size_t k = 0; k < n; ++k) {
+                encoded_token += byte_to_utf8[(uint8_t) buf[k]];
+            }
         }
-        bpe_encoded_words.emplace_back(encoded_token);
+        bpe_encoded_words.emplace_back(std::move(encoded_token));
+
+        start += offset;
     }
+
     return bpe_encoded_words;
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
+    const auto & cpt_flags = unicode_cpt_flags_table_get();
 
     size_t start = 0;
     for (auto offset : offsets) {
@@ -258,7 +357,7 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
         };
 
         auto _get_flags = [&] (const size_t pos) -> unicode_cpt_flags {
-            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags_from_cpt(cpts[pos]) : unicode_cpt_flags{};
+            return (offset_ini <= pos && pos < offset_end) ? cpt_flags.get(cpts[pos]) : unicode_cpt_flags{};
         };
 
         size_t _prev_end = offset_ini;
@@ -357,11 +456,13 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// the variants of other models differ in the digits of a number token (\p{N} instead of \p{N}{1,3}) and in the
+// newlines after the punctuation ([\r\n]* is missing)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, size_t n_digits_max, bool punct_newlines) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
+    const auto & cpt_flags = unicode_cpt_flags_table_get();
 
     size_t start = 0;
     for (auto offset : offsets) {
@@ -376,7 +477,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
         };
 
         auto _get_flags = [&] (const size_t pos) -> unicode_cpt_flags {
-            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags_from_cpt(cpts[pos]) : unicode_cpt_flags{};
+            return (offset_ini <= pos && pos < offset_end) ? cpt_flags.get(cpts[pos]) : unicode_cpt_flags{};
         };
 
         size_t _prev_end = offset_ini;
@@ -434,7 +535,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= n_digits_max) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -451,7 +552,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
                     flags2 = _get_flags(++pos);
                 }
                 uint32_t cpt2 = _get_cpt(pos);
-                while (cpt2 == '\r' || cpt2 == '\n') {
+                while (punct_newlines && (cpt2 == '\r' || cpt2 == '\n')) {
                     cpt2 = _get_cpt(++pos);
                 }
                 _add_token(pos);
@@ -559,11 +660,11 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
 
 // K2 system regex patterns (from tokenization_kimi.py):
 // [\p{Han}]+|[^\r\n\p{L}\p{N}]?[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}&&[^\p{Han}]]*[\p{Ll}\p{Lm}\p{Lo}\p{M}&&[^\p{Han}]]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\r\n\p{L}\p{N}]?[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}&&[^\p{Han}]]+[\p{Ll}\p{Lm}\p{Lo}\p{M}&&[^\p{Han}]]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_kimi_k2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_kimi_k2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
     bpe_offsets.reserve(offsets.size());
 
-    const auto cpts = unicode_cpts_from_utf8(text);
+    const auto & cpt_flags = unicode_cpt_flags_table_get();
 
     size_t start = 0;
     for (auto offset : offsets) {
@@ -578,7 +679,7 @@ static std::vector<size_t> unicode_regex_split_custom_kimi_k2(const std::string
         };
 
         auto _get_flags = [&] (const size_t pos) -> unicode_cpt_flags {
-            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags_from_cpt(cpts[pos]) : unicode_cpt_flags{};
+            return (offset_ini <= pos && pos < offset_end) ? cpt_flags.get(cpts[pos]) : unicode_cpt_flags{};
         };
 
         size_t _prev_end = offset_ini;
@@ -729,19 +830,636 @@ static std::vector<size_t> unicode_regex_split_custom_kimi_k2(const std::string
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+//
+// splitters of the regexes that match unicode categories (\p{..}) or classes of codepoints
+//
+// std::regex does not support the unicode categories, so the fallback in unicode_regex_split matches them on a
+// collapsed copy of the text, where each codepoint is replaced by a single byte. the splitters below classify the
+// same bytes (or, without categories, the same codepoints) as the fallback, so that they split the text the same way
+//
+
+static bool unicode_collapsed_is_whitespace(uint32_t c) {
+    return c == ' ' || (c >= 0x09 && c <= 0x0D);
+}
+
+static bool unicode_collapsed_is_number(uint32_t c) {
+    return c == 0xD1 || (c >= '0' && c <= '9');
+}
+
+static bool unicode_collapsed_is_letter(uint32_t c) {
+    return c == 0xD2 || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+static bool unicode_collapsed_is_punctuation(uint32_t c) {
+    switch (c) {
+        case 0xD3:
+        case '!': case '"': case '#': case '%': case '&': case '\'': case '(': case ')': case '*': case ',': case '-':
+        case '.': case '/': case ':': case ';': case '?': case '@': case '[': case '\\': case ']': case '_': case '{':
+        case '}':
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool unicode_collapsed_is_accent_mark(uint32_t c) {
+    return c == 0xD4;
+}
+
+static bool unicode_collapsed_is_symbol(uint32_t c) {
+    switch (c) {
+        case 0xD5:
+        case '$': case '+': case '<': case '=': case '>': case '^': case '`': case '|':
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool unicode_collapsed_is_category(uint32_t c, uint16_t categories) {
+    return ((categories & unicode_cpt_flags::NUMBER)      && unicode_collapsed_is_number(c))      ||
+           ((categories & unicode_cpt_flags::LETTER)      && unicode_collapsed_is_letter(c))      ||
+           ((categories & unicode_cpt_flags::PUNCTUATION) && unicode_collapsed_is_punctuation(c)) ||
+           ((categories & unicode_cpt_flags::ACCENT_MARK) && unicode_collapsed_is_accent_mark(c)) ||
+           ((categories & unicode_cpt_flags::SYMBOL)      && unicode_collapsed_is_symbol(c));
+}
+
+// splits the pieces at the matches of a pattern, the same way as unicode_regex_split_stl
+// match(pos, end) returns the length of the leftmost match at pos in the piece that ends at end, or 0 if there is none
+template <typename F>
+static std::vector<size_t> unicode_regex_split_custom_match(const std::vector<size_t> & offsets, F && match) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev_end = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t len = match(pos, end);
+            if (len == 0) {
+                pos++;
+                continue;
+            }
+
+            // the text before the match that did not match anything
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+            bpe_offsets.push_back(len);
+
+            pos += len;
+            prev_end = pos;
+        }
+
+        if (end > prev_end) {
+            bpe_offsets.push_back(end - prev_end);
+        }
+
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
+// a bracket expression or a single unicode category of a regex, e.g. [\p{P}\$\+<=>\^~\|], [^(\s|.,!?…。，、।۔،)], \p{N}
+struct unicode_regex_class {
+    bool     negate     = false;
+    bool     whitespace = false; // \s
+    uint16_t categories = 0;     // \p{..}, as unicode_cpt_flags - matched on the collapsed text
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // sorted, inclusive
+
+    // the result for the values below 256 - all collapsed bytes and the most frequent codepoints
+    std::array<bool, 256> low;
+
+    bool contains_impl(uint32_t c) const {
+        bool res = (whitespace && unicode_collapsed_is_whitespace(c)) || unicode_collapsed_is_category(c, categories);
+
+        if (!res) {
+            auto it = std::upper_bound(ranges.begin(), ranges.end(), c, [](uint32_t c, const std::pair<uint32_t, uint32_t> & range) {
+                return c < range.first;
+            });
+            res = it != ranges.begin() && c <= std::prev(it)->second;
+        }
+
+        return res != negate;
+    }
+
+    void init() {
+        // merge the overlapping and adjacent ranges, so that the lookup only has to check the last range that starts
+        // before c, e.g. [a-zc-d] becomes [a-z]
+        std::sort(ranges.begin(), ranges.end());
+
+        size_t n = 0;
+        for (const auto & range : ranges) {
+            if (n > 0 && range.first <= (uint64_t) ranges[n - 1].second + 1) {
+                ranges[n - 1].second = std::max(ranges[n - 1].second, range.second);
+            } else {
+                ranges[n++] = range;
+            }
+        }
+        ranges.resize(n);
+
+        for (uint32_t c = 0; c < low.size(); ++c) {
+            low[c] = contains_impl(c);
+        }
+    }
+
+    // c is a collapsed byte if the class uses categories, otherwise a codepoint
+    bool contains(uint32_t c) const {
+        return c < low.size() ? low[c] : contains_impl(c);
+    }
+};
+
+// the regexes that match a single class, optionally repeated and after an optional whitespace, e.g. \s?\p{L}+
+struct unicode_regex_simple {
+    enum {
+        PREFIX_NONE,
+        PREFIX_SPACE,      // " ?"
+        PREFIX_WHITESPACE, // "\s?"
+    } prefix = PREFIX_NONE;
+
+    unicode_regex_class cls;
+
+    size_t n_max = 1; // the class repeats 1 to n_max times
+};
+
+static bool unicode_regex_simple_parse(const std::string & regex_expr, unicode_regex_simple & res) {
+    static const std::pair<const char *, uint16_t> k_categories[] = {
+        { "\\p{N}", unicode_cpt_flags::NUMBER      },
+        { "\\p{L}", unicode_cpt_flags::LETTER      },
+        { "\\p{P}", unicode_cpt_flags::PUNCTUATION },
+        { "\\p{M}", unicode_cpt_flags::ACCENT_MARK },
+        { "\\p{S}", unicode_cpt_flags::SYMBOL      },
+    };
+
+    std::vector<uint32_t> cpts;
+    try {
+        size_t offset = 0;
+        while (offset < regex_expr.size()) {
+            cpts.push_back(unicode_cpt_from_utf8(regex_expr, offset));
+        }
+    } catch (const std::invalid_argument &) {
+        return false;
+    }
+
+    size_t i = 0;
+
+    const auto at = [&](size_t k) -> uint32_t {
+        return k < cpts.size() ? cpts[k] : 0;
+    };
+
+    const auto starts_with = [&](const char * str) {
+        for (size_t k = 0; str[k] != 0; ++k) {
+            if (at(i + k) != (uint8_t) str[k]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    const auto parse_category = [&](uint16_t & category) {
+        for (const auto & cat : k_categories) {
+            if (starts_with(cat.first)) {
+                category = cat.second;
+                i += strlen(cat.first);
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // a codepoint or an escaped ASCII punctuation in a bracket expression
+    const auto parse_literal = [&](uint32_t & c) {
+        if (i >= cpts.size()) {
+            return false;
+        }
+        if (cpts[i] != '\\') {
+            c = cpts[i++];
+            return true;
+        }
+        switch (at(i + 1)) {
+            case 'r': c = '\r'; break;
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            default:
+                c = at(i + 1);
+                if (c >= 128 || !ispunct(c)) {
+                    return false; // \d, \w, \x.., ...
+                }
+        }
+        i += 2;
+        return true;
+    };
+
+    if (starts_with("\\s?")) {
+        res.prefix = unicode_regex_simple::PREFIX_WHITESPACE;
+        i += 3;
+    } else if (starts_with(" ?")) {
+        res.prefix = unicode_regex_simple::PREFIX_SPACE;
+        i += 2;
+    }
+
+    auto & cls = res.cls;
+
+    uint16_t category = 0;
+    if (parse_category(category)) {
+        cls.categories = category;
+    } else if (at(i) == '[') {
+        i++;
+        if (at(i) == '^') {
+            cls.negate = true;
+            i++;
+        }
+        while (true) {
+            if (i >= cpts.size()) {
+                return false;
+            }
+            if (cpts[i] == ']') {
+                i++;
+                break;
+            }
+            if (parse_category(category)) {
+                cls.categories |= category;
+                continue;
+            }
+            if (starts_with("\\s")) {
+                cls.whitespace = true;
+                i += 2;
+                continue;
+            }
+            uint32_t first = 0;
+            if (!parse_literal(first)) {
+                return false;
+            }
+            uint32_t last = first;
+            if (at(i) == '-' && i + 1 < cpts.size() && at(i + 1) != ']') {
+                i++;
+                if (!parse_literal(last) || last < first) {
+                    return false;
+                }
+            }
+            cls.ranges.emplace_back(first, last);
+        }
+    } else {
+        return false;
+    }
+
+    if (i == cpts.size()) {
+        res.n_max = 1;
+    } else if (starts_with("+") && i + 1 == cpts.size()) {
+        res.n_max = SIZE_MAX;
+    } else if (starts_with("{1,")) {
+        i += 3;
+        size_t n = 0;
+        while (at(i) >= '0' && at(i) <= '9') {
+            n = 10*n + (at(i++) - '0');
+        }
+        if (n == 0 || !starts_with("}") || i + 1 != cpts.size()) {
+            return false;
+        }
+        res.n_max = n;
+    } else {
+        return false;
+    }
+
+    // the fallback does not support regexes with both unicode categories and non-ASCII characters
+    if (cls.categories && !cls.ranges.empty() && cls.ranges.back().second >= 128) {
+        return false;
+    }
+
+    cls.init();
+
+    return true;
+}
+
+// the parsed simple regexes, nullptr for the other regexes
+static const unicode_regex_simple * unicode_regex_simple_get(const std::string & regex_expr) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex_simple>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = cache.find(regex_expr);
+    if (it == cache.end()) {
+        auto res = std::make_unique<unicode_regex_simple>();
+        if (!unicode_regex_simple_parse(regex_expr, *res)) {
+            res.reset();
+        }
+        it = cache.emplace(regex_expr, std::move(res)).first;
+    }
+
+    return it->second.get();
+}
+
+static std::vector<size_t> unicode_regex_split_custom_simple(const std::vector<uint32_t> & cpts, const std::string & text_collapsed, const unicode_regex_simple & regex, const std::vector<size_t> & offsets) {
+    const bool collapsed = regex.cls.categories != 0;
+
+    // the value that the fallback matches - non-ASCII whitespaces are replaced by 0x0B for std::wregex
+    const auto get = [&](const size_t pos) -> uint32_t {
+        if (collapsed) {
+            return (uint8_t) text_collapsed[pos];
+        }
+        const uint32_t cpt = cpts[pos];
+        return cpt > 0x7F && unicode_cpt_flags_from_cpt(cpt).is_whitespace ? 0x0B : cpt;
+    };
+
+    return unicode_regex_split_custom_match(offsets, [&](const size_t pos, const size_t end) -> size_t {
+        size_t n = 0;
+        if (regex.prefix != unicode_regex_simple::PREFIX_NONE && pos + 1 < end && regex.cls.contains(get(pos + 1))) {
+            const uint32_t c = get(pos);
+            n = regex.prefix == unicode_regex_simple::PREFIX_SPACE ? c == ' ' : unicode_collapsed_is_whitespace(c);
+        }
+
+        size_t k = 0;
+        while (k < regex.n_max && pos + n + k < end && regex.cls.contains(get(pos + n + k))) {
+            k++;
+        }
+
+        return k > 0 ? n + k : 0;
+    });
+}
+
+// regex: [0-9][0-9][0-9]
+static std::vector<size_t> unicode_regex_split_custom_digits3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
+    return unicode_regex_split_custom_match(offsets, [&](const size_t pos, const size_t end) -> size_t {
+        const auto is_digit = [&](size_t p) { return p < end && cpts[p] >= '0' && cpts[p] <= '9'; };
+        return is_digit(pos) && is_digit(pos + 1) && is_digit(pos + 2) ? 3 : 0;
+    });
+}
+
+// regex: \s+$
+static std::vector<size_t> unicode_regex_split_custom_trailing_whitespace(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets;
+    bpe_offsets.reserve(offsets.size() + 1);
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t ws_start = end;
+        while (ws_start > start && (unicode_collapsed_is_whitespace(cpts[ws_start - 1]) ||
+                (cpts[ws_start - 1] > 0x7F && unicode_cpt_flags_from_cpt(cpts[ws_start - 1]).is_whitespace))) {
+            ws_start--;
+        }
+
+        if (ws_start > start) {
+            bpe_offsets.push_back(ws_start - start);
+        }
+        if (end > ws_start) {
+            bpe_offsets.push_back(end - ws_start);
+        }
+
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
+// the end of the whitespace alternatives of the llama3-like regexes at pos, or 0 if none matches:
+// regex: \s*[\r\n]+|\s+(?!\S)|\s+
+template <typename F>
+static size_t unicode_regex_match_whitespace(size_t pos, size_t end, F && get) {
+    size_t ws_end = pos;
+    size_t last_r_or_n = 0;
+    while (ws_end < end && unicode_collapsed_is_whitespace(get(ws_end))) {
+        if (get(ws_end) == '\r' || get(ws_end) == '\n') {
+            last_r_or_n = ws_end + 1;
+        }
+        ws_end++;
+    }
+
+    // regex: \s*[\r\n]+
+    if (last_r_or_n > 0) {
+        return last_r_or_n;
+    }
+
+    // regex: \s+(?!\S)
+    if (ws_end - pos > 1 && ws_end < end) {
+        return ws_end - 1;
+    }
+
+    // regex: \s+
+    return ws_end > pos ? ws_end : 0;
+}
+
+// GPT4O system regex:
+//   [^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))*((?=[\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|
+//   [^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))+((?=[\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|
+//   \p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n/]*|\s*[\r\n]+|\s+(?!\S)|\s+
+// TEKKEN has no contractions and \p{N} instead of \p{N}{1,3}
+static std::vector<size_t> unicode_regex_split_custom_gpt4o(const std::string & text_collapsed, const std::vector<size_t> & offsets, bool contractions, size_t n_digits_max) {
+    return unicode_regex_split_custom_match(offsets, [&](const size_t pos, const size_t end) -> size_t {
+        const auto get = [&](size_t p) -> uint32_t {
+            return p < end ? (uint8_t) text_collapsed[p] : 0;
+        };
+
+        // on the collapsed text, the non-ASCII letters are both "upper" and "lower"
+        const auto is_upper = [&](size_t p) { return p < end && unicode_collapsed_is_letter(get(p)) && !(get(p) >= 'a' && get(p) <= 'z'); };
+        const auto is_lower = [&](size_t p) { return p < end && unicode_collapsed_is_letter(get(p)) && !(get(p) >= 'A' && get(p) <= 'Z'); };
+
+        // regex: (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?
+        const auto contraction = [&](size_t p) -> size_t {
+            if (!contractions || get(p) != '\'' || p + 1 >= end) {
+                return p;
+            }
+            const uint32_t c1 = get(p + 1) | 0x20;
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                return p + 2;
+            }
+            if (p + 2 < end) {
+                const uint32_t c2 = get(p + 2) | 0x20;
+                if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                    return p + 3;
+                }
+            }
+            return p;
+        };
+
+        // regex: [^\r\n\p{L}\p{N}]?
+        const bool has_prefix = get(pos) != '\r' && get(pos) != '\n' && !unicode_collapsed_is_letter(get(pos)) && !unicode_collapsed_is_number(get(pos));
+
+        // regex: [^\r\n\p{L}\p{N}]?<upper>*<lower>+<contraction>?
+        // the prefix is not a letter, so the letters can only start after it
+        {
+            const size_t start = pos + has_prefix;
+
+            size_t upper_end = start;
+            while (is_upper(upper_end)) {
+                upper_end++;
+            }
+
+            // the greedy <upper>* gives back letters until <lower>+ matches
+            for (size_t k = upper_end + 1; k-- > start; ) {
+                if (is_lower(k)) {
+                    size_t lower_end = k;
+                    while (is_lower(lower_end)) {
+                        lower_end++;
+                    }
+                    return contraction(lower_end) - pos;
+                }
+            }
+        }
+
+        // regex: [^\r\n\p{L}\p{N}]?<upper>+<lower>*<contraction>?
+        {
+            const size_t start = pos + has_prefix;
+
+            size_t upper_end = start;
+            while (is_upper(upper_end)) {
+                upper_end++;
+            }
+
+            if (upper_end > start) {
+                size_t lower_end = upper_end;
+                while (is_lower(lower_end)) {
+                    lower_end++;
+                }
+                return contraction(lower_end) - pos;
+            }
+        }
+
+        // regex: \p{N}{1,3}
+        if (unicode_collapsed_is_number(get(pos))) {
+            size_t n = 1;
+            while (n < n_digits_max && pos + n < end && unicode_collapsed_is_number(get(pos + n))) {
+                n++;
+            }
+            return n;
+        }
+
+        // regex: <space>?[^\s\p{L}\p{N}]+[\r\n/]*
+        {
+            const auto is_other = [&](size_t p) {
+                const uint32_t c = get(p);
+                return p < end && !unicode_collapsed_is_whitespace(c) && !unicode_collapsed_is_letter(c) && !unicode_collapsed_is_number(c);
+            };
+
+            const size_t start = pos + (get(pos) == ' ' && is_other(pos + 1));
+            if (is_other(start)) {
+                size_t other_end = start;
+                while (is_other(other_end)) {
+                    other_end++;
+                }
+                while (other_end < end && (get(other_end) == '\r' || get(other_end) == '\n' || get(other_end) == '/')) {
+                    other_end++;
+                }
+                return other_end - pos;
+            }
+        }
+
+        const size_t ws_end = unicode_regex_match_whitespace(pos, end, get);
+
+        return ws_end > 0 ? ws_end - pos : 0;
+    });
+}
+
+// DEEPSEEK3 system regex:
+//   [!"#$%&'()*+,\-./:;<=>?@\[\\\]^_`{|}~][A-Za-z]+|[^\r\n\p{L}\p{P}\p{S}]?[\p{L}\p{M}]+| ?[\p{P}\p{S}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+static std::vector<size_t> unicode_regex_split_custom_deepseek3(const std::string & text_collapsed, const std::vector<size_t> & offsets) {
+    return unicode_regex_split_custom_match(offsets, [&](const size_t pos, const size_t end) -> size_t {
+        const auto get = [&](size_t p) -> uint32_t {
+            return p < end ? (uint8_t) text_collapsed[p] : 0;
+        };
+
+        const auto is_ascii_letter = [&](size_t p) {
+            const uint32_t c = get(p) | 0x20;
+            return p < end && c >= 'a' && c <= 'z';
+        };
+        const auto is_letter_or_mark = [&](size_t p) {
+            return p < end && (unicode_collapsed_is_letter(get(p)) || unicode_collapsed_is_accent_mark(get(p)));
+        };
+        const auto is_punct_or_symbol = [&](size_t p) {
+            return p < end && (unicode_collapsed_is_punctuation(get(p)) || unicode_collapsed_is_symbol(get(p)));
+        };
+
+        const uint32_t c = get(pos);
+
+        // regex: [!"#$%&'()*+,\-./:;<=>?@\[\\\]^_`{|}~][A-Za-z]+
+        if (((c >= 0x21 && c <= 0x2F) || (c >= 0x3A && c <= 0x40) || (c >= 0x5B && c <= 0x60) || (c >= 0x7B && c <= 0x7E)) && is_ascii_letter(pos + 1)) {
+            size_t p = pos + 1;
+            while (is_ascii_letter(p)) {
+                p++;
+            }
+            return p - pos;
+        }
+
+        // regex: [^\r\n\p{L}\p{P}\p{S}]?[\p{L}\p{M}]+
+        {
+            const bool has_prefix = c != '\r' && c != '\n' && !unicode_collapsed_is_letter(c) && !is_punct_or_symbol(pos);
+
+            size_t p = pos + (has_prefix && is_letter_or_mark(pos + 1));
+            if (is_letter_or_mark(p)) {
+                while (is_letter_or_mark(p)) {
+                    p++;
+                }
+                return p - pos;
+            }
+        }
+
+        // regex: <space>?[\p{P}\p{S}]+[\r\n]*
+        {
+            size_t p = pos + (c == ' ' && is_punct_or_symbol(pos + 1));
+            if (is_punct_or_symbol(p)) {
+                while (is_punct_or_symbol(p)) {
+                    p++;
+                }
+                while (p < end && (get(p) == '\r' || get(p) == '\n')) {
+                    p++;
+                }
+                return p - pos;
+            }
+        }
+
+        const size_t ws_end = unicode_regex_match_whitespace(pos, end, get);
+
+        return ws_end > 0 ? ws_end - pos : 0;
+    });
+}
+
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & text_collapsed, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
+    // the splitters that classify the collapsed text need it
+    const bool has_collapsed = text_collapsed.size() == cpts.size();
+
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 3, true);
+    } else if (
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+            // \s*[\r\n] ends at the same newline as \s*[\r\n]+
+            regex_expr == "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+") {
+        // QWEN2, BAILINGMOE
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1, true);
+    } else if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        // SEED_CODER
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1, false);
+    } else if (has_collapsed && regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_gpt4o(text_collapsed, offsets, true, 3);
+    } else if (has_collapsed && regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        // TEKKEN
+        bpe_offsets = unicode_regex_split_custom_gpt4o(text_collapsed, offsets, false, 1);
+    } else if (has_collapsed && regex_expr == "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_deepseek3(text_collapsed, offsets);
     } else if (regex_expr == "\\p{Han}+") {
         // K2's first pattern - handle all K2 patterns together
-        bpe_offsets = unicode_regex_split_custom_kimi_k2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_kimi_k2(cpts, offsets);
+    } else if (regex_expr == "[0-9][0-9][0-9]") {
+        bpe_offsets = unicode_regex_split_custom_digits3(cpts, offsets);
+    } else if (regex_expr == "\\s+$") {
+        bpe_offsets = unicode_regex_split_custom_trailing_whitespace(cpts, offsets);
+    } else if (const auto * regex = unicode_regex_simple_get(regex_expr)) {
+        // \p{N}, \s?\p{L}+, [\p{P}\$\+<=>\^~\|]+, [一-龥ࠀ-一가-퟿]+, ...
+        if (has_collapsed || regex->cls.categories == 0) {
+            bpe_offsets = unicode_regex_split_custom_simple(cpts, text_collapsed, *regex, offsets);
+        }
     }
 
     return bpe_offsets;
@@ -794,26 +1512,71 @@ std::vector<uint32_t> unicode_cpts_normalize_nfd(const std::vector<uint32_t> & c
 }
 
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
-    std::vector<uint32_t> result;
-    result.reserve(utf8.size());
+    const size_t size = utf8.size();
+    const char * data = utf8.data();
+
+    // at most one codepoint per byte
+    std::vector<uint32_t> result(size);
+    uint32_t * out = result.data();
+
     size_t offset = 0;
-    while (offset < utf8.size()) {
+    while (offset < size) {
+        const uint8_t c0 = data[offset];
+
+        if (c0 < 0x80) {
+            // ASCII fast path: 16 bytes at a time, while the high bits of both 64-bit words are clear
+            while (offset + 16 <= size) {
+                uint64_t w0;
+                uint64_t w1;
+                memcpy(&w0, data + offset,     sizeof(w0));
+                memcpy(&w1, data + offset + 8, sizeof(w1));
+                if ((w0 | w1) & 0x8080808080808080ull) {
+                    break;
+                }
+                for (size_t i = 0; i < 16; ++i) {
+                    out[i] = (uint8_t) data[offset + i];
+                }
+                out    += 16;
+                offset += 16;
+            }
+
+            while (offset < size && (uint8_t) data[offset] < 0x80) {
+                *out++ = (uint8_t) data[offset++];
+            }
+            continue;
+        }
+
+        // the 2- and 3-byte sequences inline, the rest through unicode_cpt_from_utf8
+        if ((c0 & 0xE0) == 0xC0 && offset + 1 < size && (data[offset + 1] & 0xC0) == 0x80) {
+            *out++ = ((c0 & 0x1F) << 6) | (data[offset + 1] & 0x3F);
+            offset += 2;
+            continue;
+        }
+        if ((c0 & 0xF0) == 0xE0 && offset + 2 < size && (data[offset + 1] & 0xC0) == 0x80 && (data[offset + 2] & 0xC0) == 0x80) {
+            *out++ = ((c0 & 0x0F) << 12) | ((data[offset + 1] & 0x3F) << 6) | (data[offset + 2] & 0x3F);
+            offset += 3;
+            continue;
+        }
+
+        uint32_t cpt;
         try {
-            result.push_back(unicode_cpt_from_utf8(utf8, offset));
+            cpt = unicode_cpt_from_utf8(utf8, offset);
         }
         catch (const std::invalid_argument & /*ex*/) {
             // Silently ignore invalid UTF-8 input to avoid leaking the exception beyond llama_tokenize
             ++offset;
-            result.emplace_back(0xFFFD); // replacement character
+            cpt = 0xFFFD; // replacement character
         }
+        *out++ = cpt;
     }
+
+    result.resize(out - result.data());
+
     return result;
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_cpt(const uint32_t cpt) {
-    static const unicode_cpt_flags undef(unicode_cpt_flags::UNDEFINED);
-    static const auto cpt_flags = unicode_cpt_flags_array();
-    return cpt < cpt_flags.size() ? cpt_flags[cpt] : undef;
+    return unicode_cpt_flags_table_get().get(cpt);
 }
 
 unicode_cpt_flags unicode_cpt_flags_from_utf8(const std::string & utf8) {
@@ -879,7 +1642,7 @@ bool unicode_cpt_is_han(uint32_t cpt) {
     return false;
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -926,6 +1689,8 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
+        const auto & cpt_flags = unicode_cpt_flags_table_get();
+
         for (size_t i = 0; i < cpts.size(); ++i) {
             // keep single-byte codepoints as is
             if (cpts[i] < 128) {
@@ -933,7 +1698,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                 continue;
             }
 
-            const auto flags = unicode_cpt_flags_from_cpt(cpts[i]);
+            const auto flags = cpt_flags.get(cpts[i]);
 
             if (flags.is_whitespace) {
                 //NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
@@ -951,11 +1716,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        if (use_custom) {
+            auto tmp = unicode_regex_split_custom(cpts, text_collapsed, regex_expr, bpe_offsets);
 
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
+            if (!tmp.empty()) {
+                bpe_offsets = std::move(tmp);
+                continue;
+            }
         }
 
         // fallback to general-purpose std::regex / std::wregex
@@ -1045,17 +1812,5 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<std::string> bpe_words;
-    bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
-
-    size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
-        }
-        start += offset;
-    }
-
-    return unicode_byte_encoding_process(bpe_words);
+    return unicode_byte_encoding_process(cpts, bpe_offsets);
 }
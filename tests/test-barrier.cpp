@@ -7,10 +7,151 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
+#include <functional>
+#include <random>
 #include <vector>
 
 #define MAX_NARGS 2
 
+// the abort callback is checked once before each barrier and once after the last node,
+// so the number of calls is the number of segments of the graph computed without a barrier in between
+static bool count_segments(void * data) {
+    (*(int *) data)++;
+    return false;
+}
+
+struct segments_result {
+    int n_segments;
+    std::vector<std::vector<uint8_t>> nodes; // content of the computed nodes
+};
+
+static segments_result compute_segments(const std::function<void(ggml_context *, ggml_cgraph *)> & build, int n_threads) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+    struct ggml_cgraph  * gf  = ggml_new_graph(ctx);
+
+    build(ctx, gf);
+
+    // same inputs for every run
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->op == GGML_OP_NONE && t->type == GGML_TYPE_F32) {
+            float * data = (float *) t->data;
+            for (int64_t i = 0; i < ggml_nelements(t); i++) {
+                data[i] = dist(rng);
+            }
+        }
+    }
+
+    segments_result res = { 0, {} };
+
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, NULL);
+
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+
+    cplan.abort_callback      = count_segments;
+    cplan.abort_callback_data = &res.n_segments;
+
+    if (ggml_graph_compute(gf, &cplan) != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "graph-compute failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < ggml_graph_n_nodes(gf); i++) {
+        const struct ggml_tensor * node = ggml_graph_node(gf, i);
+        const uint8_t * data = (const uint8_t *) node->data;
+
+        res.nodes.emplace_back(data, data + ggml_nbytes(node));
+    }
+
+    ggml_free(ctx);
+
+    return res;
+}
+
+// check where the barriers between the nodes are kept, and that skipping the others does not change the results
+static bool test_segments(const char * name, int n_segments, int n_threads, const std::function<void(ggml_context *, ggml_cgraph *)> & build) {
+    const segments_result ref = compute_segments(build, 1);
+    const segments_result res = compute_segments(build, n_threads);
+
+    bool ok = ref.n_segments == n_segments && res.n_segments == n_segments && ref.nodes.size() == res.nodes.size();
+
+    for (size_t i = 0; ok && i < ref.nodes.size(); i++) {
+        ok = ref.nodes[i].size() == res.nodes[i].size() &&
+            memcmp(ref.nodes[i].data(), res.nodes[i].data(), ref.nodes[i].size()) == 0;
+    }
+
+    fprintf(stderr, "%s: %-16s: n_segments = %d (expected %d, %d with 1 thread): %s\n", __func__, name,
+            res.n_segments, n_segments, ref.n_segments, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+static bool test_barriers(int n_threads) {
+    const int64_t ne0 = 256;
+    const int64_t ne1 = 64;
+
+    bool ok = true;
+
+    // no shared memory: the second node runs right after the first one
+    ok &= test_segments("independent", 1, n_threads, [&](ggml_context * ctx, ggml_cgraph * gf) {
+        ggml_tensor * a = ggml_add(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1), ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+        ggml_tensor * b = ggml_mul(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1), ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+
+        ggml_build_forward_expand(gf, a);
+        ggml_build_forward_expand(gf, b);
+    });
+
+    // the second node reads the rows of the first one through a view shifted by one row,
+    // so each thread reads rows written by another thread
+    ok &= test_segments("view", 2, n_threads, [&](ggml_context * ctx, ggml_cgraph * gf) {
+        ggml_tensor * a = ggml_add(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1), ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+        ggml_tensor * v = ggml_view_2d(ctx, a, ne0, ne1 - 1, a->nb[1], a->nb[1]);
+        ggml_tensor * b = ggml_mul(ctx, v, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1 - 1));
+
+        ggml_build_forward_expand(gf, b);
+    });
+
+    // the second node overwrites an input of the first one
+    ok &= test_segments("write-after-read", 2, n_threads, [&](ggml_context * ctx, ggml_cgraph * gf) {
+        ggml_tensor * y = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        ggml_tensor * a = ggml_add(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1), y);
+        ggml_tensor * b = ggml_cpy(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1 - 1), ggml_view_2d(ctx, y, ne0, ne1 - 1, y->nb[1], y->nb[1]));
+
+        ggml_build_forward_expand(gf, a);
+        ggml_build_forward_expand(gf, b);
+    });
+
+    // both nodes use the work buffer: they must not run in the same segment even without shared tensors
+    ok &= test_segments("wdata", 2, n_threads, [&](ggml_context * ctx, ggml_cgraph * gf) {
+        ggml_tensor * a = ggml_soft_max(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+        ggml_tensor * b = ggml_soft_max(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+
+        ggml_build_forward_expand(gf, a);
+        ggml_build_forward_expand(gf, b);
+    });
+
+    // only one of them uses the work buffer
+    ok &= test_segments("wdata-once", 1, n_threads, [&](ggml_context * ctx, ggml_cgraph * gf) {
+        ggml_tensor * a = ggml_soft_max(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+        ggml_tensor * b = ggml_add(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1), ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1));
+
+        ggml_build_forward_expand(gf, a);
+        ggml_build_forward_expand(gf, b);
+    });
+
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
 
     int n_threads = 4;
@@ -24,6 +165,10 @@ int main(int argc, char *argv[]) {
         n_rounds  = std::atoi(argv[2]);
     }
 
+    if (!test_barriers(n_threads)) {
+        return 1;
+    }
+
     struct ggml_init_params params = {
         /* .mem_size   = */ 1024*1024*1024,
         /* .mem_buffer = */ NULL,
@@ -0,0 +1,145 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "common.h"
+
+#include "../src/llama-grammar.h"
+#include "../src/llama-vocab.h"
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// the grammar sampler matches the whole vocabulary against the grammar using the vocab trie and caches the result per
+// grammar state, while small candidate arrays (e.g. after top-k) are matched token by token. apply the grammar to the
+// whole vocabulary both ways while generating a json document and check that the results are the same. with --bench,
+// also report the allowed tokens and the cost per token
+
+static const char * json_text = R"({"name": "grammar", "tags": ["json", "ünïcødé", "日本語", ""], "count": -12.5e3, "ok": true, "next": null,
+  "nested": {"a": [1, 20, {"b": "é\n"}], "empty": {}, "list": []}})";
+
+// candidate arrays smaller than this use the token-by-token path
+static const size_t n_chunk = 128;
+
+int main(int argc, char ** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <vocab-file> <grammar-file> [--bench]\n", argv[0]);
+        return 1;
+    }
+
+    const bool bench = argc > 3 && std::string(argv[3]) == "--bench";
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::string grammar_str;
+    {
+        std::ifstream file(argv[2]);
+        if (!file) {
+            fprintf(stderr, "%s: error: failed to open grammar '%s'\n", __func__, argv[2]);
+            return 1;
+        }
+
+        std::stringstream ss;
+        ss << file.rdbuf();
+        grammar_str = ss.str();
+    }
+
+    llama_grammar * grammar = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+    assert(grammar != nullptr);
+
+    // only ever sees small candidate arrays, so it never fills its mask cache
+    llama_grammar * grammar_ref = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+    assert(grammar_ref != nullptr);
+
+    const std::vector<llama_token> tokens = common_tokenize(vocab, json_text, false, false);
+
+    std::vector<llama_token_data> cur(n_vocab);
+    std::vector<llama_token_data> ref(n_vocab);
+
+    double t_full_ms  = 0.0;
+    double t_chunk_ms = 0.0;
+
+    // build the trie before timing
+    vocab->get_grammar_trie();
+
+    for (const llama_token token : tokens) {
+        for (int i = 0; i < n_vocab; ++i) {
+            cur[i] = llama_token_data{ i, 0.0f, 0.0f };
+        }
+        ref = cur;
+
+        const auto t_start = std::chrono::steady_clock::now();
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_grammar_apply_impl(*grammar, &cur_p);
+
+        const auto t_mid = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < ref.size(); i += n_chunk) {
+            llama_token_data_array ref_p = { ref.data() + i, std::min(n_chunk, ref.size() - i), -1, false };
+            llama_grammar_apply_impl(*grammar_ref, &ref_p);
+        }
+
+        const auto t_end = std::chrono::steady_clock::now();
+
+        t_full_ms  += std::chrono::duration<double, std::milli>(t_mid - t_start).count();
+        t_chunk_ms += std::chrono::duration<double, std::milli>(t_end - t_mid).count();
+
+        int n_allowed = 0;
+        for (int i = 0; i < n_vocab; ++i) {
+            if (std::isinf(cur[i].logit) != std::isinf(ref[i].logit)) {
+                fprintf(stderr, "%s: mismatch for token %d ('%s') before token '%s'\n", __func__,
+                        i, common_token_to_piece(vocab, i).c_str(), common_token_to_piece(vocab, token).c_str());
+                return 1;
+            }
+            n_allowed += !std::isinf(cur[i].logit);
+        }
+
+        assert(!std::isinf(cur[token].logit));
+
+        if (bench) {
+            printf("%-12s: %6d allowed\n", ("'" + common_token_to_piece(vocab, token) + "'").c_str(), n_allowed);
+        }
+
+        llama_grammar_accept_impl(*grammar,     token);
+        llama_grammar_accept_impl(*grammar_ref, token);
+    }
+
+    if (bench) {
+        printf("\n%s: n_vocab = %d, n_tokens = %zu\n", __func__, n_vocab, tokens.size());
+        printf("%s: full vocabulary:   %8.3f ms per token\n", __func__, t_full_ms  / tokens.size());
+        printf("%s: chunks of %5zu:   %8.3f ms per token\n", __func__, n_chunk, t_chunk_ms / tokens.size());
+        printf("%s: mask cache: %zu hits, %zu misses\n", __func__, grammar->mask_cache.n_hit, grammar->mask_cache.n_miss);
+    } else {
+        printf("%s: n_vocab = %d, n_tokens = %zu: OK\n", __func__, n_vocab, tokens.size());
+    }
+
+    assert(grammar_ref->mask_cache.entries.empty());
+
+    llama_grammar_free_impl(grammar_ref);
+    llama_grammar_free_impl(grammar);
+    llama_model_free(model);
+    llama_backend_free();
+
+    return 0;
+}
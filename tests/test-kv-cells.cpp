@@ -0,0 +1,404 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+
+#include "../src/llama-kv-cells.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+// naive model of the cells: a position and a sequence bitset per cell
+struct kv_cells_ref {
+    std::vector<llama_pos> pos;
+    std::vector<std::bitset<LLAMA_MAX_SEQ>> seq;
+
+    explicit kv_cells_ref(uint32_t n) : pos(n, -1), seq(n) {}
+
+    void clear(uint32_t i) {
+        pos[i] = -1;
+        seq[i].reset();
+    }
+};
+
+static void check_equal(const llama_kv_cells & cells, const kv_cells_ref & ref, int n_seq) {
+    const uint32_t n = cells.size();
+
+    for (uint32_t i = 0; i < n; ++i) {
+        assert(cells.is_empty(i) == (ref.pos[i] == -1));
+
+        if (ref.pos[i] == -1) {
+            continue;
+        }
+
+        assert(cells.pos_get(i) == ref.pos[i]);
+        assert(cells.seq_count(i) == (int) ref.seq[i].count());
+
+        for (int s = 0; s < n_seq; ++s) {
+            assert(cells.seq_has(i, s) == ref.seq[i].test(s));
+        }
+    }
+
+    for (int s = 0; s < n_seq; ++s) {
+        llama_pos p_min = -1;
+        llama_pos p_max = -1;
+
+        std::vector<uint32_t> idxs;
+
+        for (uint32_t i = 0; i < n; ++i) {
+            if (ref.pos[i] == -1 || !ref.seq[i].test(s)) {
+                continue;
+            }
+
+            p_min = p_min < 0 ? ref.pos[i] : std::min(p_min, ref.pos[i]);
+            p_max = std::max(p_max, ref.pos[i]);
+
+            idxs.push_back(i);
+        }
+
+        assert(cells.seq_pos_min(s) == p_min);
+        assert(cells.seq_pos_max(s) == p_max);
+
+        auto res = cells.seq_cells(s, 0, std::numeric_limits<llama_pos>::max());
+        std::sort(res.begin(), res.end());
+
+        assert(res == idxs);
+    }
+}
+
+// apply random operations to both the cells and the reference and compare them
+static void test_random_ops(uint32_t n, int n_seq, int n_ops, uint32_t seed) {
+    std::mt19937 rng(seed);
+
+    llama_kv_cells cells;
+    cells.resize(n);
+
+    kv_cells_ref ref(n);
+
+    for (int it = 0; it < n_ops; ++it) {
+        const uint32_t i = rng() % n;
+
+        // mostly a few sequences, so that cells get shared
+        const llama_seq_id s = rng() % 8 == 0 ? rng() % n_seq : rng() % 4;
+
+        switch (rng() % 8) {
+            case 0:
+                if (ref.pos[i] == -1) {
+                    const llama_pos p = rng() % 64;
+
+                    cells.pos_set(i, p);
+                    cells.seq_add(i, s);
+
+                    ref.pos[i] = p;
+                    ref.seq[i].set(s);
+                }
+                break;
+            case 1:
+                if (ref.pos[i] != -1 && !ref.seq[i].test(s)) {
+                    cells.seq_add(i, s);
+                    ref.seq[i].set(s);
+                }
+                break;
+            case 2:
+                if (ref.pos[i] != -1 && ref.seq[i].test(s)) {
+                    ref.seq[i].reset(s);
+                    if (ref.seq[i].none()) {
+                        ref.clear(i);
+                    }
+
+                    assert(cells.seq_rm(i, s) == (ref.pos[i] == -1));
+                }
+                break;
+            case 3:
+                {
+                    cells.seq_keep(i, s);
+
+                    if (ref.seq[i].test(s)) {
+                        ref.seq[i].reset();
+                        ref.seq[i].set(s);
+                    } else if (ref.pos[i] != -1) {
+                        ref.clear(i);
+                    }
+                } break;
+            case 4:
+                if (ref.pos[i] != -1) {
+                    cells.rm(i);
+                    ref.clear(i);
+                }
+                break;
+            case 5:
+                if (ref.pos[i] != -1) {
+                    const llama_pos d = (llama_pos) (rng() % 7) - 3;
+
+                    cells.pos_add(i, d);
+                    cells.reset_shift();
+
+                    ref.pos[i] += d;
+                    if (ref.pos[i] < 0) {
+                        ref.clear(i);
+                    }
+                }
+                break;
+            case 6:
+                {
+                    const uint32_t j = rng() % n;
+
+                    if (ref.pos[i] != -1 && ref.pos[j] == -1) {
+                        cells.mv(i, j);
+
+                        ref.pos[j] = ref.pos[i];
+                        ref.seq[j] = ref.seq[i];
+                        ref.clear(i);
+                    }
+                } break;
+            case 7:
+                {
+                    // save a range of cells and restore it somewhere else
+                    const uint32_t m  = 1 + rng() % 8;
+                    const uint32_t i0 = rng() % (n - m);
+                    const uint32_t i1 = rng() % (n - m);
+
+                    const auto saved = cells.cp(i0, m);
+                    cells.set(i1, saved);
+
+                    const kv_cells_ref tmp = ref;
+                    for (uint32_t k = 0; k < m; ++k) {
+                        ref.pos[i1 + k] = tmp.pos[i0 + k];
+                        ref.seq[i1 + k] = tmp.seq[i0 + k];
+                    }
+                } break;
+        }
+
+        if (it % 101 == 0) {
+            check_equal(cells, ref, n_seq);
+        }
+    }
+
+    check_equal(cells, ref, n_seq);
+}
+
+// fragment the cells at random, then compact them in steps of at most n_max_moves cells in n_max_runs runs, the way
+// llama_kv_cache does: after the compaction, the used cells must be exactly [0, n_used), with the same positions and
+// sequences as before
+static void test_compact(uint32_t n, int n_seq, uint32_t n_max_moves, uint32_t n_max_runs, uint32_t seed) {
+    std::mt19937 rng(seed);
+
+    llama_kv_cells cells;
+    cells.resize(n);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (rng() % 3 == 0) {
+            continue;
+        }
+
+        cells.pos_set(i, rng() % 1000);
+
+        const int n_cur = 1 + rng() % 3;
+        for (int k = 0; k < n_cur; ++k) {
+            const llama_seq_id s = rng() % n_seq;
+            if (!cells.seq_has(i, s)) {
+                cells.seq_add(i, s);
+            }
+        }
+    }
+
+    // the content of the used cells, in a canonical order
+    const auto content = [&]() {
+        std::vector<std::pair<llama_pos, std::bitset<LLAMA_MAX_SEQ>>> res;
+
+        for (uint32_t i = 0; i < n; ++i) {
+            if (cells.is_empty(i)) {
+                continue;
+            }
+
+            std::bitset<LLAMA_MAX_SEQ> seq;
+            for (int s = 0; s < n_seq; ++s) {
+                seq.set(s, cells.seq_has(i, s));
+            }
+
+            res.emplace_back(cells.pos_get(i), seq);
+        }
+
+        std::sort(res.begin(), res.end(), [](const auto & a, const auto & b) {
+            return a.first != b.first ? a.first < b.first : a.second.to_string() < b.second.to_string();
+        });
+
+        return res;
+    };
+
+    const auto content_before = content();
+
+    const uint32_t n_used = cells.get_used();
+
+    int n_steps = 0;
+
+    while (true) {
+        const auto runs = cells.compact_plan(n_max_moves, n_max_runs);
+
+        if (runs.empty()) {
+            break;
+        }
+
+        assert(runs.size() <= n_max_runs);
+
+        uint32_t n_moves = 0;
+
+        for (const auto & run : runs) {
+            for (uint32_t j = 0; j < run.len; ++j) {
+                assert(run.dst + j < n_used);
+                assert(run.src + j >= n_used);
+
+                cells.mv(run.src + j, run.dst + j);
+            }
+
+            n_moves += run.len;
+        }
+
+        assert(n_moves <= n_max_moves);
+
+        n_steps++;
+    }
+
+    assert(cells.get_used()    == n_used);
+    assert(cells.used_max_p1() == n_used);
+
+    for (uint32_t i = 0; i < n_used; ++i) {
+        assert(!cells.is_empty(i));
+    }
+
+    assert(content() == content_before);
+
+    // each step moves at least one cell
+    assert((uint32_t) n_steps <= n - n_used);
+}
+
+// server-like churn: slots keep finishing requests and starting new ones that reuse a part of the previous prompt,
+// with occasional context shifts. compare the cost of visiting the cells of a sequence by scanning the whole cache
+// vs by using the per-sequence index
+static void bench_churn(uint32_t n, int n_slots, int n_iter, bool use_index) {
+    std::mt19937 rng(42);
+
+    llama_kv_cells cells;
+    cells.resize(n);
+
+    const uint32_t n_ctx_slot = n/n_slots;
+
+    std::vector<llama_pos> n_past(n_slots, 0);
+
+    uint32_t head = 0;
+
+    const auto rm = [&](llama_seq_id s, llama_pos p0, llama_pos p1) {
+        if (use_index) {
+            for (const uint32_t i : cells.seq_cells(s, p0, p1)) {
+                cells.seq_rm(i, s);
+            }
+        } else {
+            for (uint32_t i = 0; i < cells.size(); ++i) {
+                if (cells.pos_in(i, p0, p1) && cells.seq_has(i, s)) {
+                    cells.seq_rm(i, s);
+                }
+            }
+        }
+    };
+
+    const auto add = [&](llama_seq_id s, llama_pos p0, llama_pos p1, llama_pos d) {
+        if (use_index) {
+            for (const uint32_t i : cells.seq_cells(s, p0, p1)) {
+                cells.pos_add(i, d);
+            }
+        } else {
+            for (uint32_t i = 0; i < cells.size(); ++i) {
+                if (cells.pos_in(i, p0, p1) && cells.seq_has(i, s)) {
+                    cells.pos_add(i, d);
+                }
+            }
+        }
+        cells.reset_shift();
+    };
+
+    const auto append = [&](llama_seq_id s, uint32_t n_tokens) {
+        for (uint32_t k = 0; k < n_tokens; ++k) {
+            while (!cells.is_empty(head)) {
+                head = (head + 1) % n;
+            }
+
+            cells.pos_set(head, n_past[s]++);
+            cells.seq_add(head, s);
+        }
+    };
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    for (int it = 0; it < n_iter; ++it) {
+        const llama_seq_id s = rng() % n_slots;
+
+        switch (rng() % 4) {
+            case 0:
+                {
+                    // new request that keeps a prefix of the previous prompt
+                    const llama_pos n_keep = n_past[s] > 0 ? rng() % n_past[s] : 0;
+
+                    rm(s, n_keep, std::numeric_limits<llama_pos>::max());
+                    n_past[s] = n_keep;
+
+                    append(s, std::min<uint32_t>(n_ctx_slot - 1 - n_keep, rng() % 64));
+                } break;
+            case 1:
+            case 2:
+                {
+                    // generate a few tokens, shift the context when the slot is full
+                    if (n_past[s] + 8 >= (llama_pos) n_ctx_slot) {
+                        const llama_pos n_discard = n_past[s]/2;
+
+                        rm (s, 0,         n_discard);
+                        add(s, n_discard, std::numeric_limits<llama_pos>::max(), -n_discard);
+
+                        n_past[s] -= n_discard;
+                    }
+
+                    append(s, 8);
+                } break;
+            case 3:
+                {
+                    // request finished
+                    rm(s, 0, std::numeric_limits<llama_pos>::max());
+                    n_past[s] = 0;
+                } break;
+        }
+    }
+
+    const auto t_end = std::chrono::steady_clock::now();
+
+    printf("%s: n = %6u, n_slots = %3d, n_iter = %d, %-7s: %8.2f ms\n", __func__, n, n_slots, n_iter,
+            use_index ? "indexed" : "scan", std::chrono::duration<double, std::milli>(t_end - t_start).count());
+}
+
+// usage: test-kv-cells [--bench]
+// --bench also times the server-like churn with and without the per-sequence index
+int main(int argc, char ** argv) {
+    const bool bench = argc > 1 && std::string(argv[1]) == "--bench";
+
+    test_random_ops(64,   300, 200000, 1);
+    test_random_ops(1024,  16,  50000, 2);
+
+    test_compact(1024, 8, 1024, 1024, 3);
+    test_compact(1024, 8,   16,    2, 4);
+    test_compact(4096, 64, 512,    1, 5);
+
+    if (bench) {
+        bench_churn(32768, 64, 20000, false);
+        bench_churn(32768, 64, 20000, true);
+    }
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+// check that the sink + recent window eviction (llama_context_params.n_sink) keeps the positions of a sequence bounded,
+// and that it removes exactly the oldest tokens after the sink: a context without eviction, on which the same
+// seq_rm/seq_add are done by hand, must give the same logits. a rejected batch or a batch with explicit positions
+// must leave the cache as it is
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static llama_context * make_context(llama_model * model, int32_t n_sink) {
+    auto cparams = llama_context_default_params();
+
+    cparams.n_ctx     = 128;
+    cparams.n_batch   = 16;
+    cparams.n_ubatch  = 16;
+    cparams.n_seq_max = 1;
+    cparams.n_threads = 2;
+    cparams.n_threads_batch = 2;
+    cparams.n_sink    = n_sink;
+
+    return llama_init_from_model(model, cparams);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+
+    llama_model * model = llama_model_load_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, model_path);
+        return EXIT_FAILURE;
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const int32_t n_sink  = 4;
+
+    llama_context * ctx = make_context(model, n_sink);
+    if (ctx == nullptr || !llama_memory_can_shift(llama_get_memory(ctx))) {
+        fprintf(stderr, "%s: the memory of this model cannot be shifted, skipping\n", __func__);
+        llama_free(ctx);
+        llama_model_free(model);
+        llama_backend_free();
+        return EXIT_SUCCESS;
+    }
+
+    llama_context * ctx_ref = make_context(model, -1);
+
+    llama_memory_t mem     = llama_get_memory(ctx);
+    llama_memory_t mem_ref = llama_get_memory(ctx_ref);
+
+    const uint32_t n_ctx = llama_n_ctx(ctx);
+
+    std::mt19937 rng(42);
+
+    int32_t n_tokens  = 0;
+    int32_t n_kept    = 0;
+    int32_t n_evicted = 0;
+
+    bool ok = true;
+
+    // feed about 3 contexts worth of tokens, in batches of varying size without explicit positions
+    while (ok && n_tokens < 3*(int32_t) n_ctx) {
+        std::vector<llama_token> tokens(1 + rng() % 12);
+        for (auto & t : tokens) {
+            t = rng() % n_vocab;
+        }
+        n_tokens += tokens.size();
+
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
+            fprintf(stderr, "%s: llama_decode failed after %d tokens\n", __func__, n_tokens);
+            ok = false;
+            break;
+        }
+
+        const llama_pos p0 = llama_memory_seq_pos_min(mem, 0);
+        const llama_pos p1 = llama_memory_seq_pos_max(mem, 0);
+
+        // the sink stays at the start and the window is shifted down, so the positions remain dense and bounded
+        if (p0 != 0 || p1 >= (llama_pos) n_ctx || p1 + 1 < n_sink) {
+            fprintf(stderr, "%s: unexpected positions [%d, %d] after %d tokens\n", __func__, p0, p1, n_tokens);
+            ok = false;
+            break;
+        }
+
+        // the number of tokens evicted before this batch
+        const int32_t n_evict = n_kept + (int32_t) tokens.size() - (p1 + 1);
+
+        if (n_evict > 0) {
+            llama_memory_seq_rm (mem_ref, 0, n_sink,           n_sink + n_evict);
+            llama_memory_seq_add(mem_ref, 0, n_sink + n_evict, -1, -n_evict);
+        }
+
+        if (llama_decode(ctx_ref, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
+            fprintf(stderr, "%s: llama_decode of the reference failed after %d tokens\n", __func__, n_tokens);
+            ok = false;
+            break;
+        }
+
+        const float * logits     = llama_get_logits_ith(ctx,     -1);
+        const float * logits_ref = llama_get_logits_ith(ctx_ref, -1);
+
+        for (int32_t i = 0; i < n_vocab; ++i) {
+            if (std::fabs(logits[i] - logits_ref[i]) > 1e-4f*std::max(1.0f, std::fabs(logits_ref[i]))) {
+                fprintf(stderr, "%s: logits differ from the reference after %d tokens: %f != %f\n", __func__, n_tokens, logits[i], logits_ref[i]);
+                ok = false;
+                break;
+            }
+        }
+
+        n_kept     = p1 + 1;
+        n_evicted += n_evict;
+    }
+
+    printf("%s: %d tokens, %d evicted, %d kept\n", __func__, n_tokens, n_evicted, n_kept);
+
+    // the cache is full now - a batch that is rejected, or that has explicit positions, must not evict
+    if (ok) {
+        const llama_pos p1 = llama_memory_seq_pos_max(mem, 0);
+
+        std::vector<llama_token>  tokens(4, 1);
+        std::vector<int32_t>      n_seq_id(tokens.size(), 1);
+        std::vector<llama_seq_id> seq_ids (tokens.size(), 1);
+        std::vector<llama_pos>    pos     (tokens.size());
+
+        std::vector<llama_seq_id *> seq_id_ptrs;
+        for (auto & s : seq_ids) {
+            seq_id_ptrs.push_back(&s);
+        }
+
+        for (size_t i = 0; i < pos.size(); ++i) {
+            pos[i] = p1 + 1 + i;
+        }
+
+        // a sequence id >= n_seq_max
+        llama_batch batch_seq = llama_batch_get_one(tokens.data(), tokens.size());
+        batch_seq.n_seq_id = n_seq_id.data();
+        batch_seq.seq_id   = seq_id_ptrs.data();
+
+        if (llama_decode(ctx, batch_seq) != -1) {
+            fprintf(stderr, "%s: a batch with an invalid sequence id was not rejected\n", __func__);
+            ok = false;
+        }
+
+        // an invalid token
+        tokens[1] = n_vocab;
+
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != -1) {
+            fprintf(stderr, "%s: a batch with an invalid token was not rejected\n", __func__);
+            ok = false;
+        }
+
+        tokens[1] = 1;
+
+        if (llama_memory_seq_pos_min(mem, 0) != 0 || llama_memory_seq_pos_max(mem, 0) != p1) {
+            fprintf(stderr, "%s: a rejected batch changed the positions to [%d, %d], expected [0, %d]\n", __func__,
+                    llama_memory_seq_pos_min(mem, 0), llama_memory_seq_pos_max(mem, 0), p1);
+            ok = false;
+        }
+
+        // explicit positions that continue the sequence - there is no room for them, but the cache is not shifted
+        llama_batch batch_pos = llama_batch_get_one(tokens.data(), tokens.size());
+        batch_pos.pos = pos.data();
+
+        llama_decode(ctx, batch_pos);
+
+        if (llama_memory_seq_pos_min(mem, 0) != 0 || llama_memory_seq_pos_max(mem, 0) < p1) {
+            fprintf(stderr, "%s: a batch with explicit positions shifted the positions to [%d, %d]\n", __func__,
+                    llama_memory_seq_pos_min(mem, 0), llama_memory_seq_pos_max(mem, 0));
+            ok = false;
+        }
+
+        // the eviction still works after that
+        if (llama_memory_seq_pos_max(mem, 0) == p1 && llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
+            fprintf(stderr, "%s: llama_decode failed after the rejected batches\n", __func__);
+            ok = false;
+        }
+    }
+
+    if (ok && n_evicted == 0) {
+        fprintf(stderr, "%s: no tokens were evicted\n", __func__);
+        ok = false;
+    }
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
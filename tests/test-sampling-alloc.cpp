@@ -0,0 +1,189 @@
+#include "llama.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+extern struct llama_sampler * llama_sampler_init_dry_testing(int32_t context_size, float dry_multiplier, float dry_base, int32_t dry_allowed_length, int32_t dry_penalty_last_n, const std::vector<std::vector<llama_token>>& seq_breakers);
+
+// count the heap allocations of the whole process, including the ones in libllama
+static std::atomic<bool>    g_count { false };
+static std::atomic<int64_t> g_n_alloc { 0 };
+
+static void * alloc_impl(size_t size) {
+    if (g_count) {
+        g_n_alloc++;
+    }
+
+    void * ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void * operator new  (size_t size) { return alloc_impl(size); }
+void * operator new[](size_t size) { return alloc_impl(size); }
+
+void operator delete  (void * ptr) noexcept { free(ptr); }
+void operator delete[](void * ptr) noexcept { free(ptr); }
+void operator delete  (void * ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void * ptr, size_t) noexcept { free(ptr); }
+
+// logits where a small set of "hot" tokens dominates, so that the generated tokens come from a bounded set, as with
+// real text - the samplers that track the generated tokens (penalties, DRY) stop growing after the warmup
+static std::vector<std::vector<float>> make_logits(int n_vocab, int n_rows, int n_hot) {
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    std::vector<std::vector<float>> res(n_rows, std::vector<float>(n_vocab));
+
+    for (auto & row : res) {
+        for (auto & logit : row) {
+            logit = dist(rng);
+        }
+        for (int i = 0; i < n_hot; ++i) {
+            row[(i*7919) % n_vocab] += 15.0f + 2.0f*dist(rng);
+        }
+    }
+
+    return res;
+}
+
+static void test_chain(const char * name, llama_sampler * chain, const std::vector<std::vector<float>> & logits, int n_warmup, int n_iter, bool bench) {
+    const int n_vocab = logits[0].size();
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    const auto sample = [&](int it) {
+        const auto & row = logits[it % logits.size()];
+
+        for (int i = 0; i < n_vocab; ++i) {
+            cur[i] = llama_token_data{i, row[i], 0.0f};
+        }
+
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+        llama_sampler_apply(chain, &cur_p);
+
+        assert(cur_p.selected >= 0 && cur_p.selected < (int64_t) cur_p.size);
+
+        llama_sampler_accept(chain, cur_p.data[cur_p.selected].id);
+    };
+
+    for (int it = 0; it < n_warmup; ++it) {
+        sample(it);
+    }
+
+    g_n_alloc = 0;
+    g_count   = true;
+
+    const auto t_start = std::chrono::steady_clock::now();
+
+    for (int it = 0; it < n_iter; ++it) {
+        sample(n_warmup + it);
+    }
+
+    const auto t_end = std::chrono::steady_clock::now();
+
+    g_count = false;
+
+    if (bench) {
+        printf("%-12s: %8.2f us per token, %lld allocations in %d tokens\n", name,
+                std::chrono::duration<double, std::micro>(t_end - t_start).count() / n_iter, (long long) g_n_alloc.load(), n_iter);
+    } else {
+        printf("%-12s: %lld allocations in %d tokens\n", name, (long long) g_n_alloc.load(), n_iter);
+    }
+
+    if (g_n_alloc != 0) {
+        fprintf(stderr, "%s: error: the '%s' chain allocates in the steady state\n", __func__, name);
+        exit(1);
+    }
+
+    llama_sampler_free(chain);
+}
+
+static llama_sampler * make_chain(const std::vector<llama_sampler *> & samplers) {
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    for (auto * smpl : samplers) {
+        llama_sampler_chain_add(chain, smpl);
+    }
+
+    return chain;
+}
+
+// usage: test-sampling-alloc [--bench]
+// --bench uses a realistic vocab size and many more tokens, and prints the time per token
+int main(int argc, char ** argv) {
+    const bool bench = argc > 1 && std::string(argv[1]) == "--bench";
+
+    // the warmup must fill the token history of the penalties and DRY samplers
+    const int n_vocab  = bench ? 32000 : 2048;
+    const int n_warmup = bench ?  2000 :  300;
+    const int n_iter   = bench ?  1000 :   32;
+
+    const auto logits = make_logits(n_vocab, 64, bench ? 100 : 20);
+
+    const std::vector<std::vector<llama_token>> breakers = { { 7919 }, { 2*7919 % n_vocab, 3*7919 % n_vocab } };
+
+    // similar to the default chain of common_sampler
+    test_chain("default", make_chain({
+            llama_sampler_init_penalties(64, 1.1f, 0.1f, 0.1f),
+            llama_sampler_init_dry_testing(4096, 0.8f, 1.75f, 2, 256, breakers),
+            llama_sampler_init_top_k(40),
+            llama_sampler_init_typical(1.0f, 1),
+            llama_sampler_init_top_p(0.95f, 1),
+            llama_sampler_init_min_p(0.05f, 1),
+            llama_sampler_init_xtc(0.5f, 0.1f, 1, 42),
+            llama_sampler_init_temp_ext(0.8f, 0.0f, 1.0f),
+            llama_sampler_init_dist(42),
+        }), logits, n_warmup, n_iter, bench);
+
+    // no top-k, so that the sorting samplers see the whole vocab
+    test_chain("full vocab", make_chain({
+            llama_sampler_init_penalties(64, 1.1f, 0.0f, 0.0f),
+            llama_sampler_init_top_p(0.9f, 1),
+            llama_sampler_init_min_p(0.05f, 1),
+            llama_sampler_init_temp(0.8f),
+            llama_sampler_init_dist(42),
+        }), logits, n_warmup, n_iter, bench);
+
+    test_chain("top-k 200", make_chain({
+            llama_sampler_init_top_k(200),
+            llama_sampler_init_typical(0.9f, 1),
+            llama_sampler_init_temp_ext(0.8f, 0.5f, 1.0f),
+            llama_sampler_init_dist(42),
+        }), logits, n_warmup, n_iter, bench);
+
+    test_chain("top-n-sigma", make_chain({
+            llama_sampler_init_top_n_sigma(1.0f),
+            llama_sampler_init_dist(42),
+        }), logits, n_warmup, n_iter, bench);
+
+    test_chain("mirostat", make_chain({
+            llama_sampler_init_temp(0.8f),
+            llama_sampler_init_mirostat(n_vocab, 42, 5.0f, 0.1f, 100),
+        }), logits, n_warmup, n_iter, bench);
+
+    test_chain("mirostat v2", make_chain({
+            llama_sampler_init_temp(0.8f),
+            llama_sampler_init_mirostat_v2(42, 5.0f, 0.1f),
+        }), logits, n_warmup, n_iter, bench);
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+// check that common_sampler_sample_batch samples the same tokens as common_sampler_sample called on each sequence in
+// turn, with and without a thread pool, for samplers with different chains, seeds and grammars. also check that
+// preparing the grammar in the background with common_sampler_prepare does not change the sampled tokens
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static std::vector<common_params_sampling> make_params() {
+    std::vector<common_params_sampling> res;
+
+    common_params_sampling params;
+
+    // greedy
+    params.temp = 0.0f;
+    res.push_back(params);
+
+    // the default chain with two different seeds
+    params.temp = 0.8f;
+    params.seed = 1;
+    res.push_back(params);
+
+    params.seed = 2;
+    res.push_back(params);
+
+    // a wide distribution
+    params.temp  = 1.5f;
+    params.top_k = 0;
+    params.top_p = 1.0f;
+    params.min_p = 0.0f;
+    params.seed  = 3;
+    res.push_back(params);
+
+    // a grammar, which resamples when the sampled token does not fit
+    params = common_params_sampling();
+    params.seed    = 4;
+    params.grammar = "root ::= [a-z ]+";
+    res.push_back(params);
+
+    // a lazy grammar, which is prepared only once it has been triggered
+    params = common_params_sampling();
+    params.seed         = 5;
+    params.grammar      = "root ::= [a-z ]+";
+    params.grammar_lazy = true;
+    params.grammar_triggers.push_back({ COMMON_GRAMMAR_TRIGGER_TYPE_WORD, "e", LLAMA_TOKEN_NULL });
+    res.push_back(params);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+
+    llama_model * model = llama_model_load_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, model_path);
+        return EXIT_FAILURE;
+    }
+
+    const auto params = make_params();
+
+    const int32_t n_seq   = params.size();
+    const int32_t n_steps = 16;
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_batch   = 64;
+    cparams.n_ubatch  = 64;
+    cparams.n_seq_max = n_seq;
+    cparams.n_threads = 2;
+    cparams.n_threads_batch = 2;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    // the same samplers four times: sampled one by one, as a batch on a pool, as a batch on the calling thread, and
+    // one by one after preparing the grammar during the decode
+    std::vector<common_sampler *> smpls_seq;
+    std::vector<common_sampler *> smpls_pool;
+    std::vector<common_sampler *> smpls_single;
+    std::vector<common_sampler *> smpls_prep;
+
+    for (const auto & p : params) {
+        smpls_seq   .push_back(common_sampler_init(model, p));
+        smpls_pool  .push_back(common_sampler_init(model, p));
+        smpls_single.push_back(common_sampler_init(model, p));
+        smpls_prep  .push_back(common_sampler_init(model, p));
+    }
+
+    common_sampler_pool * pool = common_sampler_pool_init(3);
+
+    std::mt19937 rng(42);
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    // a random prompt of a different length for each sequence
+    common_batch_clear(batch);
+    for (int32_t s = 0; s < n_seq; ++s) {
+        const int32_t n_prompt = 4 + s;
+        for (int32_t i = 0; i < n_prompt; ++i) {
+            common_batch_add(batch, rng() % n_vocab, i, { s }, i == n_prompt - 1);
+        }
+    }
+
+    std::vector<llama_pos> n_past(n_seq);
+    for (int32_t s = 0; s < n_seq; ++s) {
+        n_past[s] = 4 + s;
+    }
+
+    bool ok = true;
+
+    for (int32_t step = 0; ok && step < n_steps; ++step) {
+        if (llama_decode(ctx, batch) != 0) {
+            fprintf(stderr, "%s: llama_decode failed at step %d\n", __func__, step);
+            ok = false;
+            break;
+        }
+
+        // the output index of each sequence in the batch
+        std::vector<int> idxs;
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                idxs.push_back(i);
+            }
+        }
+
+        std::vector<llama_token> tokens_seq(n_seq);
+        for (int32_t s = 0; s < n_seq; ++s) {
+            tokens_seq[s] = common_sampler_sample(smpls_seq[s], ctx, idxs[s]);
+        }
+
+        const auto tokens_pool   = common_sampler_sample_batch(smpls_pool,   ctx, idxs, pool);
+        const auto tokens_single = common_sampler_sample_batch(smpls_single, ctx, idxs, nullptr);
+
+        std::vector<llama_token> tokens_prep(n_seq);
+        for (int32_t s = 0; s < n_seq; ++s) {
+            tokens_prep[s] = common_sampler_sample(smpls_prep[s], ctx, idxs[s]);
+        }
+
+        for (int32_t s = 0; s < n_seq; ++s) {
+            if (tokens_pool[s] != tokens_seq[s] || tokens_single[s] != tokens_seq[s] || tokens_prep[s] != tokens_seq[s]) {
+                fprintf(stderr, "%s: step %d, seq %d: batch sampled %d (pool) and %d (single), prepared sampled %d, sequential sampled %d\n",
+                        __func__, step, s, tokens_pool[s], tokens_single[s], tokens_prep[s], tokens_seq[s]);
+                ok = false;
+            }
+        }
+
+        common_batch_clear(batch);
+        for (int32_t s = 0; s < n_seq; ++s) {
+            common_sampler_accept(smpls_seq[s],    tokens_seq[s], true);
+            common_sampler_accept(smpls_pool[s],   tokens_seq[s], true);
+            common_sampler_accept(smpls_single[s], tokens_seq[s], true);
+            common_sampler_accept(smpls_prep[s],   tokens_seq[s], true);
+
+            // runs on the pool while the next batch is decoded
+            common_sampler_prepare(smpls_prep[s], ctx, pool);
+
+            common_batch_add(batch, tokens_seq[s], n_past[s]++, { s }, true);
+        }
+    }
+
+    printf("%s: %d sequences, %d steps: %s\n", __func__, n_seq, n_steps, ok ? "ok" : "failed");
+
+    common_sampler_pool_free(pool);
+
+    for (int32_t s = 0; s < n_seq; ++s) {
+        common_sampler_free(smpls_seq[s]);
+        common_sampler_free(smpls_pool[s]);
+        common_sampler_free(smpls_single[s]);
+        common_sampler_free(smpls_prep[s]);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
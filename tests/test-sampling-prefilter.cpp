@@ -0,0 +1,165 @@
+// check that selecting the candidates with the prefilter of common_sampler does not change the result of the sampling
+// chain: the candidates, their probabilities and the sampled token must be the same as with the whole vocab
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+enum logits_type {
+    LOGITS_NORMAL, // normal distribution
+    LOGITS_PEAKED, // a few tokens dominate
+    LOGITS_TIED,   // a few distinct values, so that many logits are equal
+};
+
+static std::vector<float> make_logits(std::mt19937 & rng, int n_vocab, logits_type type) {
+    std::normal_distribution<float> dist(0.0f, 2.0f);
+
+    std::vector<float> res(n_vocab);
+
+    for (auto & logit : res) {
+        logit = dist(rng);
+    }
+
+    switch (type) {
+        case LOGITS_NORMAL:
+            break;
+        case LOGITS_PEAKED:
+            for (int i = 0; i < 3; ++i) {
+                res[rng() % n_vocab] += 20.0f;
+            }
+            break;
+        case LOGITS_TIED:
+            for (auto & logit : res) {
+                logit = std::round(logit);
+            }
+            break;
+    }
+
+    return res;
+}
+
+static bool test(const char * name, llama_model * model, const common_params_sampling & params, logits_type type) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    common_sampler * gsmpl_full = common_sampler_init(model, params);
+    common_sampler * gsmpl_pre  = common_sampler_init(model, params);
+
+    std::mt19937 rng(1234);
+
+    bool ok = true;
+
+    size_t n_cur = 0;
+
+    for (int it = 0; ok && it < 16; ++it) {
+        const auto logits = make_logits(rng, n_vocab, type);
+
+        const llama_token_data_array * full = common_sampler_apply_chain_testing(gsmpl_full, logits.data(), n_vocab, false);
+        const llama_token_data_array * pre  = common_sampler_apply_chain_testing(gsmpl_pre,  logits.data(), n_vocab, true);
+
+        n_cur += full->size;
+
+        if (full->size != pre->size || full->selected != pre->selected) {
+            fprintf(stderr, "%s: %s: %zu candidates with the prefilter, selected %lld, expected %zu, selected %lld\n",
+                    __func__, name, pre->size, (long long) pre->selected, full->size, (long long) full->selected);
+            ok = false;
+            break;
+        }
+
+        for (size_t i = 0; i < full->size; ++i) {
+            const auto & a = full->data[i];
+            const auto & b = pre ->data[i];
+
+            if (a.id != b.id || std::fabs(a.p - b.p) > 1e-6f || std::fabs(a.logit - b.logit) > 1e-6f) {
+                fprintf(stderr, "%s: %s: candidate %zu with the prefilter is (%d, %f, %f), expected (%d, %f, %f)\n",
+                        __func__, name, i, b.id, b.logit, b.p, a.id, a.logit, a.p);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    printf("%-28s: %s, %.1f candidates on average\n", name, ok ? "ok" : "failed", n_cur / 16.0);
+
+    common_sampler_free(gsmpl_full);
+    common_sampler_free(gsmpl_pre);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, model_path);
+        return EXIT_FAILURE;
+    }
+
+    bool ok = true;
+
+    for (const logits_type type : { LOGITS_NORMAL, LOGITS_PEAKED, LOGITS_TIED }) {
+        const std::string suffix =
+            type == LOGITS_NORMAL ? " (normal)" :
+            type == LOGITS_PEAKED ? " (peaked)" : " (tied)";
+
+        common_params_sampling params;
+        params.seed = 42;
+
+        // top-k first
+        params.samplers = { COMMON_SAMPLER_TYPE_TOP_K, COMMON_SAMPLER_TYPE_TEMPERATURE };
+        params.top_k    = 40;
+        params.temp     = 0.8f;
+        ok = test(("top-k" + suffix).c_str(), model, params, type) && ok;
+
+        // top-k of 1, where the ties on the largest logit matter most
+        params.top_k = 1;
+        ok = test(("top-k 1" + suffix).c_str(), model, params, type) && ok;
+
+        // min-p first, with min_keep larger than the tokens above the threshold when the logits are peaked
+        params = common_params_sampling();
+        params.seed     = 42;
+        params.samplers = { COMMON_SAMPLER_TYPE_MIN_P, COMMON_SAMPLER_TYPE_TEMPERATURE };
+        params.min_p    = 0.5f;
+        params.min_keep = 10;
+        ok = test(("min-p, min_keep" + suffix).c_str(), model, params, type) && ok;
+
+        // temperature before min-p - the threshold depends on the temperature
+        for (const float temp : { 0.3f, 1.7f }) {
+            params.samplers = { COMMON_SAMPLER_TYPE_TEMPERATURE, COMMON_SAMPLER_TYPE_MIN_P };
+            params.temp     = temp;
+            params.min_p    = 0.1f;
+            params.min_keep = 0;
+            ok = test((string_format("temp %.1f, min-p", temp) + suffix).c_str(), model, params, type) && ok;
+        }
+
+        // greedy - the samplers after the temperature only see the first largest logit
+        params = common_params_sampling();
+        params.seed     = 42;
+        params.samplers = { COMMON_SAMPLER_TYPE_TEMPERATURE, COMMON_SAMPLER_TYPE_TOP_P };
+        params.temp     = 0.0f;
+        ok = test(("greedy" + suffix).c_str(), model, params, type) && ok;
+
+        // the default chain - the penalties and DRY are off by default, so its top-k is the prefilter
+        params = common_params_sampling();
+        params.seed = 42;
+        ok = test(("default" + suffix).c_str(), model, params, type) && ok;
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
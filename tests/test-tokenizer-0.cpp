@@ -3,6 +3,7 @@
 #include "console.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <map>
 #include <vector>
@@ -123,6 +124,18 @@ static llama_tests read_tests(const std::string & fname_inp, const std::string &
     return tests;
 }
 
+// tokenize a long text in parallel chunks on n_threads threads
+static std::vector<llama_token> tokenize_mt(const llama_context * ctx, const std::string & text, bool add_special, int32_t n_threads) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    std::vector<llama_token> result(text.size() + 2);
+
+    const int32_t n_tokens = llama_tokenize_ext(vocab, text.data(), text.size(), result.data(), result.size(), add_special, false, n_threads);
+    result.resize(std::max(0, n_tokens));
+
+    return result;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         fprintf(stderr, "Usage: %s vocab-file [text-file]\n", argv[0]);
@@ -252,6 +265,33 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // a long text is tokenized in chunks on several threads - it must give the same tokens as a single thread
+    if (!k_tests.empty()) {
+        std::string text;
+        while (text.size() < 256*1024) {
+            for (const auto & test_kv : k_tests) {
+                text += test_kv.first;
+                text += " and ";
+            }
+        }
+
+        const auto res_serial   = common_tokenize(ctx, text, add_special, false);
+        const auto res_parallel = tokenize_mt(ctx, text, add_special, 4);
+
+        printf("\n");
+        printf("long text: %zu bytes, %zu tokens\n", text.size(), res_serial.size());
+
+        if (res_parallel != res_serial) {
+            size_t i = 0;
+            while (i < res_serial.size() && i < res_parallel.size() && res_serial[i] == res_parallel[i]) {
+                i++;
+            }
+            fprintf(stderr, "%s : failed test:    parallel tokenization of a long text differs at token %zu\n", __func__, i);
+
+            success = false;
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
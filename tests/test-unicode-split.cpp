@@ -0,0 +1,185 @@
+// compare the custom splitters of unicode_regex_split with the std::regex fallback
+#include "../src/unicode.h"
+#include "../src/llama-vocab.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// the distinct pre-tokenizer regexes of the BPE vocabs, with the first pre-tokenizer type that uses them
+static std::vector<std::pair<int, std::vector<std::string>>> get_pre_regexes() {
+    std::vector<std::pair<int, std::vector<std::string>>> res;
+
+    // note: update the last type when adding a pre-tokenizer
+    for (int type = LLAMA_VOCAB_PRE_TYPE_DEFAULT; type <= LLAMA_VOCAB_PRE_TYPE_HUNYUAN_DENSE; ++type) {
+        // kimi-k2 has only a custom splitter, std::regex does not support \p{Han}
+        // superbpe has only the std::regex one, as its regex uses a lookahead
+        if (type == LLAMA_VOCAB_PRE_TYPE_KIMI_K2 || type == LLAMA_VOCAB_PRE_TYPE_SUPERBPE) {
+            continue;
+        }
+
+        const auto regexes = llama_vocab_pre_type_regexes((llama_vocab_pre_type) type);
+
+        const bool is_new = std::none_of(res.begin(), res.end(), [&](const auto & pre) { return pre.second == regexes; });
+        if (is_new) {
+            res.emplace_back(type, regexes);
+        }
+    }
+
+    return res;
+}
+
+// the texts of the tokenizer tests
+static std::vector<std::string> load_corpus(const std::string & dir) {
+    std::vector<std::string> res;
+
+    for (const auto & entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() != ".inp") {
+            continue;
+        }
+
+        std::ifstream fin(entry.path(), std::ios::binary);
+        std::stringstream ss;
+        ss << fin.rdbuf();
+
+        const std::string text = ss.str();
+        const std::string sep  = "\n__ggml_vocab_test__\n";
+
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t next = text.find(sep, pos);
+            if (next == std::string::npos) {
+                next = text.size();
+            }
+            res.push_back(text.substr(pos, next - pos));
+            pos = next + sep.size();
+        }
+    }
+
+    return res;
+}
+
+// random strings of codepoints that sit at the boundaries of the regexes
+static std::vector<std::string> make_fuzz(int n_texts, int max_len) {
+    static const std::vector<std::string> k_alphabet = {
+        "a", "z", "A", "Z", "x", "Q", "s", "t", "d", "m", "l", "L", "r", "e", "v", "S", "T", "D", "M", "R", "E", "V",
+        "0", "5", "9", "'", "\"", "!", ".", ",", "?", "/", "\\", "$", "+", "<", "=", ">", "^", "`", "|", "~", "(", ")",
+        "[", "]", "{", "}", "-", "_", "@", "#", "%", "&", "*", ":", ";",
+        " ", " ", " ", "\t", "\r", "\n", "\n", "\x0B", "\x0C", "\x1C", "\x7F",
+        "\xC2\xA0",     // no-break space
+        "\xE3\x80\x80", // ideographic space
+        "\xE3\x80\x82", // ideographic full stop
+        "\xE2\x80\xA6", // ellipsis
+        "é", "É", "ß", "ǅ", "ω", "Ω", "ж", "Ж", "µ", "ﬀ", "Ａ", "ａ", "！",
+        "中", "文", "龥", "ぁ", "カ", "한", "ࠀ",
+        "\xCC\x81",     // combining acute accent
+        "\xE0\xA5\xA4", // devanagari danda
+        "،", "۔", "ع", "ب",
+        "٣", "१", "Ⅻ", "²",
+        "😀", "€", "©", "°",
+        "\xF0\x90\x90\x80", // deseret capital letter long i
+        "\xEF\xBF\xBF",     // noncharacter
+    };
+
+    std::mt19937 rng(42);
+
+    std::vector<std::string> res;
+    for (int i = 0; i < n_texts; ++i) {
+        const int len = rng() % max_len;
+
+        std::string text;
+        for (int k = 0; k < len; ++k) {
+            // repeat the same codepoint sometimes, to build longer runs
+            const auto & cpt = k_alphabet[rng() % k_alphabet.size()];
+            const int n_rep = rng() % 4 == 0 ? 1 + rng() % 5 : 1;
+            for (int r = 0; r < n_rep; ++r) {
+                text += cpt;
+            }
+        }
+        res.push_back(text);
+    }
+
+    return res;
+}
+
+static std::string escape(const std::string & str) {
+    std::string res;
+    for (unsigned char c : str) {
+        if (c < 0x20 || c == 0x7F) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\x%02X", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <models-dir>\n", argv[0]);
+        return 1;
+    }
+
+    // the .inp files of the vocabs have the same texts
+    std::vector<std::string> texts = load_corpus(argv[1]);
+    std::sort(texts.begin(), texts.end());
+    texts.erase(std::unique(texts.begin(), texts.end()), texts.end());
+
+    const size_t n_corpus = texts.size();
+
+    const auto fuzz = make_fuzz(1000, 48);
+    texts.insert(texts.end(), fuzz.begin(), fuzz.end());
+
+    printf("%s: %zu texts from the tokenizer tests, %zu random texts\n", __func__, n_corpus, fuzz.size());
+
+    int n_failed = 0;
+
+    auto pre_regexes = get_pre_regexes();
+
+    // bracket expressions with overlapping and nested ranges
+    pre_regexes.emplace_back(-1, std::vector<std::string> { "[a-zc-d]+", " ?[c-dxa-z0-9]+", "[^a-fb-c\\s]+" });
+
+    for (const auto & pre : pre_regexes) {
+        const std::string name = pre.first >= 0 ? "pre type " + std::to_string(pre.first) : "ranges";
+
+        int n_mismatch = 0;
+
+        for (const auto & text : texts) {
+            const auto words_custom = unicode_regex_split(text, pre.second, true);
+            const auto words_regex  = unicode_regex_split(text, pre.second, false);
+
+            if (words_custom == words_regex) {
+                continue;
+            }
+
+            if (n_mismatch++ == 0) {
+                fprintf(stderr, "%s: %s: mismatch for '%s'\n", __func__, name.c_str(), escape(text).c_str());
+                for (size_t i = 0; i < std::max(words_custom.size(), words_regex.size()); ++i) {
+                    fprintf(stderr, "  %3zu: custom '%s' regex '%s'\n", i,
+                            i < words_custom.size() ? escape(words_custom[i]).c_str() : "-",
+                            i < words_regex.size()  ? escape(words_regex[i]).c_str()  : "-");
+                }
+            }
+        }
+
+        printf("%s: %-12s: %s", __func__, name.c_str(), n_mismatch == 0 ? "OK\n" : "");
+        if (n_mismatch > 0) {
+            printf("%d mismatches\n", n_mismatch);
+            n_failed++;
+        }
+    }
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%s: %d pre-tokenizers differ from std::regex\n", __func__, n_failed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -24,8 +24,10 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
@@ -1416,6 +1418,18 @@ struct server_slot {
 
     server_tokens cache_tokens;
 
+    // a swapped out kv cache that is being read back from disk in the background (see --slot-swap-path)
+    // the slot waits in SLOT_STATE_STARTED until the data is ready, while the other slots keep decoding
+    struct swap_in_data {
+        std::string          filepath;
+        llama_tokens         tokens;
+        std::vector<uint8_t> state;
+        size_t               n_common = 0;
+        int64_t              t_start  = 0;
+    };
+
+    std::future<swap_in_data> swap_in;
+
     std::vector<completion_token_output> generated_token_probs;
 
     std::vector<swa_checkpoint> swa_checkpoints;
@@ -2067,6 +2081,32 @@ struct server_context {
 
     server_metrics metrics;
 
+    // threads for sampling the slots of a decoded batch in parallel and for preparing their grammars
+    common_sampler_pool * smpl_pool = nullptr;
+
+    // slot saves that are still being written to disk in the background, by file path
+    std::unordered_map<std::string, std::future<void>> slot_saves;
+
+    // kv caches of idle slots that were swapped out to disk (see --slot-swap-path), oldest first
+    struct slot_swap {
+        std::string  filepath;
+        llama_tokens tokens;
+        size_t       n_bytes;
+
+        std::vector<common_adapter_lora_info> lora;
+
+        // the background write of the file
+        std::future<void> save;
+    };
+
+    std::vector<slot_swap> slot_swaps;
+
+    size_t slot_swaps_size = 0;
+    int    slot_swaps_id   = 0;
+
+    // a random tag in the names of the swap files, so that servers sharing the directory do not overwrite each other
+    std::string slot_swaps_tag = string_format("%08x", std::random_device{}());
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -2074,6 +2114,20 @@ struct server_context {
     oaicompat_parser_options  oai_parser_opt;
 
     ~server_context() {
+        wait_slot_saves();
+
+        for (auto & sw : slot_swaps) {
+            sw.save.wait();
+            std::remove(sw.filepath.c_str());
+        }
+
+        // the swap ins that are still in flight remove their files when done
+        for (server_slot & slot : slots) {
+            if (slot.swap_in.valid()) {
+                slot.swap_in.wait();
+            }
+        }
+
         mtmd_free(mctx);
 
         // Clear any sampling context
@@ -2090,6 +2144,8 @@ struct server_context {
             llama_batch_free(slot.batch_spec);
         }
 
+        common_sampler_pool_free(smpl_pool);
+
         llama_batch_free(batch);
     }
 
@@ -2256,6 +2312,9 @@ struct server_context {
             slots.push_back(std::move(slot));
         }
 
+        // at least one worker, for preparing the grammars in the background
+        smpl_pool = common_sampler_pool_init(std::max(2, std::min(params_base.n_parallel, params_base.cpuparams.n_threads)));
+
         default_generation_settings_for_props = slots[0].to_json();
 
         // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
@@ -2289,6 +2348,205 @@ struct server_context {
         return nullptr;
     }
 
+    // drop the background slot saves that have finished
+    void prune_slot_saves() {
+        for (auto it = slot_saves.begin(); it != slot_saves.end(); ) {
+            if (it->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                it = slot_saves.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // wait for the background save to the given file, if any
+    void wait_slot_save(const std::string & filepath) {
+        auto it = slot_saves.find(filepath);
+        if (it != slot_saves.end()) {
+            it->second.wait();
+            slot_saves.erase(it);
+        }
+    }
+
+    void wait_slot_saves() {
+        for (auto & [filepath, f] : slot_saves) {
+            f.wait();
+        }
+
+        slot_saves.clear();
+    }
+
+    // called before the slot starts processing a new prompt:
+    // - if the prompt would discard most of the cached tokens of the slot, swap the cache out to a file first
+    // - if a previously swapped out cache shares a longer prefix with the prompt than the current one, start
+    //   reading it back in the background; it is restored by swap_in_slot_cache() once the data is ready
+    void swap_slot_cache(server_slot & slot) {
+        if (params_base.slot_swap_path.empty() || mctx) {
+            return;
+        }
+
+        // a swap in of a previous task that was cancelled before it completed
+        if (slot.swap_in.valid()) {
+            slot.swap_in.wait();
+            slot.swap_in = {};
+        }
+
+        const llama_tokens & prompt = slot.prompt_tokens.get_text_tokens();
+
+        const size_t n_keep = slot.cache_tokens.get_common_prefix(slot.prompt_tokens);
+
+        size_t n_best = n_keep;
+        int    i_best = -1;
+
+        if (slot.params.cache_prompt) {
+            for (size_t i = 0; i < slot_swaps.size(); ++i) {
+                if (!are_lora_equal(slot_swaps[i].lora, slot.lora)) {
+                    continue;
+                }
+
+                const llama_tokens & tokens = slot_swaps[i].tokens;
+
+                size_t n = 0;
+                while (n < tokens.size() && n < prompt.size() && tokens[n] == prompt[n]) {
+                    n++;
+                }
+
+                if (n > n_best) {
+                    n_best = n;
+                    i_best = i;
+                }
+            }
+        }
+
+        const size_t n_max = (size_t) params_base.slot_swap_size*1024*1024;
+
+        // swap out - only the caches that fit in the budget; a task that does not cache its prompt would discard the
+        // cache anyway, so nothing is kept for it
+        size_t n_state = 0;
+
+        if (slot.params.cache_prompt && !slot.cache_tokens.empty() && (n_keep < slot.cache_tokens.size()/2 || i_best >= 0)) {
+            n_state = llama_state_seq_get_size(ctx, slot.id);
+
+            if (n_state > n_max) {
+                SLT_DBG(slot, "not swapping out %zu cached tokens, size = %.3f MiB does not fit in the budget\n",
+                        slot.cache_tokens.size(), (float) n_state / 1024 / 1024);
+                n_state = 0;
+            }
+        }
+
+        if (n_state > 0) {
+            const int64_t t_start = ggml_time_us();
+
+            slot_swap sw;
+            sw.filepath = params_base.slot_swap_path + string_format("slot-swap-%s-%d.bin", slot_swaps_tag.c_str(), slot_swaps_id++);
+            sw.tokens   = slot.cache_tokens.get_text_tokens(); // copy
+            sw.lora     = slot.lora;
+
+            std::vector<uint8_t> state(n_state);
+            state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), slot.id));
+
+            sw.n_bytes = state.size();
+
+            SLT_INF(slot, "swapping out %zu cached tokens to %s, size = %.3f MiB, t = %.3f ms\n", sw.tokens.size(),
+                    sw.filepath.c_str(), (float) sw.n_bytes / 1024 / 1024, (ggml_time_us() - t_start) / 1000.0);
+
+            sw.save = std::async(std::launch::async,
+                [filepath = sw.filepath, tokens = sw.tokens, state = std::move(state)]() {
+                    if (llama_state_seq_save_file_data(filepath.c_str(), state.data(), state.size(), tokens.data(), tokens.size()) == 0) {
+                        SRV_WRN("failed to write %s\n", filepath.c_str());
+                    }
+                });
+
+            slot_swaps_size += sw.n_bytes;
+            slot_swaps.push_back(std::move(sw));
+        }
+
+        // swap in
+        if (i_best >= 0) {
+            slot_swap sw = std::move(slot_swaps[i_best]);
+
+            slot_swaps.erase(slot_swaps.begin() + i_best);
+            slot_swaps_size -= sw.n_bytes;
+
+            SLT_INF(slot, "swapping in %zu cached tokens from %s, n_common = %zu\n", sw.tokens.size(), sw.filepath.c_str(), n_best);
+
+            // the cache of the slot is replaced by the swapped in one
+            slot.cache_tokens.clear();
+            llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+
+            slot.swap_in = std::async(std::launch::async,
+                [sw = std::move(sw), n_best, t_start = ggml_time_us()]() mutable {
+                    server_slot::swap_in_data data;
+                    data.filepath = sw.filepath;
+                    data.n_common = n_best;
+                    data.t_start  = t_start;
+
+                    // the file may still be being written
+                    sw.save.wait();
+
+                    data.tokens.resize(sw.tokens.size());
+                    data.state.resize(sw.n_bytes);
+
+                    size_t token_count = 0;
+
+                    const size_t nread = llama_state_seq_load_file_data(sw.filepath.c_str(), data.state.data(), data.state.size(),
+                            data.tokens.data(), data.tokens.size(), &token_count);
+
+                    std::remove(sw.filepath.c_str());
+
+                    data.tokens.resize(nread == 0 ? 0 : token_count);
+                    data.state .resize(nread);
+
+                    return data;
+                });
+        }
+
+        // drop the oldest swapped out caches that do not fit in the budget
+        while (!slot_swaps.empty() && slot_swaps_size > n_max) {
+            slot_swap & sw = slot_swaps.front();
+
+            SRV_DBG("dropping swapped out cache %s\n", sw.filepath.c_str());
+
+            // the file may still be being written
+            sw.save.wait();
+
+            std::remove(sw.filepath.c_str());
+
+            slot_swaps_size -= sw.n_bytes;
+            slot_swaps.erase(slot_swaps.begin());
+        }
+    }
+
+    // restore the swapped out cache of the slot once it has been read back in
+    // returns false if the data is not ready yet
+    bool swap_in_slot_cache(server_slot & slot) {
+        if (!slot.swap_in.valid()) {
+            return true;
+        }
+
+        if (slot.swap_in.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+
+        const server_slot::swap_in_data data = slot.swap_in.get();
+
+        if (data.state.empty() || llama_state_seq_set_data(ctx, data.state.data(), data.state.size(), slot.id) == 0) {
+            SLT_WRN(slot, "failed to swap in %s\n", data.filepath.c_str());
+
+            llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+
+            return true;
+        }
+
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert(data.tokens);
+
+        SLT_INF(slot, "swapped in %zu cached tokens from %s, n_common = %zu, t = %.3f ms\n", data.tokens.size(),
+                data.filepath.c_str(), data.n_common, (ggml_time_us() - data.t_start) / 1000.0);
+
+        return true;
+    }
+
     server_slot * get_available_slot(const server_task & task) {
         server_slot * ret = nullptr;
 
@@ -2370,6 +2628,11 @@ struct server_context {
             send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
             return false;
         }
+
+        if (slot.task_type == SERVER_TASK_TYPE_COMPLETION || slot.task_type == SERVER_TASK_TYPE_INFILL) {
+            swap_slot_cache(slot);
+        }
+
         SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
 
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
@@ -3019,27 +3282,55 @@ struct server_context {
                         break;
                     }
 
-                    const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
-                    const llama_tokens & tokens = slot->cache_tokens.get_text_tokens();
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, tokens.data(), token_count);
+                    // capture the state of the slot in host memory - the file is written in the background,
+                    // so that the other slots can keep decoding while the data goes to disk
+                    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot->id));
+                    state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), slot->id));
 
-                    const int64_t t_end = ggml_time_us();
-                    const double t_save_ms = (t_end - t_start) / 1000.0;
+                    llama_tokens tokens = slot->cache_tokens.get_text_tokens(); // copy
 
-                    auto res = std::make_unique<server_task_result_slot_save_load>();
-                    res->id       = task.id;
-                    res->id_slot  = id_slot;
-                    res->filename = filename;
-                    res->is_save  = true;
-                    res->n_tokens = token_count;
-                    res->n_bytes  = nwrite;
-                    res->t_ms     = t_save_ms;
-                    queue_results.send(std::move(res));
+                    SLT_DBG(*slot, "captured slot state, size = %.3f MiB, t = %.3f ms\n",
+                            (float) state.size() / 1024 / 1024, (ggml_time_us() - t_start) / 1000.0);
+
+                    prune_slot_saves();
+
+                    // a previous save to the same file that is still running must finish first, otherwise both
+                    // would write the file at the same time
+                    std::future<void> prev;
+                    if (auto it = slot_saves.find(filepath); it != slot_saves.end()) {
+                        prev = std::move(it->second);
+                    }
+
+                    std::future<void> & save = slot_saves[filepath];
+
+                    save = std::async(std::launch::async,
+                        [this, id_task = task.id, id_slot, t_start, prev = std::move(prev),
+                            filename = std::move(filename), filepath = std::move(filepath),
+                            tokens = std::move(tokens), state = std::move(state)]() {
+                        if (prev.valid()) {
+                            prev.wait();
+                        }
+
+                        const size_t nwrite = llama_state_seq_save_file_data(filepath.c_str(), state.data(), state.size(), tokens.data(), tokens.size());
+
+                        const int64_t t_end = ggml_time_us();
+                        const double t_save_ms = (t_end - t_start) / 1000.0;
+
+                        auto res = std::make_unique<server_task_result_slot_save_load>();
+                        res->id       = id_task;
+                        res->id_slot  = id_slot;
+                        res->filename = filename;
+                        res->is_save  = true;
+                        res->n_tokens = tokens.size();
+                        res->n_bytes  = nwrite;
+                        res->t_ms     = t_save_ms;
+                        queue_results.send(std::move(res));
+                    });
                 } break;
             case SERVER_TASK_TYPE_SLOT_RESTORE:
                 {
@@ -3062,6 +3353,9 @@ struct server_context {
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
+                    // the file may still be being written by a save
+                    wait_slot_save(filepath);
+
                     llama_tokens tokens;
                     tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
@@ -3258,6 +3552,11 @@ struct server_context {
 
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
+                        // the swapped out cache of the slot is still being read back in
+                        if (!swap_in_slot_cache(slot)) {
+                            continue;
+                        }
+
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
@@ -3589,7 +3888,20 @@ struct server_context {
         }
 
         if (batch.n_tokens == 0) {
-            SRV_WRN("%s", "no tokens to decode\n");
+            // nothing else to do - wait for the swapped out caches that are being read back in
+            bool swapping_in = false;
+
+            for (server_slot & slot : slots) {
+                if (slot.swap_in.valid()) {
+                    slot.swap_in.wait();
+                    swapping_in = true;
+                }
+            }
+
+            if (!swapping_in) {
+                SRV_WRN("%s", "no tokens to decode\n");
+            }
+
             return;
         }
 
@@ -3665,6 +3977,36 @@ struct server_context {
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
+            // sample the next token of all generating slots in this part of the batch at once
+            std::vector<llama_token> sampled(slots.size(), LLAMA_TOKEN_NULL);
+            {
+                std::vector<common_sampler *> smpls;
+                std::vector<int>              idxs;
+                std::vector<int>              ids;
+
+                for (const auto & slot : slots) {
+                    if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                        continue;
+                    }
+
+                    const bool is_generating =
+                        slot.state == SLOT_STATE_GENERATING ||
+                        (slot.state == SLOT_STATE_DONE_PROMPT && slot.task_type != SERVER_TASK_TYPE_EMBEDDING && slot.task_type != SERVER_TASK_TYPE_RERANK);
+
+                    if (is_generating) {
+                        smpls.push_back(slot.smpl);
+                        idxs.push_back(slot.i_batch - i);
+                        ids.push_back(slot.id);
+                    }
+                }
+
+                const auto tokens = common_sampler_sample_batch(smpls, ctx, idxs, smpl_pool);
+
+                for (size_t k = 0; k < ids.size(); ++k) {
+                    sampled[ids[k]] = tokens[k];
+                }
+            }
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3727,7 +4069,7 @@ struct server_context {
 
                 const int tok_idx = slot.i_batch - i;
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                const llama_token id = sampled[slot.id];
 
                 slot.i_batch = -1;
 
@@ -3762,6 +4104,9 @@ struct server_context {
                     metrics.on_prediction(slot);
                     continue;
                 }
+
+                // overlap the grammar masking for the next token with the next decode
+                common_sampler_prepare(slot.smpl, ctx, smpl_pool);
             }
 
             // do speculative decoding
@@ -3864,6 +4209,10 @@ struct server_context {
                 }
 
                 SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+
+                if (slot.is_processing()) {
+                    common_sampler_prepare(slot.smpl, ctx, smpl_pool);
+                }
             }
         }
 
@@ -4455,7 +4804,7 @@ int main(int argc, char ** argv) {
                 inputs.push_back(process_mtmd_prompt(ctx_server.mctx, prompt.get<std::string>(), files));
             } else {
                 // Everything else, including multimodal completions.
-                inputs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true);
+                inputs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true, ctx_server.params_base.cpuparams_batch.n_threads);
             }
 
             tasks.reserve(inputs.size());
@@ -4624,7 +4973,7 @@ int main(int argc, char ** argv) {
         data["input_extra"] = input_extra; // default to empty array if it's not exist
 
         std::string prompt = json_value(data, "prompt", std::string());
-        std::vector<server_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, false, true);
+        std::vector<server_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, false, true, ctx_server.params_base.cpuparams_batch.n_threads);
         SRV_DBG("creating infill tasks, n_prompts = %d\n", (int) tokenized_prompts.size());
         data["prompt"] = format_infill(
             ctx_server.vocab,
@@ -4732,7 +5081,7 @@ int main(int argc, char ** argv) {
             const bool parse_special = json_value(body, "parse_special", true);
             const bool with_pieces = json_value(body, "with_pieces", false);
 
-            llama_tokens tokens = tokenize_mixed(ctx_server.vocab, body.at("content"), add_special, parse_special);
+            llama_tokens tokens = tokenize_mixed(ctx_server.vocab, body.at("content"), add_special, parse_special, ctx_server.params_base.cpuparams_batch.n_threads);
 
             if (with_pieces) {
                 for (const auto& token : tokens) {
@@ -4813,7 +5162,7 @@ int main(int argc, char ** argv) {
             }
         }
 
-        auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true);
+        auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true, ctx_server.params_base.cpuparams_batch.n_threads);
         for (const auto & tokens : tokenized_prompts) {
             // this check is necessary for models that do not add BOS token to the input
             if (tokens.empty()) {
@@ -4928,7 +5277,7 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        std::vector<server_tokens> tokenized_queries = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, query, /* add_special */ false, true);
+        std::vector<server_tokens> tokenized_queries = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, query, /* add_special */ false, true, ctx_server.params_base.cpuparams_batch.n_threads);
         if (tokenized_queries.size() != 1) {
             res_error(res, format_error_response("\"query\" must contain only a single prompt", ERROR_TYPE_INVALID_REQUEST));
         }
@@ -4939,7 +5288,7 @@ int main(int argc, char ** argv) {
         std::unordered_set<int> task_ids;
         {
             std::vector<server_task> tasks;
-            auto tokenized_docs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, documents, /* add_special */ false, true);
+            auto tokenized_docs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, documents, /* add_special */ false, true, ctx_server.params_base.cpuparams_batch.n_threads);
             tasks.reserve(tokenized_docs.size());
             for (size_t i = 0; i < tokenized_docs.size(); i++) {
                 auto tmp = format_rerank(ctx_server.vocab, tokenized_queries[0], tokenized_docs[i]);
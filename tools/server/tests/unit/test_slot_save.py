@@ -96,3 +96,36 @@ def test_slot_erase():
     assert res.status_code == 200
     assert match_regex("(Whiskers|Flana)+", res.body["content"])
     assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+
+def test_slot_save_same_file():
+    global server
+    server.start()
+
+    for id_slot, prompt in enumerate(["What is the capital of France?", "Once upon a time, in a land far away"]):
+        res = server.make_request("POST", "/completion", data={
+            "prompt": prompt,
+            "id_slot": id_slot,
+            "cache_prompt": True,
+        })
+        assert res.status_code == 200
+
+    # the saves run in the background - two saves to the same file must not write it at the same time
+    tasks = []
+    for _ in range(4):
+        for id_slot in range(2):
+            tasks.append((server.make_request, ("POST", f"/slots/{id_slot}?action=save", {"filename": "slot_same.bin"})))
+    results = parallel_function_calls(tasks)
+
+    n_saved = set()
+    for res in results:
+        assert res.status_code == 200
+        n_saved.add(res.body["n_saved"])
+    assert len(n_saved) == 2
+
+    # the file holds one of the two states, whole
+    res = server.make_request("POST", "/slots/0?action=restore", data={
+        "filename": "slot_same.bin",
+    })
+    assert res.status_code == 200
+    assert res.body["n_restored"] in n_saved
@@ -0,0 +1,107 @@
+import os
+import signal
+import time
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+SWAP_PATH = "./tmp/slot-swap"
+
+PROMPT_A = "The quick brown fox jumps over the lazy dog and then runs far away into the deep dark forest where nobody can find it"
+PROMPT_B = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua"
+
+
+def swap_files():
+    return [f for f in os.listdir(SWAP_PATH) if f.startswith("slot-swap-")]
+
+
+def wait_swap_files(n: int, timeout: float = 10.0, old: list[str] | None = None):
+    # the files are written and removed in the background, after the request has returned
+    t_end = time.time() + timeout
+    while time.time() < t_end:
+        files = swap_files()
+        if len(files) == n and not any(f in (old or []) for f in files):
+            break
+        time.sleep(0.05)
+    return swap_files()
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.slot_swap_path = SWAP_PATH
+    server.temperature = 0.0
+    os.makedirs(SWAP_PATH, exist_ok=True)
+    for f in swap_files():
+        os.remove(os.path.join(SWAP_PATH, f))
+
+
+def complete(prompt: str, cache_prompt: bool = True):
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+        "cache_prompt": cache_prompt,
+    })
+    assert res.status_code == 200
+    return res.body
+
+
+def test_slot_swap_out_in():
+    global server
+    server.start()
+
+    res_a = complete(PROMPT_A)
+    n_a = res_a["timings"]["prompt_n"]
+    assert swap_files() == []
+
+    # an unrelated prompt swaps the cache of the slot out to a file
+    complete(PROMPT_B)
+    files = wait_swap_files(1)
+    assert len(files) == 1
+
+    # continuing the first prompt swaps its cache back in, so only the new suffix is processed
+    res = complete(PROMPT_A + " again")
+    assert res["timings"]["prompt_n"] < n_a
+    assert res["tokens_evaluated"] > n_a
+
+    # the swapped in file is removed, and the cache of the second prompt is swapped out in its place
+    files_new = wait_swap_files(1, old=files)
+    assert len(files_new) == 1 and files_new != files
+
+    # the files are removed when the server exits
+    if os.name != "nt":
+        assert server.process is not None
+        server.process.send_signal(signal.SIGINT)
+        server.process.wait(timeout=30)
+        assert swap_files() == []
+
+
+def test_slot_swap_budget():
+    global server
+    server.slot_swap_size = 0
+    server.start()
+
+    res_a = complete(PROMPT_A)
+    n_a = res_a["timings"]["prompt_n"]
+
+    # the cache does not fit in the budget, so it is not swapped out
+    complete(PROMPT_B)
+    assert wait_swap_files(1, timeout=1.0) == []
+
+    # so the first prompt has to be processed again
+    res = complete(PROMPT_A + " again")
+    assert res["timings"]["prompt_n"] >= n_a
+
+
+def test_slot_swap_no_cache_prompt():
+    global server
+    server.start()
+
+    complete(PROMPT_A)
+
+    # a task that does not cache its prompt does not swap the cache out
+    complete(PROMPT_B, cache_prompt=False)
+    assert wait_swap_files(1, timeout=1.0) == []
@@ -61,6 +61,8 @@ class ServerProcess:
     n_predict: int | None = None
     n_prompts: int | None = 0
     slot_save_path: str | None = None
+    slot_swap_path: str | None = None
+    slot_swap_size: int | None = None
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
@@ -168,6 +170,10 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.slot_swap_path:
+            server_args.extend(["--slot-swap-path", self.slot_swap_path])
+        if self.slot_swap_size is not None:
+            server_args.extend(["--slot-swap-size", self.slot_swap_size])
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
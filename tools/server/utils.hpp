@@ -162,8 +162,9 @@ static json json_get_nested_values(const std::vector<std::string> & paths, const
  * this handles 2 cases:
  * - only string, example: "string"
  * - mixed string and tokens, example: [12, 34, "string", 56, 78]
+ * long strings are tokenized on up to n_threads threads
  */
-static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special) {
+static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_prompt, bool add_special, bool parse_special, int32_t n_threads = 1) {
     // If `add_bos` is true, we only add BOS, when json_prompt is a string,
     // or the first element of the json_prompt array is a string.
     llama_tokens prompt_tokens;
@@ -176,10 +177,10 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
 
                 llama_tokens p;
                 if (first) {
-                    p = common_tokenize(vocab, s, add_special, parse_special);
+                    p = common_tokenize(vocab, s, add_special, parse_special, n_threads);
                     first = false;
                 } else {
-                    p = common_tokenize(vocab, s, false, parse_special);
+                    p = common_tokenize(vocab, s, false, parse_special, n_threads);
                 }
 
                 prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
@@ -193,7 +194,7 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
         }
     } else {
         auto s = json_prompt.template get<std::string>();
-        prompt_tokens = common_tokenize(vocab, s, add_special, parse_special);
+        prompt_tokens = common_tokenize(vocab, s, add_special, parse_special, n_threads);
     }
 
     return prompt_tokens;
@@ -1388,13 +1389,13 @@ static server_tokens process_mtmd_prompt(mtmd_context * mctx, std::string prompt
  * - "prompt": [12, 34, "string", 56, 78]
  * - "prompt": { "prompt_string": "string", "multimodal_data": [ "base64" ] }
  */
-static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special) {
+static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special, int32_t n_threads = 1) {
     constexpr char JSON_STRING_PROMPT_KEY[] = "prompt_string";
     constexpr char JSON_MTMD_DATA_KEY[] = "multimodal_data";
     const bool has_mtmd = mctx != nullptr;
     if (json_prompt.is_string() || json_is_array_of_mixed_numbers_strings(json_prompt)) {
         // string or mixed
-        llama_tokens tmp = tokenize_mixed(vocab, json_prompt, add_special, parse_special);
+        llama_tokens tmp = tokenize_mixed(vocab, json_prompt, add_special, parse_special, n_threads);
         return server_tokens(tmp, false);
     } else if (json_is_array_of_numbers(json_prompt)) {
         // array of tokens
@@ -1414,7 +1415,7 @@ static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_co
             return process_mtmd_prompt(mctx, json_prompt.at(JSON_STRING_PROMPT_KEY), files);
         } else {
             // Not multimodal, but contains a subobject.
-            llama_tokens tmp = tokenize_mixed(vocab, json_prompt.at(JSON_STRING_PROMPT_KEY), add_special, parse_special);
+            llama_tokens tmp = tokenize_mixed(vocab, json_prompt.at(JSON_STRING_PROMPT_KEY), add_special, parse_special, n_threads);
             return server_tokens(tmp, false);
         }
    } else {
@@ -1435,15 +1436,15 @@ static server_tokens tokenize_input_subprompt(const llama_vocab * vocab, mtmd_co
  * - "prompt": [[12, 34, 56], [78, 90, 12]]
  * - "prompt": [[12, 34, "string", 56, 78], [12, 34, 56], { "prompt_string": "string", "multimodal_data": [ "base64" ]}]
  */
-static std::vector<server_tokens> tokenize_input_prompts(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special) {
+static std::vector<server_tokens> tokenize_input_prompts(const llama_vocab * vocab, mtmd_context * mctx, const json & json_prompt, bool add_special, bool parse_special, int32_t n_threads = 1) {
     std::vector<server_tokens> result;
     if (json_prompt.is_array() && !json_is_array_and_contains_numbers(json_prompt)) {
         result.reserve(json_prompt.size());
         for (const auto & p : json_prompt) {
-            result.push_back(tokenize_input_subprompt(vocab, mctx, p,add_special, parse_special));
+            result.push_back(tokenize_input_subprompt(vocab, mctx, p,add_special, parse_special, n_threads));
         }
     } else {
-        result.push_back(tokenize_input_subprompt(vocab, mctx, json_prompt, add_special, parse_special));
+        result.push_back(tokenize_input_subprompt(vocab, mctx, json_prompt, add_special, parse_special, n_threads));
     }
     if (result.empty()) {
         throw std::runtime_error("\"prompt\" must not be empty");
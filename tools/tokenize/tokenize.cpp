@@ -2,6 +2,7 @@
 //#include "log.h" // TODO: start using log.h
 #include "llama.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
@@ -35,6 +36,9 @@ static void print_usage_information(const char * argv0) {
     printf("    --no-parse-special                   do not parse control tokens.\n");
     printf("    --log-disable                        disable logs. Makes stderr quiet when loading the model.\n");
     printf("    --show-count                         print the total number of tokens.\n");
+    printf("    --bench N                            tokenize the prompt N times and print the throughput instead of the tokens.\n");
+    printf("                                         The first run starts with cold caches.\n");
+    printf("    -t N, --threads N                    number of threads to tokenize long prompts with (default: 1).\n");
 }
 
 static void llama_log_callback_null(ggml_log_level level, const char * text, void * user_data) {
@@ -203,6 +207,8 @@ int main(int raw_argc, char ** raw_argv) {
     bool no_parse_special = false;
     bool disable_logging = false;
     bool show_token_count = false;
+    int n_bench = 0;
+    int n_threads = 1;
     const char * model_path = NULL;
     const char * prompt_path = NULL;
     const char * prompt_arg = NULL;
@@ -266,6 +272,28 @@ int main(int raw_argc, char ** raw_argv) {
         else if (arg == "--show-count") {
             show_token_count = true;
         }
+        else if (arg == "--bench") {
+            if (iarg + 1 >= argc) {
+                fprintf(stderr, "Error: --bench requires an argument.\n");
+                return 1;
+            }
+            n_bench = std::stoi(argv[++iarg]);
+            if (n_bench <= 0) {
+                fprintf(stderr, "Error: --bench requires a positive number of runs.\n");
+                return 1;
+            }
+        }
+        else if (arg == "-t" || arg == "--threads") {
+            if (iarg + 1 >= argc) {
+                fprintf(stderr, "Error: --threads requires an argument.\n");
+                return 1;
+            }
+            n_threads = std::stoi(argv[++iarg]);
+            if (n_threads <= 0) {
+                fprintf(stderr, "Error: --threads requires a positive number of threads.\n");
+                return 1;
+            }
+        }
         else {
             fprintf(stderr, "Error: unknown option '%s'\n", argv[iarg].c_str());
             return 1;
@@ -377,7 +405,26 @@ int main(int raw_argc, char ** raw_argv) {
     }
 
     std::vector<llama_token> tokens;
-    tokens = common_tokenize(vocab, prompt, add_bos, parse_special);
+
+    if (n_bench > 0) {
+        for (int i = 0; i < n_bench; ++i) {
+            const int64_t t_start_us = llama_time_us();
+            tokens = common_tokenize(vocab, prompt, add_bos, parse_special, n_threads);
+            const int64_t t_end_us = llama_time_us();
+
+            const double t_s = std::max<int64_t>(t_end_us - t_start_us, 1) / 1e6;
+
+            printf("run %d: %zu bytes -> %zu tokens on %d threads in %.3f ms, %.2f MB/s, %.0f tokens/s\n", i + 1,
+                    prompt.size(), tokens.size(), n_threads, t_s*1e3, prompt.size()/t_s/1e6, tokens.size()/t_s);
+        }
+
+        llama_free(ctx);
+        llama_model_free(model);
+
+        return 0;
+    }
+
+    tokens = common_tokenize(vocab, prompt, add_bos, parse_special, n_threads);
 
     if (printing_ids) {
         printf("[");